@@ -22,25 +22,28 @@
 # Android.mk for hwdrm
 
 # Setting LOCAL_PATH will mess up all-subdir-makefiles, so do it beforehand.
-SUBDIR_MAKEFILES := $(call all-named-subdir-makefiles,modules)
+SUBDIR_MAKEFILES := $(call all-named-subdir-makefiles,modules bench)
 
 # Since this is a directory insight omap, we'll fix the GPU here
 BOARD_GPU_DRIVERS := omapdrm
 
-DRM_GPU_DRIVERS := $(strip $(filter-out swrast, $(BOARD_GPU_DRIVERS)))
+DRM_GPU_DRIVERS := $(strip $(BOARD_GPU_DRIVERS))
 
 intel_drivers := i915 i965 i915g
 radeon_drivers := r300g r600g
 nouveau_drivers := nouveau
 vmwgfx_drivers := vmwgfx
 omap_drivers := omapdrm
+# no GPU; every KMS device is driven with dumb buffers
+dumb_drivers := swrast dumb
 
 valid_drivers := \
 	$(intel_drivers) \
 	$(radeon_drivers) \
 	$(nouveau_drivers) \
 	$(vmwgfx_drivers) \
-	$(omap_drivers)
+	$(omap_drivers) \
+	$(dumb_drivers)
 
 # warn about invalid drivers
 invalid_drivers := $(filter-out $(valid_drivers), $(DRM_GPU_DRIVERS))
@@ -64,7 +67,11 @@ include $(CLEAR_VARS)
 
 LOCAL_SRC_FILES := \
 	gralloc_drm.c \
-	gralloc_drm_kms.c
+	gralloc_drm_kms.c \
+	gralloc_drm_format.c \
+	gralloc_drm_blit.c \
+	gralloc_drm_trace.c \
+	gralloc_drm_dumb.c
 
 LOCAL_C_INCLUDES := \
 	$(LOCAL_PATH)/../libdrm \
@@ -75,6 +82,9 @@ LOCAL_SHARED_LIBRARIES := \
 	liblog \
 	libcutils
 
+# the fallback for devices none of the drivers below supports
+LOCAL_CFLAGS += -DENABLE_DUMB
+
 ifneq ($(filter $(intel_drivers), $(DRM_GPU_DRIVERS)),)
 LOCAL_SRC_FILES += gralloc_drm_intel.c
 LOCAL_C_INCLUDES += external/drm/intel
@@ -132,7 +142,17 @@ LOCAL_STATIC_LIBRARIES += \
 LOCAL_SHARED_LIBRARIES += libdl
 endif # DRM_USES_PIPE
 
-LOCAL_CFLAGS += -Wall -Wno-unused-parameter -O0 -g
+# backends loaded at runtime, see GRALLOC_DRM_PLUGIN_DIR
+ifeq ($(strip $(DRM_GRALLOC_PLUGINS)),true)
+LOCAL_CFLAGS += -DENABLE_PLUGINS
+LOCAL_SHARED_LIBRARIES += libdl
+endif
+
+ifneq ($(strip $(DRM_GRALLOC_TRACE)),false)
+LOCAL_CFLAGS += -DENABLE_TRACE
+endif
+
+LOCAL_CFLAGS += -Wall -Wno-unused-parameter -O2 -g
 
 LOCAL_MODULE := libhwdrm
 LOCAL_MODULE_TAGS := optional
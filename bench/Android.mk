@@ -0,0 +1,103 @@
+# Host build of the gralloc core with a stand-in DRM device, for
+# microbenchmarks of the hot paths:
+#
+#   mmm hardware/ti/omap4xxx/libdrm-kms/gralloc/bench
+#   gralloc_drm_bench -i 5 -t 4
+#
+# Outside of AOSP, the Makefile next to this file builds the same programs.
+
+LOCAL_PATH := $(call my-dir)
+
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := \
+	../gralloc_drm.c \
+	../gralloc_drm_kms.c \
+	../gralloc_drm_format.c \
+	../gralloc_drm_blit.c \
+	../gralloc_drm_trace.c \
+	bench_drm.c \
+	bench_drv.c \
+	gralloc_drm_bench.c
+
+LOCAL_C_INCLUDES := \
+	$(LOCAL_PATH)/.. \
+	$(LOCAL_PATH)/../../libdrm \
+	$(LOCAL_PATH)/../../libdrm/include/drm
+
+LOCAL_CFLAGS := \
+	-DENABLE_BENCH \
+	-DENABLE_TRACE \
+	-DGRALLOC_DRM_DEVICE=\"/dev/null\" \
+	-Wall -Wno-unused-parameter -O2 -g
+
+LOCAL_STATIC_LIBRARIES := \
+	libcutils \
+	liblog
+
+LOCAL_LDLIBS := -lpthread -lrt
+
+LOCAL_MODULE := gralloc_drm_bench
+LOCAL_MODULE_TAGS := optional
+
+include $(BUILD_HOST_EXECUTABLE)
+
+include $(CLEAR_VARS)
+
+# checks of the format layouts:
+#
+#   gralloc_drm_format_test
+
+LOCAL_SRC_FILES := \
+	../gralloc_drm_format.c \
+	format_test.c
+
+LOCAL_C_INCLUDES := \
+	$(LOCAL_PATH)/.. \
+	$(LOCAL_PATH)/../../libdrm \
+	$(LOCAL_PATH)/../../libdrm/include/drm
+
+LOCAL_CFLAGS := -Wall -Wno-unused-parameter -O2 -g
+
+LOCAL_MODULE := gralloc_drm_format_test
+LOCAL_MODULE_TAGS := optional
+
+include $(BUILD_HOST_EXECUTABLE)
+
+include $(CLEAR_VARS)
+
+# checks of the SW lock upgrades:
+#
+#   gralloc_drm_lock_test
+
+LOCAL_SRC_FILES := \
+	../gralloc_drm.c \
+	../gralloc_drm_kms.c \
+	../gralloc_drm_format.c \
+	../gralloc_drm_blit.c \
+	../gralloc_drm_trace.c \
+	bench_drm.c \
+	bench_drv.c \
+	lock_test.c
+
+LOCAL_C_INCLUDES := \
+	$(LOCAL_PATH)/.. \
+	$(LOCAL_PATH)/../../libdrm \
+	$(LOCAL_PATH)/../../libdrm/include/drm
+
+LOCAL_CFLAGS := \
+	-DENABLE_BENCH \
+	-DENABLE_TRACE \
+	-DGRALLOC_DRM_DEVICE=\"/dev/null\" \
+	-Wall -Wno-unused-parameter -O2 -g
+
+LOCAL_STATIC_LIBRARIES := \
+	libcutils \
+	liblog
+
+LOCAL_LDLIBS := -lpthread -lrt
+
+LOCAL_MODULE := gralloc_drm_lock_test
+LOCAL_MODULE_TAGS := optional
+
+include $(BUILD_HOST_EXECUTABLE)
@@ -0,0 +1,51 @@
+/*
+ * Copyright (C) 2010-2011 Chia-I Wu <olvaffe@gmail.com>
+ * Copyright (C) 2010-2011 LunarG Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef _BENCH_H_
+#define _BENCH_H_
+
+#include <stdint.h>
+
+/*
+ * The stand-in DRM device.  Every ioctl that would reach the kernel takes
+ * bench_ioctl_ns, and a page flip completes bench_vblank_ns after it is
+ * scheduled.
+ */
+extern int64_t bench_ioctl_ns;
+extern int64_t bench_vblank_ns;
+
+int64_t bench_get_time_ns(void);
+void bench_delay(int64_t ns);
+
+static inline void bench_ioctl(void)
+{
+	if (bench_ioctl_ns)
+		bench_delay(bench_ioctl_ns);
+}
+
+/* the storage behind GEM handles and names of the stand-in driver */
+void *bench_object_new(unsigned long size, uint32_t *handle, uint32_t *name);
+void *bench_object_open(uint32_t name, uint32_t *handle, unsigned long *size);
+void bench_object_close(uint32_t handle);
+
+#endif /* _BENCH_H_ */
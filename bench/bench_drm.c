@@ -0,0 +1,520 @@
+/*
+ * Copyright (C) 2010-2011 Chia-I Wu <olvaffe@gmail.com>
+ * Copyright (C) 2010-2011 LunarG Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * A stand-in for libdrm and the kernel: the libdrm calls made by the gralloc
+ * core are answered in process, after a configurable delay.  There is one
+ * connected 1920x1080 output.
+ */
+
+#define LOG_TAG "HWDRM-BENCH"
+
+#include <cutils/log.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+
+#include "bench.h"
+
+#define BENCH_MAX_OBJECTS 4096
+
+#define BENCH_CRTC_ID 1
+#define BENCH_CONNECTOR_ID 2
+#define BENCH_ENCODER_ID 3
+
+int64_t bench_ioctl_ns;
+int64_t bench_vblank_ns;
+
+struct bench_object {
+	void *ptr;
+	unsigned long size;
+	int refcount;
+	int next_free;
+};
+
+static struct {
+	pthread_mutex_t mutex;
+	struct bench_object objects[BENCH_MAX_OBJECTS];
+	int free_head;
+	int count;
+
+	uint32_t fb_ids;
+	void *flip_data;
+	int64_t flip_time;
+	unsigned int vblank_seq;
+} bench = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+	.free_head = -1,
+};
+
+int64_t bench_get_time_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Wait for ns nanoseconds.  Short delays spin, as sleeping would take much
+ * longer than asked.
+ */
+void bench_delay(int64_t ns)
+{
+	int64_t end = bench_get_time_ns() + ns;
+
+	if (ns >= 1000000) {
+		struct timespec ts;
+
+		ts.tv_sec = ns / 1000000000;
+		ts.tv_nsec = ns % 1000000000;
+		nanosleep(&ts, NULL);
+		return;
+	}
+
+	while (bench_get_time_ns() < end)
+		;
+}
+
+/*
+ * Allocate an object.  Handles double as names, and index the table from 1.
+ */
+void *bench_object_new(unsigned long size, uint32_t *handle, uint32_t *name)
+{
+	struct bench_object *obj;
+	int index;
+	void *ptr;
+
+	bench_ioctl();
+
+	ptr = calloc(1, size);
+	if (!ptr)
+		return NULL;
+
+	pthread_mutex_lock(&bench.mutex);
+	if (bench.free_head >= 0) {
+		index = bench.free_head;
+		bench.free_head = bench.objects[index].next_free;
+	}
+	else if (bench.count < BENCH_MAX_OBJECTS) {
+		index = bench.count++;
+	}
+	else {
+		pthread_mutex_unlock(&bench.mutex);
+		free(ptr);
+		return NULL;
+	}
+
+	obj = &bench.objects[index];
+	obj->ptr = ptr;
+	obj->size = size;
+	obj->refcount = 1;
+	pthread_mutex_unlock(&bench.mutex);
+
+	*handle = index + 1;
+	*name = index + 1;
+
+	return ptr;
+}
+
+void *bench_object_open(uint32_t name, uint32_t *handle, unsigned long *size)
+{
+	struct bench_object *obj;
+	void *ptr = NULL;
+
+	bench_ioctl();
+
+	pthread_mutex_lock(&bench.mutex);
+	if (name > 0 && name <= (uint32_t) bench.count) {
+		obj = &bench.objects[name - 1];
+		if (obj->refcount) {
+			obj->refcount++;
+			ptr = obj->ptr;
+			*size = obj->size;
+			*handle = name;
+		}
+	}
+	pthread_mutex_unlock(&bench.mutex);
+
+	return ptr;
+}
+
+void bench_object_close(uint32_t handle)
+{
+	struct bench_object *obj = &bench.objects[handle - 1];
+	void *ptr = NULL;
+
+	bench_ioctl();
+
+	pthread_mutex_lock(&bench.mutex);
+	if (!--obj->refcount) {
+		ptr = obj->ptr;
+		obj->ptr = NULL;
+		obj->next_free = bench.free_head;
+		bench.free_head = handle - 1;
+	}
+	pthread_mutex_unlock(&bench.mutex);
+
+	free(ptr);
+}
+
+drmVersionPtr drmGetVersion(int fd)
+{
+	drmVersionPtr version;
+
+	bench_ioctl();
+
+	version = calloc(1, sizeof(*version));
+	if (version) {
+		version->name = strdup("bench");
+		version->name_len = strlen("bench");
+	}
+
+	return version;
+}
+
+void drmFreeVersion(drmVersionPtr version)
+{
+	if (version) {
+		free(version->name);
+		free(version);
+	}
+}
+
+int drmGetCap(int fd, uint64_t capability, uint64_t *value)
+{
+	bench_ioctl();
+
+	return -EINVAL;
+}
+
+int drmGetMagic(int fd, drm_magic_t *magic)
+{
+	bench_ioctl();
+	*magic = 1;
+
+	return 0;
+}
+
+int drmAuthMagic(int fd, drm_magic_t magic)
+{
+	bench_ioctl();
+
+	return 0;
+}
+
+int drmSetMaster(int fd)
+{
+	bench_ioctl();
+
+	return 0;
+}
+
+int drmDropMaster(int fd)
+{
+	bench_ioctl();
+
+	return 0;
+}
+
+int drmPrimeHandleToFD(int fd, uint32_t handle, uint32_t flags, int *prime_fd)
+{
+	bench_ioctl();
+
+	return -ENOSYS;
+}
+
+int drmPrimeFDToHandle(int fd, int prime_fd, uint32_t *handle)
+{
+	bench_ioctl();
+
+	return -ENOSYS;
+}
+
+int drmIoctl(int fd, unsigned long request, void *arg)
+{
+	bench_ioctl();
+
+	return 0;
+}
+
+/*
+ * Wait for a vblank.  Without a vblank period, every absolute wait returns
+ * at once with the requested sequence.
+ */
+int drmWaitVBlank(int fd, drmVBlankPtr vbl)
+{
+	unsigned int current, target = vbl->request.sequence;
+	int relative = (vbl->request.type & DRM_VBLANK_RELATIVE);
+
+	bench_ioctl();
+
+	if (bench_vblank_ns) {
+		current = bench_get_time_ns() / bench_vblank_ns;
+		if (relative)
+			target += current;
+		if ((int) (target - current) > 0)
+			bench_delay((int64_t) (target - current) *
+					bench_vblank_ns);
+	}
+	else {
+		pthread_mutex_lock(&bench.mutex);
+		current = bench.vblank_seq;
+		if (relative)
+			target += current;
+		if ((int) (target - current) > 0)
+			bench.vblank_seq = target;
+		pthread_mutex_unlock(&bench.mutex);
+	}
+
+	vbl->reply.sequence = target;
+
+	return 0;
+}
+
+/*
+ * Deliver the pending page flip event, waiting for its vblank.
+ */
+int drmHandleEvent(int fd, drmEventContextPtr evctx)
+{
+	void *data;
+	int64_t wait;
+
+	pthread_mutex_lock(&bench.mutex);
+	data = bench.flip_data;
+	wait = bench.flip_time - bench_get_time_ns();
+	bench.flip_data = NULL;
+	pthread_mutex_unlock(&bench.mutex);
+
+	if (!data)
+		return 0;
+
+	if (wait > 0)
+		bench_delay(wait);
+	bench_ioctl();
+
+	if (evctx->page_flip_handler)
+		evctx->page_flip_handler(fd, 0, 0, 0, data);
+
+	return 0;
+}
+
+drmModeResPtr drmModeGetResources(int fd)
+{
+	static uint32_t crtcs[] = { BENCH_CRTC_ID };
+	static uint32_t connectors[] = { BENCH_CONNECTOR_ID };
+	static uint32_t encoders[] = { BENCH_ENCODER_ID };
+	drmModeResPtr res;
+
+	bench_ioctl();
+
+	res = calloc(1, sizeof(*res));
+	if (res) {
+		res->count_crtcs = 1;
+		res->crtcs = crtcs;
+		res->count_connectors = 1;
+		res->connectors = connectors;
+		res->count_encoders = 1;
+		res->encoders = encoders;
+		res->max_width = 8192;
+		res->max_height = 8192;
+	}
+
+	return res;
+}
+
+void drmModeFreeResources(drmModeResPtr res)
+{
+	free(res);
+}
+
+drmModeConnectorPtr drmModeGetConnector(int fd, uint32_t connector_id)
+{
+	static uint32_t encoders[] = { BENCH_ENCODER_ID };
+	static drmModeModeInfo mode = {
+		.clock = 148500,
+		.hdisplay = 1920,
+		.hsync_start = 2008,
+		.hsync_end = 2052,
+		.htotal = 2200,
+		.vdisplay = 1080,
+		.vsync_start = 1084,
+		.vsync_end = 1089,
+		.vtotal = 1125,
+		.vrefresh = 60,
+		.type = DRM_MODE_TYPE_PREFERRED,
+		.name = "1920x1080",
+	};
+	drmModeConnectorPtr connector;
+
+	bench_ioctl();
+
+	if (connector_id != BENCH_CONNECTOR_ID)
+		return NULL;
+
+	connector = calloc(1, sizeof(*connector));
+	if (connector) {
+		connector->connector_id = connector_id;
+		connector->encoder_id = BENCH_ENCODER_ID;
+		connector->connection = DRM_MODE_CONNECTED;
+		connector->mmWidth = 510;
+		connector->mmHeight = 290;
+		connector->count_modes = 1;
+		connector->modes = &mode;
+		connector->count_encoders = 1;
+		connector->encoders = encoders;
+	}
+
+	return connector;
+}
+
+void drmModeFreeConnector(drmModeConnectorPtr connector)
+{
+	free(connector);
+}
+
+drmModeEncoderPtr drmModeGetEncoder(int fd, uint32_t encoder_id)
+{
+	drmModeEncoderPtr encoder;
+
+	bench_ioctl();
+
+	if (encoder_id != BENCH_ENCODER_ID)
+		return NULL;
+
+	encoder = calloc(1, sizeof(*encoder));
+	if (encoder) {
+		encoder->encoder_id = encoder_id;
+		encoder->crtc_id = BENCH_CRTC_ID;
+		encoder->possible_crtcs = 1;
+	}
+
+	return encoder;
+}
+
+void drmModeFreeEncoder(drmModeEncoderPtr encoder)
+{
+	free(encoder);
+}
+
+drmModePlaneResPtr drmModeGetPlaneResources(int fd)
+{
+	bench_ioctl();
+
+	return calloc(1, sizeof(drmModePlaneRes));
+}
+
+void drmModeFreePlaneResources(drmModePlaneResPtr res)
+{
+	free(res);
+}
+
+drmModePlanePtr drmModeGetPlane(int fd, uint32_t plane_id)
+{
+	bench_ioctl();
+
+	return NULL;
+}
+
+void drmModeFreePlane(drmModePlanePtr plane)
+{
+	free(plane);
+}
+
+int drmModeAddFB(int fd, uint32_t width, uint32_t height, uint8_t depth,
+		uint8_t bpp, uint32_t pitch, uint32_t bo_handle,
+		uint32_t *buf_id)
+{
+	bench_ioctl();
+
+	pthread_mutex_lock(&bench.mutex);
+	*buf_id = ++bench.fb_ids;
+	pthread_mutex_unlock(&bench.mutex);
+
+	return 0;
+}
+
+int drmModeAddFB2(int fd, uint32_t width, uint32_t height,
+		uint32_t pixel_format, const uint32_t bo_handles[4],
+		const uint32_t pitches[4], const uint32_t offsets[4],
+		uint32_t *buf_id, uint32_t flags)
+{
+	return drmModeAddFB(fd, width, height, 0, 0, pitches[0],
+			bo_handles[0], buf_id);
+}
+
+int drmModeRmFB(int fd, uint32_t buffer_id)
+{
+	bench_ioctl();
+
+	return 0;
+}
+
+int drmModeDirtyFB(int fd, uint32_t buffer_id, drmModeClipPtr clips,
+		uint32_t num_clips)
+{
+	bench_ioctl();
+
+	return 0;
+}
+
+int drmModeSetCrtc(int fd, uint32_t crtc_id, uint32_t buffer_id,
+		uint32_t x, uint32_t y, uint32_t *connectors, int count,
+		drmModeModeInfoPtr mode)
+{
+	bench_ioctl();
+
+	return 0;
+}
+
+/*
+ * Schedule a page flip, which completes at the next vblank.
+ */
+int drmModePageFlip(int fd, uint32_t crtc_id, uint32_t fb_id,
+		uint32_t flags, void *user_data)
+{
+	int64_t now;
+	int ret = 0;
+
+	bench_ioctl();
+
+	now = bench_get_time_ns();
+
+	pthread_mutex_lock(&bench.mutex);
+	if (bench.flip_data) {
+		ret = -EBUSY;
+	}
+	else {
+		bench.flip_data = user_data;
+		bench.flip_time = (bench_vblank_ns) ?
+			(now / bench_vblank_ns + 1) * bench_vblank_ns : now;
+	}
+	pthread_mutex_unlock(&bench.mutex);
+
+	return ret;
+}
@@ -0,0 +1,188 @@
+/*
+ * Copyright (C) 2010-2011 Chia-I Wu <olvaffe@gmail.com>
+ * Copyright (C) 2010-2011 LunarG Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * The driver of the stand-in DRM device.  Buffers are linear and live in
+ * host memory; every driver call that would be an ioctl is delayed the same
+ * as one.
+ */
+
+#define LOG_TAG "HWDRM-BENCH"
+
+#include <cutils/log.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "gralloc_drm.h"
+#include "gralloc_drm_priv.h"
+#include "bench.h"
+
+struct bench_info {
+	struct gralloc_drm_drv_t base;
+	int fd;
+};
+
+struct bench_buffer {
+	struct gralloc_drm_bo_t base;
+	void *ptr;
+};
+
+static int bench_alloc(struct gralloc_drm_drv_t *drv,
+		struct gralloc_drm_handle_t *handle,
+		struct gralloc_drm_bo_t *bo)
+{
+	struct bench_buffer *buf = (struct bench_buffer *) bo;
+	uint32_t gem_handle, name;
+	unsigned long size;
+
+	if (handle->name) {
+		buf->ptr = bench_object_open(handle->name, &gem_handle, &size);
+		if (!buf->ptr) {
+			LOGE("failed to open bo %u", handle->name);
+			return -EINVAL;
+		}
+	}
+	else {
+		int width = handle->width, height = handle->height;
+		int cpp = gralloc_drm_get_bpp(handle->format);
+
+		if (!cpp) {
+			LOGE("unrecognized format 0x%x", handle->format);
+			return -EINVAL;
+		}
+
+		gralloc_drm_align_geometry(handle->format, &width, &height);
+		handle->stride = ALIGN(width * cpp, 64);
+		size = (unsigned long) handle->stride * height;
+
+		buf->ptr = bench_object_new(size, &gem_handle, &name);
+		if (!buf->ptr)
+			return -ENOMEM;
+
+		handle->name = name;
+	}
+
+	buf->base.fb_handle = gem_handle;
+	buf->base.size = size;
+	buf->base.domain = GRALLOC_DRM_DOMAIN_CACHED;
+
+	buf->base.handle = handle;
+
+	return 0;
+}
+
+static void bench_free(struct gralloc_drm_drv_t *drv,
+		struct gralloc_drm_bo_t *bo)
+{
+	bench_object_close(bo->fb_handle);
+}
+
+static int bench_prepare(struct gralloc_drm_drv_t *drv,
+		struct gralloc_drm_bo_t *bo,
+		int x, int y, int w, int h, int enable_write)
+{
+	bench_ioctl();
+
+	return 0;
+}
+
+static int bench_map(struct gralloc_drm_drv_t *drv,
+		struct gralloc_drm_bo_t *bo, int x, int y, int w, int h,
+		int enable_write, void **addr)
+{
+	struct bench_buffer *buf = (struct bench_buffer *) bo;
+
+	/* mmap and the domain change */
+	bench_ioctl();
+	bench_ioctl();
+
+	*addr = buf->ptr;
+
+	return 0;
+}
+
+static void bench_unmap(struct gralloc_drm_drv_t *drv,
+		struct gralloc_drm_bo_t *bo)
+{
+	bench_ioctl();
+}
+
+static int bench_busy(struct gralloc_drm_drv_t *drv,
+		struct gralloc_drm_bo_t *bo, int enable_write)
+{
+	bench_ioctl();
+
+	return 0;
+}
+
+static void bench_init_kms_features(struct gralloc_drm_drv_t *drv,
+		struct gralloc_drm_t *drm)
+{
+	drm->fb_format = HAL_PIXEL_FORMAT_BGRA_8888;
+	drm->swap_mode = DRM_SWAP_FLIP;
+	drm->mode_sync_flip = 1;
+	drm->swap_interval = 1;
+	drm->vblank_secondary = 0;
+}
+
+static void bench_destroy(struct gralloc_drm_drv_t *drv)
+{
+	free(drv);
+}
+
+static struct gralloc_drm_drv_t *bench_drv_create(const struct gralloc_drm_device *dev)
+{
+	struct bench_info *info;
+
+	info = calloc(1, sizeof(*info));
+	if (!info)
+		return NULL;
+
+	info->fd = dev->fd;
+
+	info->base.bo_size = sizeof(struct bench_buffer);
+	info->base.destroy = bench_destroy;
+	info->base.init_kms_features = bench_init_kms_features;
+	info->base.alloc = bench_alloc;
+	info->base.free = bench_free;
+	info->base.map = bench_map;
+	info->base.unmap = bench_unmap;
+	info->base.prepare = bench_prepare;
+	info->base.busy = bench_busy;
+
+	return &info->base;
+}
+
+static int bench_drv_probe(const struct gralloc_drm_device *dev)
+{
+	return (strcmp(dev->name, "bench") == 0) ?
+		GRALLOC_DRM_PROBE_NATIVE : -1;
+}
+
+const struct gralloc_drm_backend gralloc_drm_backend_bench = {
+	.version = GRALLOC_DRM_BACKEND_VERSION,
+	.name = "bench",
+	.probe = bench_drv_probe,
+	.create = bench_drv_create,
+};
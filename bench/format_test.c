@@ -0,0 +1,91 @@
+/*
+ * Copyright (C) 2010-2011 Chia-I Wu <olvaffe@gmail.com>
+ * Copyright (C) 2010-2011 LunarG Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Checks of the format table: the planes of a bo of every format and size
+ * fit in the rows gralloc_drm_align_geometry asks for.
+ *
+ *	gralloc_drm_format_test
+ */
+
+#include <stdio.h>
+
+#include "gralloc_drm.h"
+
+/*
+ * Check one size of a format.  Return the number of failures.
+ */
+static int check_layout(int format, int width, int height)
+{
+	const struct gralloc_drm_format *fmt = gralloc_drm_get_format(format);
+	int offsets[GRALLOC_DRM_MAX_PLANES], pitches[GRALLOC_DRM_MAX_PLANES];
+	int w = width, h = height, stride, count, last, end;
+
+	gralloc_drm_align_geometry(format, &w, &h);
+	stride = ALIGN(w * fmt->planes[0].cpp, 64);
+
+	count = gralloc_drm_format_get_layout(format, height, stride,
+			offsets, pitches);
+	if (count != fmt->plane_count) {
+		printf("format 0x%x: %d planes, expected %d\n",
+				format, count, fmt->plane_count);
+		return 1;
+	}
+
+	last = count - 1;
+	end = offsets[last] + pitches[last] *
+		(ALIGN(height, fmt->align_h) / fmt->planes[last].vsub);
+	if (end > stride * h) {
+		printf("format 0x%x %dx%d: planes end at %d, "
+				"past %d rows of %d bytes\n",
+				format, width, height, end, h, stride);
+		return 1;
+	}
+
+	return 0;
+}
+
+int main(void)
+{
+	/* chroma rows that end in the middle of a luma row */
+	static const int yv12_heights[] = { 6, 90, 270, 1078 };
+	int failures = 0, i;
+
+	for (i = 0; i < (int) (sizeof(yv12_heights) / sizeof(yv12_heights[0])); i++)
+		failures += check_layout(HAL_PIXEL_FORMAT_YV12, 64,
+				yv12_heights[i]);
+
+	for (i = 0; i < GRALLOC_DRM_FORMAT_SLOTS; i++) {
+		int format = gralloc_drm_formats[i].format, h;
+
+		if (!format)
+			continue;
+
+		for (h = 1; h <= 2160; h++)
+			failures += check_layout(format, 1920, h);
+	}
+
+	printf("%s: %d failures\n", (failures) ? "FAIL" : "PASS", failures);
+
+	return (failures) ? 1 : 0;
+}
@@ -0,0 +1,511 @@
+/*
+ * Copyright (C) 2010-2011 Chia-I Wu <olvaffe@gmail.com>
+ * Copyright (C) 2010-2011 LunarG Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Microbenchmarks of the gralloc core against the stand-in DRM device.
+ *
+ *	gralloc_drm_bench [-n iterations] [-t threads] [-i ioctl_us]
+ *			  [-v vblank_us] [-s WxH] [benchmark...]
+ */
+
+#define LOG_TAG "HWDRM-BENCH"
+
+#include <cutils/log.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "gralloc_drm.h"
+#include "gralloc_drm_handle.h"
+#include "bench.h"
+
+#define BENCH_MAX_THREADS 64
+
+#define BENCH_USAGE_TEXTURE \
+	(GRALLOC_USAGE_HW_TEXTURE | GRALLOC_USAGE_HW_RENDER)
+#define BENCH_USAGE_SW \
+	(GRALLOC_USAGE_SW_READ_OFTEN | GRALLOC_USAGE_SW_WRITE_OFTEN)
+
+struct bench_run {
+	struct gralloc_drm_t *drm;
+	int iterations;
+	int threads;
+	int width, height;
+
+	/* shared by the threads of a multi-threaded benchmark */
+	struct gralloc_drm_bo_t *shared_bo;
+	pthread_barrier_t barrier;
+};
+
+struct bench_thread {
+	struct bench_run *run;
+	int64_t *samples;
+	int count;
+};
+
+static int compare_samples(const void *a, const void *b)
+{
+	int64_t x = *(const int64_t *) a, y = *(const int64_t *) b;
+
+	return (x > y) - (x < y);
+}
+
+/*
+ * Print the throughput and the latency percentiles of the samples.
+ */
+static void report(const char *name, int64_t *samples, int count,
+		int64_t elapsed)
+{
+	if (!count) {
+		printf("%-16s failed\n", name);
+		return;
+	}
+
+	qsort(samples, count, sizeof(*samples), compare_samples);
+
+	printf("%-16s %8d %10.0f %9.2f %9.2f %9.2f\n", name, count,
+			(double) count * 1e9 / elapsed,
+			samples[count / 2] / 1e3,
+			samples[(int64_t) count * 99 / 100] / 1e3,
+			samples[count - 1] / 1e3);
+}
+
+static int bench_alloc(struct bench_run *run, int64_t *samples)
+{
+	int i;
+
+	for (i = 0; i < run->iterations; i++) {
+		struct gralloc_drm_bo_t *bo;
+		int64_t start = bench_get_time_ns();
+
+		bo = gralloc_drm_bo_create(run->drm, run->width, run->height,
+				HAL_PIXEL_FORMAT_RGBA_8888,
+				BENCH_USAGE_TEXTURE);
+		if (!bo)
+			break;
+		gralloc_drm_bo_destroy(bo);
+
+		samples[i] = bench_get_time_ns() - start;
+	}
+
+	return i;
+}
+
+/*
+ * Allocate and free buffers of changing sizes, which the bo cache cannot
+ * serve.
+ */
+static int bench_alloc_varied(struct bench_run *run, int64_t *samples)
+{
+	int i;
+
+	for (i = 0; i < run->iterations; i++) {
+		struct gralloc_drm_bo_t *bo;
+		int64_t start = bench_get_time_ns();
+
+		bo = gralloc_drm_bo_create(run->drm,
+				run->width + (i % 64) * 64, run->height,
+				HAL_PIXEL_FORMAT_RGBA_8888,
+				BENCH_USAGE_TEXTURE);
+		if (!bo)
+			break;
+		gralloc_drm_bo_destroy(bo);
+
+		samples[i] = bench_get_time_ns() - start;
+	}
+
+	return i;
+}
+
+/*
+ * Register and unregister a handle as if it came from another process.
+ */
+static int bench_register(struct bench_run *run, int64_t *samples)
+{
+	struct gralloc_drm_bo_t *bo;
+	struct gralloc_drm_handle_t remote;
+	int i;
+
+	bo = gralloc_drm_bo_create(run->drm, run->width, run->height,
+			HAL_PIXEL_FORMAT_RGBA_8888, BENCH_USAGE_TEXTURE);
+	if (!bo)
+		return 0;
+
+	memcpy(&remote, gralloc_drm_bo_get_handle(bo, NULL), sizeof(remote));
+	gralloc_drm_handle_set_prime_fd(&remote, -1);
+
+	for (i = 0; i < run->iterations; i++) {
+		int64_t start = bench_get_time_ns();
+
+		remote.data_owner = 0;
+		remote.data = 0;
+		if (gralloc_drm_handle_register((buffer_handle_t) &remote,
+					run->drm))
+			break;
+		gralloc_drm_handle_unregister((buffer_handle_t) &remote);
+
+		samples[i] = bench_get_time_ns() - start;
+	}
+
+	gralloc_drm_bo_destroy(bo);
+
+	return i;
+}
+
+static int lock_unlock(struct bench_run *run, struct gralloc_drm_bo_t *bo,
+		int usage, int64_t *samples)
+{
+	int i;
+
+	for (i = 0; i < run->iterations; i++) {
+		int64_t start = bench_get_time_ns();
+		void *addr;
+
+		if (gralloc_drm_bo_lock(bo, usage, 0, 0,
+					run->width, run->height, &addr))
+			break;
+		gralloc_drm_bo_unlock(bo);
+
+		samples[i] = bench_get_time_ns() - start;
+	}
+
+	return i;
+}
+
+static int bench_lock(struct bench_run *run, int64_t *samples)
+{
+	struct gralloc_drm_bo_t *bo;
+	int count;
+
+	bo = gralloc_drm_bo_create(run->drm, run->width, run->height,
+			HAL_PIXEL_FORMAT_RGBA_8888, BENCH_USAGE_SW);
+	if (!bo)
+		return 0;
+
+	count = lock_unlock(run, bo, BENCH_USAGE_SW, samples);
+
+	gralloc_drm_bo_destroy(bo);
+
+	return count;
+}
+
+/*
+ * Each thread locks a buffer of its own.
+ */
+static void *lock_private_thread(void *arg)
+{
+	struct bench_thread *t = (struct bench_thread *) arg;
+	struct gralloc_drm_bo_t *bo;
+
+	bo = gralloc_drm_bo_create(t->run->drm, t->run->width, t->run->height,
+			HAL_PIXEL_FORMAT_RGBA_8888, BENCH_USAGE_SW);
+
+	pthread_barrier_wait(&t->run->barrier);
+
+	if (bo) {
+		t->count = lock_unlock(t->run, bo, BENCH_USAGE_SW, t->samples);
+		gralloc_drm_bo_destroy(bo);
+	}
+
+	return NULL;
+}
+
+/*
+ * All threads lock the same buffer for reading.
+ */
+static void *lock_shared_thread(void *arg)
+{
+	struct bench_thread *t = (struct bench_thread *) arg;
+
+	pthread_barrier_wait(&t->run->barrier);
+
+	t->count = lock_unlock(t->run, t->run->shared_bo,
+			GRALLOC_USAGE_SW_READ_OFTEN, t->samples);
+
+	return NULL;
+}
+
+/*
+ * Run a benchmark on all threads, and merge the samples.
+ */
+static int run_threads(struct bench_run *run, void *(*func)(void *),
+		int64_t *samples)
+{
+	struct bench_thread threads[BENCH_MAX_THREADS];
+	pthread_t ids[BENCH_MAX_THREADS];
+	int i, count = 0;
+
+	pthread_barrier_init(&run->barrier, NULL, run->threads);
+
+	for (i = 0; i < run->threads; i++) {
+		threads[i].run = run;
+		threads[i].samples = samples + (int64_t) run->iterations * i;
+		threads[i].count = 0;
+		pthread_create(&ids[i], NULL, func, &threads[i]);
+	}
+
+	for (i = 0; i < run->threads; i++) {
+		pthread_join(ids[i], NULL);
+		memmove(samples + count, threads[i].samples,
+				sizeof(*samples) * threads[i].count);
+		count += threads[i].count;
+	}
+
+	pthread_barrier_destroy(&run->barrier);
+
+	return count;
+}
+
+static int bench_lock_mt(struct bench_run *run, int64_t *samples)
+{
+	return run_threads(run, lock_private_thread, samples);
+}
+
+static int bench_lock_shared(struct bench_run *run, int64_t *samples)
+{
+	int count;
+
+	run->shared_bo = gralloc_drm_bo_create(run->drm, run->width,
+			run->height, HAL_PIXEL_FORMAT_RGBA_8888,
+			BENCH_USAGE_SW);
+	if (!run->shared_bo)
+		return 0;
+
+	count = run_threads(run, lock_shared_thread, samples);
+
+	gralloc_drm_bo_destroy(run->shared_bo);
+	run->shared_bo = NULL;
+
+	return count;
+}
+
+/*
+ * Post two fullscreen buffers in turn.
+ */
+static int bench_post(struct bench_run *run, int64_t *samples)
+{
+	struct gralloc_drm_bo_t *bos[2];
+	int i;
+
+	if (gralloc_drm_init_kms(run->drm))
+		return 0;
+
+	for (i = 0; i < 2; i++) {
+		bos[i] = gralloc_drm_bo_create(run->drm, 1920, 1080,
+				HAL_PIXEL_FORMAT_BGRA_8888,
+				GRALLOC_USAGE_HW_FB | GRALLOC_USAGE_HW_RENDER);
+		if (!bos[i] || gralloc_drm_bo_add_fb(bos[i]))
+			return 0;
+	}
+
+	for (i = 0; i < run->iterations; i++) {
+		int64_t start = bench_get_time_ns();
+
+		if (gralloc_drm_bo_post(bos[i & 1]))
+			break;
+
+		samples[i] = bench_get_time_ns() - start;
+	}
+
+	/* let the last flip complete before the buffers go */
+	gralloc_drm_fini_kms(run->drm);
+	gralloc_drm_bo_destroy(bos[0]);
+	gralloc_drm_bo_destroy(bos[1]);
+
+	return i;
+}
+
+/*
+ * Copy a frame between two buffers in host memory.  The strides are padded
+ * so that the rows are copied one by one.
+ */
+static int blit(struct bench_run *run, int flags, int64_t *samples)
+{
+	int size = run->width * 4, stride = size + 64;
+	char *dst, *src;
+	int i;
+
+	dst = malloc((size_t) stride * run->height);
+	src = malloc((size_t) stride * run->height);
+	if (!dst || !src) {
+		free(dst);
+		free(src);
+		return 0;
+	}
+	memset(src, 0x5a, (size_t) stride * run->height);
+
+	for (i = 0; i < run->iterations; i++) {
+		int64_t start = bench_get_time_ns();
+
+		gralloc_drm_blit(dst, stride, src, stride, size,
+				run->height, flags);
+
+		samples[i] = bench_get_time_ns() - start;
+	}
+
+	free(dst);
+	free(src);
+
+	return i;
+}
+
+static int bench_blit(struct bench_run *run, int64_t *samples)
+{
+	return blit(run, 0, samples);
+}
+
+static int bench_blit_stream(struct bench_run *run, int64_t *samples)
+{
+	return blit(run, GRALLOC_DRM_BLIT_STREAM, samples);
+}
+
+static const struct {
+	const char *name;
+	int (*func)(struct bench_run *run, int64_t *samples);
+	int threaded;
+} benchmarks[] = {
+	{ "alloc",         bench_alloc,        0 },
+	{ "alloc-varied",  bench_alloc_varied, 0 },
+	{ "register",      bench_register,     0 },
+	{ "lock",          bench_lock,         0 },
+	{ "lock-mt",       bench_lock_mt,      1 },
+	{ "lock-shared",   bench_lock_shared,  1 },
+	{ "post",          bench_post,         0 },
+	{ "blit",          bench_blit,         0 },
+	{ "blit-stream",   bench_blit_stream,  0 },
+};
+
+static void usage(const char *prog)
+{
+	unsigned int i;
+
+	fprintf(stderr, "usage: %s [-n iterations] [-t threads] "
+			"[-i ioctl_us] [-v vblank_us] [-s WxH] "
+			"[benchmark...]\nbenchmarks:", prog);
+	for (i = 0; i < sizeof(benchmarks) / sizeof(benchmarks[0]); i++)
+		fprintf(stderr, " %s", benchmarks[i].name);
+	fprintf(stderr, "\n");
+}
+
+static int is_selected(const char *name, char **argv, int argc)
+{
+	int i;
+
+	if (!argc)
+		return 1;
+
+	for (i = 0; i < argc; i++) {
+		if (!strcmp(argv[i], name))
+			return 1;
+	}
+
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	struct bench_run run;
+	int64_t *samples;
+	unsigned int i;
+	int opt;
+
+	memset(&run, 0, sizeof(run));
+	run.iterations = 10000;
+	run.threads = 4;
+	run.width = 1280;
+	run.height = 720;
+	bench_ioctl_ns = 2000;
+
+	while ((opt = getopt(argc, argv, "n:t:i:v:s:")) != -1) {
+		switch (opt) {
+		case 'n':
+			run.iterations = atoi(optarg);
+			break;
+		case 't':
+			run.threads = atoi(optarg);
+			break;
+		case 'i':
+			bench_ioctl_ns = atol(optarg) * 1000;
+			break;
+		case 'v':
+			bench_vblank_ns = atol(optarg) * 1000;
+			break;
+		case 's':
+			if (sscanf(optarg, "%dx%d", &run.width,
+						&run.height) != 2) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (run.iterations <= 0 || run.threads <= 0 ||
+	    run.threads > BENCH_MAX_THREADS ||
+	    run.width <= 0 || run.height <= 0) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	samples = malloc(sizeof(*samples) * run.iterations * run.threads);
+	if (!samples)
+		return 1;
+
+	run.drm = gralloc_drm_create(1);
+	if (!run.drm) {
+		fprintf(stderr, "failed to create the stand-in device\n");
+		return 1;
+	}
+
+	printf("%dx%d, %d iterations, %d threads, ioctl %lld us, vblank %lld us\n",
+			run.width, run.height, run.iterations, run.threads,
+			(long long) bench_ioctl_ns / 1000,
+			(long long) bench_vblank_ns / 1000);
+	printf("%-16s %8s %10s %9s %9s %9s\n", "benchmark", "ops",
+			"ops/s", "p50(us)", "p99(us)", "max(us)");
+
+	for (i = 0; i < sizeof(benchmarks) / sizeof(benchmarks[0]); i++) {
+		int64_t start, elapsed;
+		int count;
+
+		if (!is_selected(benchmarks[i].name, argv + optind,
+					argc - optind))
+			continue;
+
+		start = bench_get_time_ns();
+		count = benchmarks[i].func(&run, samples);
+		elapsed = bench_get_time_ns() - start;
+
+		report(benchmarks[i].name, samples, count, elapsed);
+	}
+
+	gralloc_drm_destroy(run.drm);
+	free(samples);
+
+	return 0;
+}
@@ -0,0 +1,55 @@
+/*
+ * Copyright (C) 2010-2011 Chia-I Wu <olvaffe@gmail.com>
+ * Copyright (C) 2010-2011 LunarG Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Stand-in for the Android log on the host: messages go to stderr.
+ */
+
+#ifndef _HOST_CUTILS_LOG_H_
+#define _HOST_CUTILS_LOG_H_
+
+/* as included by the real one */
+#include <stdio.h>
+#include <time.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <stdarg.h>
+
+#ifndef LOG_TAG
+#define LOG_TAG ""
+#endif
+
+#define HOST_LOG(prio, ...) do {				\
+	fprintf(stderr, "%c/%s: ", prio, LOG_TAG);		\
+	fprintf(stderr, __VA_ARGS__);				\
+	fputc('\n', stderr);					\
+} while (0)
+
+/* verbose messages are compiled out, as with LOG_NDEBUG */
+#define ALOGV(...) do { if (0) HOST_LOG('V', __VA_ARGS__); } while (0)
+#define ALOGD(...) HOST_LOG('D', __VA_ARGS__)
+#define ALOGI(...) HOST_LOG('I', __VA_ARGS__)
+#define ALOGW(...) HOST_LOG('W', __VA_ARGS__)
+#define ALOGE(...) HOST_LOG('E', __VA_ARGS__)
+
+#endif /* _HOST_CUTILS_LOG_H_ */
@@ -0,0 +1,115 @@
+/*
+ * Copyright (C) 2010-2011 Chia-I Wu <olvaffe@gmail.com>
+ * Copyright (C) 2010-2011 LunarG Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Stand-in for the Android gralloc HAL on the host, the parts the core uses.
+ */
+
+#ifndef _HOST_HARDWARE_GRALLOC_H_
+#define _HOST_HARDWARE_GRALLOC_H_
+
+/* as included by the real one, and by system/window.h */
+#include <stddef.h>
+#include <stdint.h>
+#include <limits.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <system/graphics.h>
+#include <hardware/hardware.h>
+
+enum {
+	GRALLOC_USAGE_SW_READ_NEVER         = 0x00000000,
+	GRALLOC_USAGE_SW_READ_RARELY        = 0x00000002,
+	GRALLOC_USAGE_SW_READ_OFTEN         = 0x00000003,
+	GRALLOC_USAGE_SW_READ_MASK          = 0x0000000F,
+
+	GRALLOC_USAGE_SW_WRITE_NEVER        = 0x00000000,
+	GRALLOC_USAGE_SW_WRITE_RARELY       = 0x00000020,
+	GRALLOC_USAGE_SW_WRITE_OFTEN        = 0x00000030,
+	GRALLOC_USAGE_SW_WRITE_MASK         = 0x000000F0,
+
+	GRALLOC_USAGE_HW_TEXTURE            = 0x00000100,
+	GRALLOC_USAGE_HW_RENDER             = 0x00000200,
+	GRALLOC_USAGE_HW_2D                 = 0x00000400,
+	GRALLOC_USAGE_HW_COMPOSER           = 0x00000800,
+	GRALLOC_USAGE_HW_FB                 = 0x00001000,
+	GRALLOC_USAGE_HW_VIDEO_ENCODER      = 0x00010000,
+	GRALLOC_USAGE_HW_MASK               = 0x00011F00,
+
+	GRALLOC_USAGE_PRIVATE_0             = 0x10000000,
+	GRALLOC_USAGE_PRIVATE_1             = 0x20000000,
+	GRALLOC_USAGE_PRIVATE_2             = 0x40000000,
+	GRALLOC_USAGE_PRIVATE_3             = 0x80000000,
+	GRALLOC_USAGE_PRIVATE_MASK          = 0xF0000000,
+};
+
+typedef struct gralloc_module_t {
+	struct hw_module_t common;
+
+	int (*registerBuffer)(struct gralloc_module_t const *module,
+			buffer_handle_t handle);
+	int (*unregisterBuffer)(struct gralloc_module_t const *module,
+			buffer_handle_t handle);
+	int (*lock)(struct gralloc_module_t const *module,
+			buffer_handle_t handle, int usage,
+			int l, int t, int w, int h, void **vaddr);
+	int (*unlock)(struct gralloc_module_t const *module,
+			buffer_handle_t handle);
+	int (*perform)(struct gralloc_module_t const *module,
+			int operation, ...);
+
+	void *reserved_proc[7];
+} gralloc_module_t;
+
+typedef struct framebuffer_device_t {
+	struct hw_device_t common;
+
+	const uint32_t flags;
+	const uint32_t width;
+	const uint32_t height;
+	const int stride;
+	const int format;
+	const float xdpi;
+	const float ydpi;
+	const float fps;
+	const int minSwapInterval;
+	const int maxSwapInterval;
+	const int numFramebuffers;
+	int reserved[7];
+
+	int (*setSwapInterval)(struct framebuffer_device_t *window,
+			int interval);
+	int (*setUpdateRect)(struct framebuffer_device_t *window,
+			int left, int top, int width, int height);
+	int (*post)(struct framebuffer_device_t *dev, buffer_handle_t buffer);
+	int (*compositionComplete)(struct framebuffer_device_t *dev);
+	void (*dump)(struct framebuffer_device_t *dev, char *buff,
+			int buff_len);
+	int (*enableScreen)(struct framebuffer_device_t *dev, int enable);
+
+	void *reserved_proc[6];
+} framebuffer_device_t;
+
+#endif /* _HOST_HARDWARE_GRALLOC_H_ */
@@ -0,0 +1,62 @@
+/*
+ * Copyright (C) 2010-2011 Chia-I Wu <olvaffe@gmail.com>
+ * Copyright (C) 2010-2011 LunarG Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Stand-in for the Android HAL on the host, the parts the core uses.
+ */
+
+#ifndef _HOST_HARDWARE_HARDWARE_H_
+#define _HOST_HARDWARE_HARDWARE_H_
+
+#include <stdint.h>
+#include <cutils/native_handle.h>
+
+struct hw_module_t;
+struct hw_device_t;
+
+typedef struct hw_module_methods_t {
+	int (*open)(const struct hw_module_t *module, const char *id,
+			struct hw_device_t **device);
+} hw_module_methods_t;
+
+typedef struct hw_module_t {
+	uint32_t tag;
+	uint16_t version_major;
+	uint16_t version_minor;
+	const char *id;
+	const char *name;
+	const char *author;
+	struct hw_module_methods_t *methods;
+	void *dso;
+	uint32_t reserved[32 - 7];
+} hw_module_t;
+
+typedef struct hw_device_t {
+	uint32_t tag;
+	uint32_t version;
+	struct hw_module_t *module;
+	uint32_t reserved[12];
+	int (*close)(struct hw_device_t *device);
+} hw_device_t;
+
+#endif /* _HOST_HARDWARE_HARDWARE_H_ */
@@ -0,0 +1,61 @@
+/*
+ * Copyright (C) 2010-2011 Chia-I Wu <olvaffe@gmail.com>
+ * Copyright (C) 2010-2011 LunarG Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Stand-in for the Android properties on the host: a property is read from
+ * the environment variable named after it, with the dots as underscores.
+ *
+ *	debug_drm_bo_cache_kb=0 ./gralloc_drm_bench
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <cutils/properties.h>
+
+int property_get(const char *key, char *value, const char *default_value)
+{
+	char name[PROPERTY_KEY_MAX * 2];
+	const char *v;
+	int i, len;
+
+	for (i = 0; key[i] && i < (int) sizeof(name) - 1; i++)
+		name[i] = (key[i] == '.') ? '_' : key[i];
+	name[i] = '\0';
+
+	v = getenv(name);
+	if (!v)
+		v = default_value;
+	if (!v) {
+		value[0] = '\0';
+		return 0;
+	}
+
+	len = strlen(v);
+	if (len > PROPERTY_VALUE_MAX - 1)
+		len = PROPERTY_VALUE_MAX - 1;
+	memcpy(value, v, len);
+	value[len] = '\0';
+
+	return len;
+}
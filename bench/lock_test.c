@@ -0,0 +1,189 @@
+/*
+ * Copyright (C) 2010-2011 Chia-I Wu <olvaffe@gmail.com>
+ * Copyright (C) 2010-2011 LunarG Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Checks of the SW lock of a bo: threads that hold read locks upgrade them
+ * to write locks, or fail, instead of waiting for themselves.
+ *
+ *	gralloc_drm_lock_test
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "gralloc_drm.h"
+#include "gralloc_drm_priv.h"
+
+#define USAGE_READ GRALLOC_USAGE_SW_READ_OFTEN
+#define USAGE_WRITE (GRALLOC_USAGE_SW_READ_OFTEN | GRALLOC_USAGE_SW_WRITE_OFTEN)
+
+static struct gralloc_drm_t *drm;
+static int failures;
+
+#define CHECK(cond) do {						\
+	if (!(cond)) {							\
+		printf("%s:%d: %s\n", __FILE__, __LINE__, #cond);	\
+		failures++;						\
+	}								\
+} while (0)
+
+static int lock(struct gralloc_drm_bo_t *bo, int usage)
+{
+	void *addr;
+
+	return gralloc_drm_bo_lock(bo, usage, 0, 0, 64, 64, &addr);
+}
+
+static struct gralloc_drm_bo_t *create_bo(void)
+{
+	return gralloc_drm_bo_create(drm, 64, 64, HAL_PIXEL_FORMAT_RGBA_8888,
+			USAGE_WRITE);
+}
+
+/*
+ * The bo is unlocked: another thread may take the write lock.
+ */
+static void check_unlocked(struct gralloc_drm_bo_t *bo)
+{
+	void *addr;
+	int err = gralloc_drm_bo_lock_flags(bo, USAGE_WRITE, 0, 0, 64, 64,
+			GRALLOC_DRM_LOCK_NONBLOCK, &addr, NULL);
+
+	CHECK(!err);
+	if (!err)
+		gralloc_drm_bo_unlock(bo);
+}
+
+static void *read_unlock_thread(void *arg)
+{
+	struct gralloc_drm_bo_t *bo = arg;
+
+	CHECK(!lock(bo, USAGE_READ));
+	gralloc_drm_bo_unlock(bo);
+
+	return NULL;
+}
+
+/*
+ * A reads, B reads and unlocks, A writes.
+ */
+static void check_upgrade_after_reader(void)
+{
+	struct gralloc_drm_bo_t *bo = create_bo();
+	pthread_t b;
+
+	CHECK(!lock(bo, USAGE_READ));
+	pthread_create(&b, NULL, read_unlock_thread, bo);
+	pthread_join(b, NULL);
+
+	CHECK(!lock(bo, USAGE_WRITE));
+	gralloc_drm_bo_unlock(bo);
+	gralloc_drm_bo_unlock(bo);
+
+	check_unlocked(bo);
+	gralloc_drm_bo_destroy(bo);
+}
+
+/*
+ * A thread reads twice and writes.
+ */
+static void check_upgrade_nested(void)
+{
+	struct gralloc_drm_bo_t *bo = create_bo();
+
+	CHECK(!lock(bo, USAGE_READ));
+	CHECK(!lock(bo, USAGE_READ));
+	CHECK(!lock(bo, USAGE_WRITE));
+	gralloc_drm_bo_unlock(bo);
+	gralloc_drm_bo_unlock(bo);
+	gralloc_drm_bo_unlock(bo);
+
+	check_unlocked(bo);
+	gralloc_drm_bo_destroy(bo);
+}
+
+static void *upgrade_thread(void *arg)
+{
+	struct gralloc_drm_bo_t *bo = arg;
+
+	CHECK(!lock(bo, USAGE_READ));
+	CHECK(!lock(bo, USAGE_WRITE));
+	gralloc_drm_bo_unlock(bo);
+	gralloc_drm_bo_unlock(bo);
+
+	return NULL;
+}
+
+/*
+ * A and B read, A writes and waits for B, B writes.  B fails instead of
+ * waiting for A, and A gets the write lock once B unlocks.
+ */
+static void check_upgrade_both(void)
+{
+	struct gralloc_drm_bo_t *bo = create_bo();
+	pthread_t a;
+	int waiting = 0, tries;
+
+	CHECK(!lock(bo, USAGE_READ));
+	pthread_create(&a, NULL, upgrade_thread, bo);
+
+	for (tries = 0; !waiting && tries < 1000; tries++) {
+		pthread_mutex_lock(&bo->lock_mutex);
+		waiting = bo->holder_waiting;
+		pthread_mutex_unlock(&bo->lock_mutex);
+		if (!waiting)
+			usleep(1000);
+	}
+	CHECK(waiting);
+
+	CHECK(lock(bo, USAGE_WRITE) == -EDEADLK);
+	gralloc_drm_bo_unlock(bo);
+	pthread_join(a, NULL);
+
+	check_unlocked(bo);
+	gralloc_drm_bo_destroy(bo);
+}
+
+int main(void)
+{
+	/* a deadlock is a failure too */
+	alarm(10);
+
+	drm = gralloc_drm_create(0);
+	if (!drm) {
+		printf("FAIL: no device\n");
+		return 1;
+	}
+
+	check_upgrade_after_reader();
+	check_upgrade_nested();
+	check_upgrade_both();
+
+	gralloc_drm_destroy(drm);
+
+	printf("%s: %d failures\n", (failures) ? "FAIL" : "PASS", failures);
+
+	return (failures) ? 1 : 0;
+}
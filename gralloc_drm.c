@@ -25,18 +25,77 @@
 
 #include <cutils/log.h>
 #include <cutils/atomic.h>
+#include <cutils/properties.h>
 #include <stdlib.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
 #include <errno.h>
+#include <time.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/resource.h>
+#include <sys/ioctl.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <linux/dma-buf.h>
+#include <limits.h>
+#ifdef ENABLE_PLUGINS
+#include <dlfcn.h>
+#endif
 
 #include "gralloc_drm.h"
 #include "gralloc_drm_priv.h"
+#include "gralloc_drm_trace.h"
+#include "pci_ids/pci_id_driver_map.h"
 
 #define unlikely(x) __builtin_expect(!!(x), 0)
 
+#ifndef GRALLOC_DRM_DEVICE
 #define GRALLOC_DRM_DEVICE "/dev/dri/card0"
+#endif
+#ifndef GRALLOC_DRM_RENDER_DEVICE
+#define GRALLOC_DRM_RENDER_DEVICE "/dev/dri/renderD128"
+#endif
+#ifndef GRALLOC_DRM_PLUGIN_DIR
+#define GRALLOC_DRM_PLUGIN_DIR "/system/lib/hwdrm"
+#endif
+
+/* defaults of the bo cache, see bo_cache_init() */
+#define GRALLOC_DRM_BO_CACHE_MAX_SIZE (32 * 1024 * 1024)
+#define GRALLOC_DRM_BO_CACHE_MAX_AGE_MS 3000
+
+/* defaults of the warm pool, see bo_pool_init() */
+#define GRALLOC_DRM_BO_POOL_MAX_SIZE (16 * 1024 * 1024)
+#define GRALLOC_DRM_BO_POOL_DEPTH 2
+#define GRALLOC_DRM_BO_POOL_MIN_REQUESTS 2
+#define GRALLOC_DRM_BO_POOL_IDLE_MS 30000
+#define GRALLOC_DRM_BO_POOL_PERIOD_MS 5000
+
+/* default of the map cache, see map_cache_init() */
+#define GRALLOC_DRM_MAP_CACHE_MAX_SIZE (64 * 1024 * 1024)
+
+/* sync file export, from linux/dma-buf.h of newer kernels */
+#ifndef DMA_BUF_IOCTL_EXPORT_SYNC_FILE
+struct dma_buf_export_sync_file {
+	__u32 flags;
+	__s32 fd;
+};
+#define DMA_BUF_IOCTL_EXPORT_SYNC_FILE \
+	_IOWR(DMA_BUF_BASE, 2, struct dma_buf_export_sync_file)
+#endif
+
+/* ANDROID_PRIORITY_BACKGROUND, for the zero and pool workers */
+#define GRALLOC_DRM_WORKER_PRIORITY 10
+
+/* usage bits that decide the layout (and tiling) chosen by the drivers */
+#define GRALLOC_DRM_USAGE_CLASS_MASK (GRALLOC_USAGE_SW_READ_MASK | \
+				      GRALLOC_USAGE_SW_WRITE_MASK | \
+				      GRALLOC_USAGE_HW_TEXTURE | \
+				      GRALLOC_USAGE_HW_RENDER | \
+				      GRALLOC_USAGE_HW_FB)
 
 static int32_t gralloc_drm_pid = 0;
 
@@ -52,13 +111,342 @@ static int gralloc_drm_get_pid(void)
 }
 
 /*
- * Create the driver for a DRM fd.
+ * Return the monotonic time in milliseconds.
+ */
+static int64_t gralloc_drm_get_time_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * The slot table maps the ids stored in gralloc_drm_handle_t::data to bo's.
+ * An id is a slot index and the generation of the slot, which is bumped
+ * whenever the slot is released, so a stale id never resolves to a recycled
+ * bo.  Each slot also holds the handle and the driver bo struct, so a bo
+ * takes a single allocation from the arena.  Slots live in chunks that never
+ * move once allocated.
+ */
+#define GRALLOC_DRM_SLOT_INDEX_BITS 16
+#define GRALLOC_DRM_SLOT_INDEX_MASK ((1 << GRALLOC_DRM_SLOT_INDEX_BITS) - 1)
+#define GRALLOC_DRM_SLOT_GENERATION_MASK 0x7fff
+#define GRALLOC_DRM_SLOTS_PER_CHUNK 64
+#define GRALLOC_DRM_SLOT_MAX_CHUNKS \
+	((GRALLOC_DRM_SLOT_INDEX_MASK + 1) / GRALLOC_DRM_SLOTS_PER_CHUNK)
+
+struct gralloc_drm_slot {
+	struct gralloc_drm_bo_t *bo; /* NULL until the bo is created */
+	int generation;
+	int next_free;
+
+	struct gralloc_drm_handle_t handle;
+	/* followed by the driver bo struct */
+};
+
+static struct {
+	pthread_mutex_t mutex;
+
+	size_t slot_size, bo_offset;
+	char *chunks[GRALLOC_DRM_SLOT_MAX_CHUNKS];
+	int count;
+	int free_head;
+} slot_table = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+	.free_head = -1,
+};
+
+/*
+ * Size the slots for the bo structs of a driver.
+ */
+static void slot_table_init(const struct gralloc_drm_drv_t *drv)
+{
+	pthread_mutex_lock(&slot_table.mutex);
+	if (!slot_table.slot_size) {
+		slot_table.bo_offset = ALIGN(sizeof(struct gralloc_drm_slot), 16);
+		slot_table.slot_size = slot_table.bo_offset +
+			ALIGN(drv->bo_size, 16);
+	}
+	pthread_mutex_unlock(&slot_table.mutex);
+}
+
+static struct gralloc_drm_slot *slot_get_locked(int index)
+{
+	char *chunk = slot_table.chunks[index / GRALLOC_DRM_SLOTS_PER_CHUNK];
+
+	return (struct gralloc_drm_slot *) (chunk + slot_table.slot_size *
+			(index % GRALLOC_DRM_SLOTS_PER_CHUNK));
+}
+
+static int slot_id(int index, const struct gralloc_drm_slot *slot)
+{
+	return (slot->generation << GRALLOC_DRM_SLOT_INDEX_BITS) | index;
+}
+
+/*
+ * Allocate a slot with a zeroed handle and bo struct.  The handle is returned
+ * with its id in data.
+ */
+static struct gralloc_drm_handle_t *slot_alloc(struct gralloc_drm_bo_t **bo)
+{
+	struct gralloc_drm_slot *slot = NULL;
+	int index;
+
+	pthread_mutex_lock(&slot_table.mutex);
+
+	if (slot_table.free_head < 0) {
+		int c = slot_table.count / GRALLOC_DRM_SLOTS_PER_CHUNK;
+		char *chunk;
+
+		chunk = (c < GRALLOC_DRM_SLOT_MAX_CHUNKS) ? calloc(
+				GRALLOC_DRM_SLOTS_PER_CHUNK,
+				slot_table.slot_size) : NULL;
+		if (!chunk) {
+			pthread_mutex_unlock(&slot_table.mutex);
+			LOGE("failed to allocate bo slots");
+			return NULL;
+		}
+
+		slot_table.chunks[c] = chunk;
+		for (index = slot_table.count + GRALLOC_DRM_SLOTS_PER_CHUNK - 1;
+		     index >= slot_table.count; index--) {
+			slot = slot_get_locked(index);
+			slot->generation = 1;
+			slot->next_free = slot_table.free_head;
+			slot_table.free_head = index;
+		}
+		slot_table.count += GRALLOC_DRM_SLOTS_PER_CHUNK;
+	}
+
+	index = slot_table.free_head;
+	slot = slot_get_locked(index);
+	slot_table.free_head = slot->next_free;
+
+	pthread_mutex_unlock(&slot_table.mutex);
+
+	slot->bo = NULL;
+	slot->next_free = -1;
+	memset((char *) slot + offsetof(struct gralloc_drm_slot, handle), 0,
+			slot_table.slot_size -
+			offsetof(struct gralloc_drm_slot, handle));
+
+	slot->handle.data = slot_id(index, slot);
+	*bo = (struct gralloc_drm_bo_t *) ((char *) slot + slot_table.bo_offset);
+
+	pthread_mutex_init(&(*bo)->lock_mutex, NULL);
+	pthread_cond_init(&(*bo)->lock_cond, NULL);
+
+	return &slot->handle;
+}
+
+/*
+ * Make the id in the handle of a bo resolve to the bo.
+ */
+static void slot_publish(struct gralloc_drm_bo_t *bo)
+{
+	struct gralloc_drm_slot *slot;
+
+	pthread_mutex_lock(&slot_table.mutex);
+	slot = slot_get_locked(bo->handle->data & GRALLOC_DRM_SLOT_INDEX_MASK);
+	slot->bo = bo;
+	pthread_mutex_unlock(&slot_table.mutex);
+}
+
+/*
+ * Invalidate all outstanding ids of a slot.  The slot is put back to the free
+ * list unless keep is true, in which case the handle gets a fresh id.
+ */
+static void slot_retire(struct gralloc_drm_handle_t *handle, int keep)
+{
+	struct gralloc_drm_slot *slot;
+	int index = handle->data & GRALLOC_DRM_SLOT_INDEX_MASK;
+
+	pthread_mutex_lock(&slot_table.mutex);
+
+	slot = slot_get_locked(index);
+	slot->generation = (slot->generation + 1) &
+		GRALLOC_DRM_SLOT_GENERATION_MASK;
+	if (!slot->generation)
+		slot->generation = 1;
+
+	if (keep) {
+		handle->data = slot_id(index, slot);
+	}
+	else {
+		struct gralloc_drm_bo_t *bo = (struct gralloc_drm_bo_t *)
+			((char *) slot + slot_table.bo_offset);
+
+		pthread_cond_destroy(&bo->lock_cond);
+		pthread_mutex_destroy(&bo->lock_mutex);
+
+		slot->bo = NULL;
+		slot->next_free = slot_table.free_head;
+		slot_table.free_head = index;
+	}
+
+	pthread_mutex_unlock(&slot_table.mutex);
+}
+
+/*
+ * Return the bo of an id, or NULL if the id is stale.
+ */
+static struct gralloc_drm_bo_t *slot_lookup(int id)
+{
+	struct gralloc_drm_bo_t *bo = NULL;
+	int index = id & GRALLOC_DRM_SLOT_INDEX_MASK;
+
+	pthread_mutex_lock(&slot_table.mutex);
+	if (id > 0 && index < slot_table.count) {
+		struct gralloc_drm_slot *slot = slot_get_locked(index);
+
+		if (slot_id(index, slot) == id)
+			bo = slot->bo;
+	}
+	pthread_mutex_unlock(&slot_table.mutex);
+
+	return bo;
+}
+
+static void bo_free(struct gralloc_drm_bo_t *bo);
+static void bo_cache_init(struct gralloc_drm_t *drm);
+static void bo_cache_fini(struct gralloc_drm_t *drm);
+static void bo_pool_init(struct gralloc_drm_t *drm);
+static void bo_pool_fini(struct gralloc_drm_t *drm);
+static void map_cache_init(struct gralloc_drm_t *drm);
+static void map_cache_fini(struct gralloc_drm_t *drm);
+static void map_cache_drop(struct gralloc_drm_bo_t *bo);
+static long bo_get_size(const struct gralloc_drm_bo_t *bo);
+static void mem_init(struct gralloc_drm_t *drm);
+
+/* the built-in backends */
+static const struct gralloc_drm_backend *const backends[] = {
+#ifdef ENABLE_PIPE
+	&gralloc_drm_backend_pipe,
+#endif
+#ifdef ENABLE_INTEL
+	&gralloc_drm_backend_intel,
+#endif
+#ifdef ENABLE_OMAPDRM
+	&gralloc_drm_backend_omap,
+#endif
+#ifdef ENABLE_RADEON
+	&gralloc_drm_backend_radeon,
+#endif
+#ifdef ENABLE_NOUVEAU
+	&gralloc_drm_backend_nouveau,
+#endif
+#ifdef ENABLE_BENCH
+	&gralloc_drm_backend_bench,
+#endif
+#ifdef ENABLE_DUMB
+	/* any KMS device can do without acceleration */
+	&gralloc_drm_backend_dumb,
+#endif
+	NULL, /* room for the plugin */
+};
+
+/*
+ * Read a hex id of the device of a DRM fd from sysfs.  Return 0 when there
+ * is none, as for platform devices.
+ */
+static int read_device_id(int fd, const char *file)
+{
+	char path[64], buf[16];
+	struct stat st;
+	int id_fd, len;
+
+	if (fstat(fd, &st) || !S_ISCHR(st.st_mode))
+		return 0;
+
+	snprintf(path, sizeof(path), "/sys/dev/char/%u:%u/device/%s",
+			major(st.st_rdev), minor(st.st_rdev), file);
+	id_fd = open(path, O_RDONLY);
+	if (id_fd < 0)
+		return 0;
+
+	len = read(id_fd, buf, sizeof(buf) - 1);
+	close(id_fd);
+	if (len <= 0)
+		return 0;
+	buf[len] = '\0';
+
+	return (int) strtol(buf, NULL, 16);
+}
+
+/*
+ * Return the driver of a PCI id in the driver map.
+ */
+static const char *find_pci_driver(int vendor_id, int device_id)
+{
+	int idx, i;
+
+	for (idx = 0; driver_map[idx].driver; idx++) {
+		if (driver_map[idx].vendor_id != vendor_id)
+			continue;
+
+		if (driver_map[idx].num_chips_ids == -1)
+			return driver_map[idx].driver;
+
+		for (i = 0; i < driver_map[idx].num_chips_ids; i++) {
+			if (driver_map[idx].chip_ids[i] == device_id)
+				return driver_map[idx].driver;
+		}
+	}
+
+	return NULL;
+}
+
+#ifdef ENABLE_PLUGINS
+/*
+ * Load the plugin for a kernel driver.  Plugins are never unloaded, as the
+ * drivers they create live until the process exits.
+ */
+static const struct gralloc_drm_backend *load_plugin(const char *name)
+{
+	const struct gralloc_drm_backend *backend;
+	char path[PATH_MAX];
+	void *lib;
+
+	snprintf(path, sizeof(path), "%s/gralloc_drm_%s.so",
+			GRALLOC_DRM_PLUGIN_DIR, name);
+	if (access(path, R_OK))
+		return NULL;
+
+	lib = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+	if (!lib) {
+		LOGE("failed to load %s: %s", path, dlerror());
+		return NULL;
+	}
+
+	backend = dlsym(lib, "gralloc_drm_backend");
+	if (!backend || backend->version != GRALLOC_DRM_BACKEND_VERSION) {
+		LOGE("%s is not a backend of version %d", path,
+				GRALLOC_DRM_BACKEND_VERSION);
+		dlclose(lib);
+		return NULL;
+	}
+
+	return backend;
+}
+#endif
+
+/*
+ * Create the driver for a DRM fd.  Every backend that drives the device is
+ * tried, the best scoring one first.  debug.drm.backend names the only
+ * backend to try.
  */
 static struct gralloc_drm_drv_t *
 init_drv_from_fd(int fd)
 {
+	const struct gralloc_drm_backend *candidates[ARRAY_SIZE(backends)];
+	int scores[ARRAY_SIZE(backends)];
+	char forced[PROPERTY_VALUE_MAX];
+	struct gralloc_drm_device dev;
 	struct gralloc_drm_drv_t *drv = NULL;
 	drmVersionPtr version;
+	int count = 0, i;
 
 	/* get the kernel module name */
 	version = drmGetVersion(fd);
@@ -67,33 +455,62 @@ init_drv_from_fd(int fd)
 		return NULL;
 	}
 
-	if (version->name) {
-#ifdef ENABLE_PIPE
-		drv = gralloc_drm_drv_create_for_pipe(fd, version->name);
+	memset(&dev, 0, sizeof(dev));
+	dev.fd = fd;
+	dev.name = (version->name) ? version->name : "";
+	dev.vendor_id = read_device_id(fd, "vendor");
+	dev.device_id = read_device_id(fd, "device");
+	if (dev.vendor_id)
+		dev.pci_driver = find_pci_driver(dev.vendor_id, dev.device_id);
+	if (drmGetCap(fd, DRM_CAP_DUMB_BUFFER, &dev.dumb_buffer))
+		dev.dumb_buffer = 0;
+	if (drmGetCap(fd, DRM_CAP_PRIME, &dev.prime_caps))
+		dev.prime_caps = 0;
+
+	property_get("debug.drm.backend", forced, "");
+
+	for (i = 0; i < (int) ARRAY_SIZE(backends); i++) {
+		const struct gralloc_drm_backend *backend = backends[i];
+		int score, j;
+
+#ifdef ENABLE_PLUGINS
+		if (!backend && dev.name[0])
+			backend = load_plugin(dev.name);
 #endif
+		if (!backend)
+			continue;
 
-#ifdef ENABLE_INTEL
-		if (!drv && !strcmp(version->name, "i915"))
-			drv = gralloc_drm_drv_create_for_intel(fd);
-#endif
-#ifdef ENABLE_OMAP
-		if (!drv && !strcmp(version->name, "omapdrm"))
-			drv = gralloc_drm_drv_create_for_omap(fd);
-#endif
-#ifdef ENABLE_RADEON
-		if (!drv && !strcmp(version->name, "radeon"))
-			drv = gralloc_drm_drv_create_for_radeon(fd);
-#endif
-#ifdef ENABLE_NOUVEAU
-		if (!drv && !strcmp(version->name, "nouveau"))
-			drv = gralloc_drm_drv_create_for_nouveau(fd);
-#endif
+		if (forced[0] && strcmp(forced, backend->name))
+			continue;
+
+		score = backend->probe(&dev);
+		if (score < 0)
+			continue;
+
+		/* keep the candidates sorted, ties in registry order */
+		for (j = count; j > 0 && scores[j - 1] < score; j--) {
+			candidates[j] = candidates[j - 1];
+			scores[j] = scores[j - 1];
+		}
+		candidates[j] = backend;
+		scores[j] = score;
+		count++;
+	}
+
+	for (i = 0; i < count && !drv; i++) {
+		drv = candidates[i]->create(&dev);
+		if (drv)
+			LOGI("using backend %s for driver %s (%04x:%04x)",
+					candidates[i]->name, dev.name,
+					dev.vendor_id, dev.device_id);
+		else
+			LOGW("backend %s failed to drive %s",
+					candidates[i]->name, dev.name);
 	}
 
-	if (!drv) {
+	if (!drv)
 		LOGE("unsupported driver: %s", (version->name) ?
 				version->name : "NULL");
-	}
 
 	drmFreeVersion(version);
 
@@ -101,9 +518,59 @@ init_drv_from_fd(int fd)
 }
 
 /*
- * Create a DRM device object.
+ * Open the render node and create the driver for it.  Render nodes need no
+ * authentication, but have no GEM names either, so the driver has to support
+ * them and bo's have to be shared by dma-buf.  Importers that open bo's by
+ * name, as the EGL of many systems still does, fail on them, so the render
+ * node is used only when debug.drm.render_node=1.  Return 0 when it is not
+ * used.
+ */
+static int open_render_node(struct gralloc_drm_t *drm)
+{
+	char value[PROPERTY_VALUE_MAX];
+	uint64_t caps;
+	int fd;
+
+	property_get("debug.drm.render_node", value, "0");
+	if (!atoi(value))
+		return 0;
+
+	fd = open(GRALLOC_DRM_RENDER_DEVICE, O_RDWR | O_CLOEXEC);
+	if (fd < 0)
+		return 0;
+
+	if (drmGetCap(fd, DRM_CAP_PRIME, &caps) ||
+	    (caps & (DRM_PRIME_CAP_IMPORT | DRM_PRIME_CAP_EXPORT)) !=
+	    (DRM_PRIME_CAP_IMPORT | DRM_PRIME_CAP_EXPORT)) {
+		close(fd);
+		return 0;
+	}
+
+	drm->drv = init_drv_from_fd(fd);
+	if (drm->drv && !drm->drv->render_node) {
+		drm->drv->destroy(drm->drv);
+		drm->drv = NULL;
+	}
+	if (!drm->drv) {
+		close(fd);
+		return 0;
+	}
+
+	drm->fd = fd;
+	drm->render_node = 1;
+	drm->prime_caps = caps;
+
+	LOGI("allocating from %s", GRALLOC_DRM_RENDER_DEVICE);
+
+	return 1;
+}
+
+/*
+ * Create a DRM device object.  Unless primary is true, bo's are allocated
+ * from the render node when possible, and the primary node is opened only
+ * when KMS or the DRM master is needed.
  */
-struct gralloc_drm_t *gralloc_drm_create(void)
+struct gralloc_drm_t *gralloc_drm_create(int primary)
 {
 	struct gralloc_drm_t *drm;
 
@@ -111,19 +578,44 @@ struct gralloc_drm_t *gralloc_drm_create(void)
 	if (!drm)
 		return NULL;
 
-	drm->fd = open(GRALLOC_DRM_DEVICE, O_RDWR);
-	if (drm->fd < 0) {
-		LOGE("failed to open %s", GRALLOC_DRM_DEVICE);
-		return NULL;
-	}
+	drm->kms_fd = -1;
 
-	drm->drv = init_drv_from_fd(drm->fd);
-	if (!drm->drv) {
-		close(drm->fd);
-		free(drm);
-		return NULL;
+	if (primary || !open_render_node(drm)) {
+		drm->fd = open(GRALLOC_DRM_DEVICE, O_RDWR);
+		if (drm->fd < 0) {
+			LOGE("failed to open %s", GRALLOC_DRM_DEVICE);
+			free(drm);
+			return NULL;
+		}
+
+		drm->drv = init_drv_from_fd(drm->fd);
+		if (!drm->drv) {
+			close(drm->fd);
+			free(drm);
+			return NULL;
+		}
+
+		if (drmGetCap(drm->fd, DRM_CAP_PRIME, &drm->prime_caps))
+			drm->prime_caps = 0;
+
+		drm->kms_fd = drm->fd;
 	}
 
+	/* the CPU copies for the drivers without a blitter */
+	if (!drm->drv->copy)
+		drm->drv->copy = gralloc_drm_cpu_copy;
+
+	slot_table_init(drm->drv);
+	bo_cache_init(drm);
+	bo_pool_init(drm);
+	map_cache_init(drm);
+	mem_init(drm);
+	pthread_mutex_init(&drm->imports.mutex, NULL);
+	pthread_cond_init(&drm->imports.cond, NULL);
+	pthread_mutex_init(&drm->present.mutex, NULL);
+	pthread_cond_init(&drm->present.cond, NULL);
+	gralloc_drm_trace_init();
+
 	return drm;
 }
 
@@ -134,9 +626,20 @@ void gralloc_drm_destroy(struct gralloc_drm_t *drm)
 {
 	int i;
 
+	bo_pool_fini(drm);
+	bo_cache_fini(drm);
+	map_cache_fini(drm);
+	pthread_mutex_destroy(&drm->mem.mutex);
+	pthread_mutex_destroy(&drm->imports.mutex);
+	pthread_cond_destroy(&drm->imports.cond);
+	pthread_mutex_destroy(&drm->present.mutex);
+	pthread_cond_destroy(&drm->present.cond);
+
 	if (drm->drv)
 		drm->drv->destroy(drm->drv);
 
+	if (drm->kms_fd >= 0 && drm->kms_fd != drm->fd)
+		close(drm->kms_fd);
 	close(drm->fd);
 
 	for (i = 0; i < drm->plane_count; i++)
@@ -155,19 +658,60 @@ int gralloc_drm_get_fd(struct gralloc_drm_t *drm)
 }
 
 /*
- * Get the magic for authentication.
+ * Get the fd of the primary node, which is opened on first use when bo's are
+ * allocated from the render node.
+ */
+int gralloc_drm_get_kms_fd(struct gralloc_drm_t *drm)
+{
+	int fd = drm->kms_fd;
+
+	if (fd >= 0)
+		return fd;
+
+	fd = open(GRALLOC_DRM_DEVICE, O_RDWR | O_CLOEXEC);
+	if (fd < 0) {
+		LOGE("failed to open %s", GRALLOC_DRM_DEVICE);
+		return -errno;
+	}
+
+	/* another thread may have opened it meanwhile */
+	if (!__sync_bool_compare_and_swap(&drm->kms_fd, -1, fd)) {
+		close(fd);
+		fd = drm->kms_fd;
+	}
+
+	return fd;
+}
+
+/*
+ * Get the magic for authentication.  The render node needs none, and 0 is
+ * returned as the magic.
  */
 int gralloc_drm_get_magic(struct gralloc_drm_t *drm, int32_t *magic)
 {
+	if (drm->render_node) {
+		*magic = 0;
+		return 0;
+	}
+
 	return drmGetMagic(drm->fd, (drm_magic_t *) magic);
 }
 
 /*
- * Authenticate a magic.
+ * Authenticate a magic.  A 0 magic is from a render node user.
  */
 int gralloc_drm_auth_magic(struct gralloc_drm_t *drm, int32_t magic)
 {
-	return drmAuthMagic(drm->fd, (drm_magic_t) magic);
+	int fd;
+
+	if (!magic)
+		return 0;
+
+	fd = gralloc_drm_get_kms_fd(drm);
+	if (fd < 0)
+		return fd;
+
+	return drmAuthMagic(fd, (drm_magic_t) magic);
 }
 
 /*
@@ -175,9 +719,13 @@ int gralloc_drm_auth_magic(struct gralloc_drm_t *drm, int32_t magic)
  */
 int gralloc_drm_set_master(struct gralloc_drm_t *drm)
 {
-	int ret;
+	int fd, ret;
 
-	ret = drmSetMaster(drm->fd);
+	fd = gralloc_drm_get_kms_fd(drm);
+	if (fd < 0)
+		return fd;
+
+	ret = drmSetMaster(fd);
 	if (ret) {
 		LOGE("Error: drmSetMaster failed: %s\n", strerror(errno));
 		return -errno;
@@ -198,7 +746,7 @@ void gralloc_drm_drop_master(struct gralloc_drm_t *drm)
 	if (!drm->master)
 		return;
 
-	ret = drmDropMaster(drm->fd);
+	ret = drmDropMaster(drm->kms_fd);
 	if (ret)
 		LOGE("Error: drmDropMaster failed: %s\n", strerror(errno));
 
@@ -206,212 +754,2518 @@ void gralloc_drm_drop_master(struct gralloc_drm_t *drm)
 }
 
 /*
- * Validate a buffer handle and return the associated bo.
+ * Initialize the memory accounting.  The budget, in KiB, is set by
+ * debug.drm.mem_budget_kb; there is none by default.
  */
-static struct gralloc_drm_bo_t *validate_handle(buffer_handle_t _handle,
-		struct gralloc_drm_t *drm)
+static void mem_init(struct gralloc_drm_t *drm)
 {
-	struct gralloc_drm_handle_t *handle = gralloc_drm_handle(_handle);
-
-	if (!handle)
-		return NULL;
+	char value[PROPERTY_VALUE_MAX];
 
-	/* the buffer handle is passed to a new process */
-	if (unlikely(handle->data_owner != gralloc_drm_pid)) {
-		struct gralloc_drm_bo_t *bo;
-
-		/* check only */
-		if (!drm)
-			return NULL;
-
-		/* create the struct gralloc_drm_bo_t locally */
-		if (handle->name)
-			bo = drm->drv->alloc(drm->drv, handle);
-		else /* an invalid handle */
-			bo = NULL;
-		if (bo) {
-			bo->drm = drm;
-			bo->imported = 1;
-			bo->handle = handle;
-		}
-
-		handle->data_owner = gralloc_drm_get_pid();
-		handle->data = (int) bo;
-	}
+	pthread_mutex_init(&drm->mem.mutex, NULL);
 
-	return (struct gralloc_drm_bo_t *) handle->data;
+	if (property_get("debug.drm.mem_budget_kb", value, NULL))
+		drm->mem.info.budget = atol(value) * 1024;
 }
 
-/*
- * Register a buffer handle.
- */
-int gralloc_drm_handle_register(buffer_handle_t handle, struct gralloc_drm_t *drm)
+static int mem_class(int usage)
 {
-	return (validate_handle(handle, drm)) ? 0 : -EINVAL;
+	if (usage & GRALLOC_USAGE_HW_FB)
+		return GRALLOC_DRM_MEM_FB;
+	if (usage & GRALLOC_USAGE_HW_RENDER)
+		return GRALLOC_DRM_MEM_RENDER;
+	if (usage & GRALLOC_USAGE_HW_TEXTURE)
+		return GRALLOC_DRM_MEM_TEXTURE;
+	if (usage & (GRALLOC_USAGE_SW_READ_MASK | GRALLOC_USAGE_SW_WRITE_MASK))
+		return GRALLOC_DRM_MEM_SW;
+
+	return GRALLOC_DRM_MEM_OTHER;
 }
 
 /*
- * Unregister a buffer handle.  It is no-op for handles created locally.
+ * Add a bo to, or remove it from, the memory accounting.
  */
-int gralloc_drm_handle_unregister(buffer_handle_t handle)
+static void mem_account(struct gralloc_drm_bo_t *bo, int add)
 {
-	struct gralloc_drm_bo_t *bo;
+	struct gralloc_drm_mem *mem = &bo->drm->mem;
+	struct gralloc_drm_mem_info *info = &mem->info;
+	long size;
+
+	if (add) {
+		bo->mem_class = mem_class(bo->handle->usage);
+		bo->mem_size = bo_get_size(bo);
+		size = bo->mem_size;
+	}
+	else {
+		/* never accounted */
+		if (!bo->mem_size)
+			return;
+		size = -bo->mem_size;
+		bo->mem_size = 0;
+	}
 
-	bo = validate_handle(handle, NULL);
-	if (!bo)
-		return -EINVAL;
+	pthread_mutex_lock(&mem->mutex);
 
 	if (bo->imported)
-		gralloc_drm_bo_destroy(bo);
+		info->imported += size;
+	else
+		info->owned += size;
+	info->count += (add) ? 1 : -1;
 
-	return 0;
+	info->by_class[bo->mem_class] += size;
+	if (bo->domain >= 0 && bo->domain < GRALLOC_DRM_DOMAIN_COUNT)
+		info->by_domain[bo->domain] += size;
+	if (bo->tiled)
+		info->tiled += size;
+
+	if (info->peak < info->owned + info->imported)
+		info->peak = info->owned + info->imported;
+
+	pthread_mutex_unlock(&mem->mutex);
 }
 
 /*
- * Create a buffer handle.
+ * Return true if size more bytes fit in the budget.
  */
-static struct gralloc_drm_handle_t *
-create_bo_handle(int width, int height, int format, int usage)
+static int mem_fits(struct gralloc_drm_t *drm, long size)
 {
-	struct gralloc_drm_handle_t *handle;
-
-	handle = calloc(1, sizeof(*handle));
-	if (!handle)
-		return NULL;
+	struct gralloc_drm_mem *mem = &drm->mem;
+	int fits;
 
-	handle->base.version = sizeof(handle->base);
-	handle->base.numInts = GRALLOC_DRM_HANDLE_NUM_INTS;
-	handle->base.numFds = GRALLOC_DRM_HANDLE_NUM_FDS;
-
-	handle->magic = GRALLOC_DRM_HANDLE_MAGIC;
-	handle->width = width;
-	handle->height = height;
-	handle->format = format;
-	handle->usage = usage;
+	pthread_mutex_lock(&mem->mutex);
+	fits = (!mem->info.budget || mem->info.owned + mem->info.imported +
+			size <= mem->info.budget);
+	pthread_mutex_unlock(&mem->mutex);
 
-	return handle;
+	return fits;
 }
 
 /*
- * Create a bo.
+ * Make room for size more bytes in the budget, by emptying the caches and
+ * then asking the pressure callback for memory.
  */
-struct gralloc_drm_bo_t *gralloc_drm_bo_create(struct gralloc_drm_t *drm,
-		int width, int height, int format, int usage)
+static int mem_reserve(struct gralloc_drm_t *drm, long size)
 {
-	struct gralloc_drm_bo_t *bo;
-	struct gralloc_drm_handle_t *handle;
+	struct gralloc_drm_mem *mem = &drm->mem;
+	gralloc_drm_mem_pressure_t callback;
+	void *data;
 
-	handle = create_bo_handle(width, height, format, usage);
+	if (mem_fits(drm, size))
+		return 0;
+
+	gralloc_drm_bo_pool_trim(drm);
+	gralloc_drm_bo_cache_trim(drm);
+	if (mem_fits(drm, size))
+		return 0;
+
+	pthread_mutex_lock(&mem->mutex);
+	callback = mem->pressure_callback;
+	data = mem->pressure_data;
+	pthread_mutex_unlock(&mem->mutex);
+
+	if (callback) {
+		callback(data, size);
+		if (mem_fits(drm, size))
+			return 0;
+	}
+
+	LOGE("allocating %ld bytes would exceed the budget of %ld bytes",
+			size, mem->info.budget);
+
+	return -ENOMEM;
+}
+
+/*
+ * Get the memory accounting of the process.
+ */
+void gralloc_drm_get_mem_info(struct gralloc_drm_t *drm,
+		struct gralloc_drm_mem_info *info)
+{
+	long cached;
+
+	pthread_mutex_lock(&drm->bo_cache.mutex);
+	cached = drm->bo_cache.size;
+	pthread_mutex_unlock(&drm->bo_cache.mutex);
+
+	pthread_mutex_lock(&drm->bo_pool.mutex);
+	cached += drm->bo_pool.size;
+	pthread_mutex_unlock(&drm->bo_pool.mutex);
+
+	pthread_mutex_lock(&drm->mem.mutex);
+	*info = drm->mem.info;
+	pthread_mutex_unlock(&drm->mem.mutex);
+
+	info->cached = cached;
+}
+
+/*
+ * Set the callback that is asked to release memory before an allocation
+ * fails for the budget.  The callback may free bo's.
+ */
+void gralloc_drm_set_mem_pressure_callback(struct gralloc_drm_t *drm,
+		gralloc_drm_mem_pressure_t callback, void *data)
+{
+	pthread_mutex_lock(&drm->mem.mutex);
+	drm->mem.pressure_callback = callback;
+	drm->mem.pressure_data = data;
+	pthread_mutex_unlock(&drm->mem.mutex);
+}
+
+struct gralloc_drm_dump {
+	char *buf;
+	int len;
+	int pos;    /* what the report would take, may exceed len */
+};
+
+static void dump_printf(struct gralloc_drm_dump *dump, const char *fmt, ...)
+{
+	va_list args;
+	int avail = (dump->pos < dump->len) ? dump->len - dump->pos : 0;
+	int n;
+
+	va_start(args, fmt);
+	n = vsnprintf((avail) ? dump->buf + dump->pos : NULL, avail, fmt, args);
+	va_end(args);
+
+	if (n > 0)
+		dump->pos += n;
+}
+
+/*
+ * Return the size a bo would take without any alignment or padding.
+ */
+static long bo_natural_size(const struct gralloc_drm_handle_t *handle)
+{
+	const struct gralloc_drm_format *fmt =
+		gralloc_drm_get_format(handle->format);
+	long size = 0;
+	int i;
+
+	if (!fmt)
+		return 0;
+
+	for (i = 0; i < fmt->plane_count; i++) {
+		size += (long) (handle->width / fmt->planes[i].hsub) *
+			(handle->height / fmt->planes[i].vsub) *
+			fmt->planes[i].cpp;
+	}
+
+	return size;
+}
+
+/*
+ * Write a report of all bo's of the process to buf, which is always NUL
+ * terminated when len is positive.  Return the length of the whole report,
+ * which is truncated when that is not less than len.  The bo's are not
+ * locked; their lock state may be stale by the time it is printed.
+ */
+int gralloc_drm_dump(struct gralloc_drm_t *drm, char *buf, int len)
+{
+	static const char *parked_names[] = { "live", "cached", "pooled" };
+	static const char *domain_names[GRALLOC_DRM_DOMAIN_COUNT] = {
+		"default", "cached", "wc", "vram"
+	};
+	struct gralloc_drm_dump dump = { buf, len, 0 };
+	struct gralloc_drm_mem_info info;
+	long total[3] = { 0, 0, 0 }, waste = 0, natural, sum;
+	int count[3] = { 0, 0, 0 }, imported = 0, locked = 0;
+	int64_t now = gralloc_drm_get_time_ms();
+	int index;
+
+	if (len > 0)
+		buf[0] = '\0';
+
+	gralloc_drm_get_mem_info(drm, &info);
+
+	dump_printf(&dump, "%-8s %11s %5s %8s %6s %9s %9s %5s %7s %4s %8s %3s %8s %6s\n",
+			"id", "size", "fmt", "usage", "stride",
+			"bytes", "waste", "tiled", "domain", "fb",
+			"lock", "imp", "age(s)", "state");
+
+	pthread_mutex_lock(&slot_table.mutex);
+	for (index = 0; index < slot_table.count; index++) {
+		struct gralloc_drm_slot *slot = slot_get_locked(index);
+		struct gralloc_drm_bo_t *bo = slot->bo;
+		const struct gralloc_drm_handle_t *handle;
+		char dims[16];
+		long size;
+		int parked;
+
+		if (!bo || bo->drm != drm)
+			continue;
+
+		handle = bo->handle;
+		size = bo_get_size(bo);
+		natural = bo_natural_size(handle);
+		parked = (bo->parked >= GRALLOC_DRM_BO_LIVE &&
+			  bo->parked <= GRALLOC_DRM_BO_POOLED) ?
+			bo->parked : GRALLOC_DRM_BO_LIVE;
+
+		snprintf(dims, sizeof(dims), "%dx%d",
+				handle->width, handle->height);
+		dump_printf(&dump, "%08x %11s %5d %08x %6d %9ld %9ld %5s %7s %4d %3d/%04x %3s %8lld %6s\n",
+				handle->data, dims, handle->format,
+				handle->usage, handle->stride, size,
+				(size > natural) ? size - natural : 0,
+				(bo->tiled) ? "yes" : "no",
+				(bo->domain >= 0 &&
+				 bo->domain < GRALLOC_DRM_DOMAIN_COUNT) ?
+				domain_names[bo->domain] : "?",
+				bo->fb_id, bo->lock_count,
+				bo->locked_for & 0xffff,
+				(bo->imported) ? "yes" : "no",
+				(long long) (now - bo->create_time) / 1000,
+				parked_names[parked]);
+
+		count[parked]++;
+		total[parked] += size;
+		if (size > natural)
+			waste += size - natural;
+		if (bo->imported)
+			imported++;
+		if (bo->lock_count)
+			locked++;
+	}
+	pthread_mutex_unlock(&slot_table.mutex);
+
+	dump_printf(&dump, "live: %d bo's, %ld bytes (%d imported, %d locked)\n",
+			count[GRALLOC_DRM_BO_LIVE], total[GRALLOC_DRM_BO_LIVE],
+			imported, locked);
+	dump_printf(&dump, "cached: %d bo's, %ld bytes; pooled: %d bo's, %ld bytes\n",
+			count[GRALLOC_DRM_BO_CACHED],
+			total[GRALLOC_DRM_BO_CACHED],
+			count[GRALLOC_DRM_BO_POOLED],
+			total[GRALLOC_DRM_BO_POOLED]);
+	sum = total[0] + total[1] + total[2];
+	dump_printf(&dump, "padding: %ld of %ld bytes (%ld%%)\n", waste,
+			sum, (sum) ? waste * 100 / sum : 0);
+	dump_printf(&dump, "owned %ld, imported %ld, peak %ld, budget %ld bytes\n",
+			info.owned, info.imported, info.peak, info.budget);
+
+	return dump.pos;
+}
+
+/*
+ * Return the key of a handle in the import table.  A dma-buf is identified by
+ * its inode, as every process (and every registration) gets a different fd.
+ */
+static uint64_t import_key(const struct gralloc_drm_handle_t *handle)
+{
+	int fd = gralloc_drm_handle_prime_fd(handle);
+	struct stat st;
+
+	if (fd >= 0 && !fstat(fd, &st))
+		return (1ULL << 63) | (uint64_t) st.st_ino;
+
+	return (uint64_t) (uint32_t) handle->name;
+}
+
+/*
+ * Return true if two handles, with their keys, describe the same buffer.  A
+ * buffer recycled by the bo cache of the owner keeps its name but may change
+ * its metadata.
+ */
+static int import_match(const struct gralloc_drm_handle_t *h, uint64_t h_key,
+		const struct gralloc_drm_handle_t *handle, uint64_t key)
+{
+	return (h_key == key &&
+		h->width == handle->width &&
+		h->height == handle->height &&
+		h->format == handle->format &&
+		h->usage == handle->usage &&
+		h->stride == handle->stride);
+}
+
+/*
+ * Look up an imported bo and reference it.  The table must be locked.  A
+ * buffer that another thread is still opening is waited for.
+ */
+static struct gralloc_drm_bo_t *import_lookup_locked(
+		struct gralloc_drm_import_table *table,
+		const struct gralloc_drm_handle_t *handle, uint64_t key)
+{
+	struct gralloc_drm_import_pending *pending;
+	struct gralloc_drm_bo_t *bo;
+	int bucket = key % GRALLOC_DRM_IMPORT_BUCKETS;
+
+	for (;;) {
+		for (bo = table->buckets[bucket]; bo; bo = bo->import_next) {
+			if (import_match(bo->handle, bo->import_key,
+						handle, key)) {
+				bo->import_refcount++;
+				return bo;
+			}
+		}
+
+		for (pending = table->pending; pending;
+		     pending = pending->next) {
+			if (import_match(pending->handle, pending->key,
+						handle, key))
+				break;
+		}
+
+		/* there is no bo either when the other thread fails */
+		if (!pending)
+			return NULL;
+
+		pthread_cond_wait(&table->cond, &table->mutex);
+	}
+}
+
+/*
+ * Import the buffer of a handle from another process.  The buffer is opened
+ * once and the bo is shared by all handles of the buffer in this process.
+ * Other threads registering the buffer while it is opened wait for it
+ * instead of opening it again.
+ */
+static struct gralloc_drm_bo_t *import_bo(struct gralloc_drm_t *drm,
+		const struct gralloc_drm_handle_t *handle)
+{
+	struct gralloc_drm_import_table *table = &drm->imports;
+	struct gralloc_drm_import_pending pending, **p;
+	struct gralloc_drm_handle_t *copy;
+	struct gralloc_drm_bo_t *bo;
+	uint64_t key = import_key(handle);
+	int bucket, id, err;
+
+	pthread_mutex_lock(&table->mutex);
+
+	bo = import_lookup_locked(table, handle, key);
+	if (bo) {
+		table->hits++;
+		pthread_mutex_unlock(&table->mutex);
+		return bo;
+	}
+	table->misses++;
+
+	pending.handle = handle;
+	pending.key = key;
+	pending.next = table->pending;
+	table->pending = &pending;
+
+	pthread_mutex_unlock(&table->mutex);
+
+	/* the bo outlives the handle it is first registered with */
+	copy = slot_alloc(&bo);
+	if (copy) {
+		id = copy->data;
+		memcpy(copy, handle, sizeof(*copy));
+		copy->data_owner = gralloc_drm_get_pid();
+		copy->data = id;
+
+		/* create the struct gralloc_drm_bo_t locally */
+		err = drm->drv->alloc(drm->drv, copy, bo);
+		if (err)
+			slot_retire(copy, 0);
+	}
+	else {
+		err = -ENOMEM;
+	}
+
+	if (!err) {
+		bo->drm = drm;
+		bo->imported = 1;
+		bo->handle = copy;
+		bo->create_time = gralloc_drm_get_time_ms();
+		bo->import_refcount = 1;
+		bo->import_key = key;
+
+		/* the fd belongs to the registering handle */
+		gralloc_drm_handle_set_prime_fd(copy, -1);
+
+		mem_account(bo, 1);
+		slot_publish(bo);
+	}
+
+	pthread_mutex_lock(&table->mutex);
+
+	for (p = &table->pending; *p != &pending; p = &(*p)->next)
+		;
+	*p = pending.next;
+
+	if (!err) {
+		bucket = key % GRALLOC_DRM_IMPORT_BUCKETS;
+		bo->import_next = table->buckets[bucket];
+		table->buckets[bucket] = bo;
+		table->count++;
+	}
+
+	pthread_cond_broadcast(&table->cond);
+	pthread_mutex_unlock(&table->mutex);
+
+	return (err) ? NULL : bo;
+}
+
+/*
+ * Drop a reference to an imported bo, and free it when it is the last one.
+ */
+static void import_unref(struct gralloc_drm_bo_t *bo)
+{
+	struct gralloc_drm_import_table *table = &bo->drm->imports;
+	int last;
+
+	pthread_mutex_lock(&table->mutex);
+
+	last = (--bo->import_refcount == 0);
+	if (last) {
+		struct gralloc_drm_bo_t **p;
+		int bucket = bo->import_key % GRALLOC_DRM_IMPORT_BUCKETS;
+
+		for (p = &table->buckets[bucket]; *p; p = &(*p)->import_next) {
+			if (*p == bo) {
+				*p = bo->import_next;
+				table->count--;
+				break;
+			}
+		}
+	}
+
+	pthread_mutex_unlock(&table->mutex);
+
+	if (last)
+		bo_free(bo);
+}
+
+/*
+ * Validate a buffer handle and return the associated bo.
+ */
+static struct gralloc_drm_bo_t *validate_handle(buffer_handle_t _handle,
+		struct gralloc_drm_t *drm)
+{
+	struct gralloc_drm_handle_t *handle = gralloc_drm_handle(_handle);
+
+	if (!handle)
+		return NULL;
+
+	/* the buffer handle is passed to a new process */
+	if (unlikely(handle->data_owner != gralloc_drm_pid)) {
+		struct gralloc_drm_bo_t *bo;
+
+		/* check only */
+		if (!drm)
+			return NULL;
+
+		if (handle->name || gralloc_drm_handle_prime_fd(handle) >= 0)
+			bo = import_bo(drm, handle);
+		else /* an invalid handle */
+			bo = NULL;
+
+		handle->data_owner = gralloc_drm_get_pid();
+		handle->data = (bo) ? bo->handle->data : 0;
+	}
+
+	return slot_lookup(handle->data);
+}
+
+/*
+ * Register a buffer handle.
+ */
+int gralloc_drm_handle_register(buffer_handle_t handle, struct gralloc_drm_t *drm)
+{
+	int err;
+
+	GRALLOC_DRM_TRACE_BEGIN(REGISTER);
+	err = (validate_handle(handle, drm)) ? 0 : -EINVAL;
+	GRALLOC_DRM_TRACE_END(REGISTER);
+
+	return err;
+}
+
+/*
+ * Unregister a buffer handle.  It is no-op for handles created locally.
+ */
+int gralloc_drm_handle_unregister(buffer_handle_t _handle)
+{
+	struct gralloc_drm_handle_t *handle = gralloc_drm_handle(_handle);
+	struct gralloc_drm_bo_t *bo;
+
+	bo = validate_handle(_handle, NULL);
+	if (!bo)
+		return -EINVAL;
+
+	if (bo->imported) {
+		handle->data_owner = 0;
+		handle->data = 0;
+		import_unref(bo);
+	}
+
+	return 0;
+}
+
+/*
+ * Create a buffer handle, together with the storage of its bo.
+ */
+static struct gralloc_drm_handle_t *
+create_bo_handle(int width, int height, int format, int usage,
+		struct gralloc_drm_bo_t **bo)
+{
+	struct gralloc_drm_handle_t *handle;
+
+	handle = slot_alloc(bo);
 	if (!handle)
 		return NULL;
 
-	bo = drm->drv->alloc(drm->drv, handle);
-	if (!bo) {
-		free(handle);
-		return NULL;
+	handle->base.version = sizeof(handle->base);
+	gralloc_drm_handle_set_prime_fd(handle, -1);
+
+	handle->magic = GRALLOC_DRM_HANDLE_MAGIC;
+	handle->width = width;
+	handle->height = height;
+	handle->format = format;
+	handle->usage = usage;
+
+	return handle;
+}
+
+/*
+ * Free a bo for real.
+ */
+static void bo_free(struct gralloc_drm_bo_t *bo)
+{
+	/* imported bo's have their own copies of the handles */
+	struct gralloc_drm_handle_t *handle = bo->handle;
+
+	if (bo->fb_id)
+		gralloc_drm_bo_rm_fb(bo);
+	map_cache_drop(bo);
+	mem_account(bo, 0);
+
+	bo->drm->drv->free(bo->drm->drv, bo);
+
+	if (gralloc_drm_handle_prime_fd(handle) >= 0)
+		close(handle->prime_fd);
+	slot_retire(handle, 0);
+}
+
+/*
+ * Return the size of a bo, as reported by the driver or as computed from the
+ * stride.
+ */
+static long bo_get_size(const struct gralloc_drm_bo_t *bo)
+{
+	int width = bo->handle->width, height = bo->handle->height;
+
+	if (bo->size)
+		return bo->size;
+
+	gralloc_drm_align_geometry(bo->handle->format, &width, &height);
+
+	return (long) bo->handle->stride * height;
+}
+
+/*
+ * Return the approximate size of a bo before it is allocated.
+ */
+static long bo_estimate_size(int width, int height, int format)
+{
+	int cpp = gralloc_drm_get_bpp(format);
+
+	gralloc_drm_align_geometry(format, &width, &height);
+
+	return (long) width * height * ((cpp) ? cpp : 4);
+}
+
+/*
+ * Return true if a bo has the layout the drivers would give to a bo with the
+ * given aligned geometry, format and usage.
+ */
+static int bo_match(const struct gralloc_drm_bo_t *bo,
+		int aligned_width, int aligned_height, int format, int usage)
+{
+	const struct gralloc_drm_handle_t *handle = bo->handle;
+	int w = handle->width, h = handle->height;
+
+	gralloc_drm_align_geometry(handle->format, &w, &h);
+
+	return (w == aligned_width && h == aligned_height &&
+		handle->format == format &&
+		(handle->usage & GRALLOC_DRM_USAGE_CLASS_MASK) ==
+		(usage & GRALLOC_DRM_USAGE_CLASS_MASK));
+}
+
+/*
+ * Give a recycled bo the dimensions and usage of a new allocation.
+ */
+static void bo_retarget(struct gralloc_drm_bo_t *bo,
+		int width, int height, int usage)
+{
+	struct gralloc_drm_handle_t *handle = bo->handle;
+
+	/* the fb has the old dimensions */
+	if (bo->fb_id && (handle->width != width || handle->height != height))
+		gralloc_drm_bo_rm_fb(bo);
+
+	handle->width = width;
+	handle->height = height;
+
+	/* account the bo to its new usage class */
+	if (mem_class(handle->usage) != mem_class(usage)) {
+		mem_account(bo, 0);
+		handle->usage = usage;
+		mem_account(bo, 1);
+	}
+	else {
+		handle->usage = usage;
+	}
+}
+
+/*
+ * Return the cache bucket and the (approximate) size of a bo with the given
+ * parameters.  Buffers with the same aligned geometry, format and usage class
+ * get the same layout from the drivers.
+ */
+static int bo_cache_bucket(int width, int height, int format, int usage,
+		int *aligned_width, int *aligned_height)
+{
+	unsigned int hash;
+
+	gralloc_drm_align_geometry(format, &width, &height);
+	*aligned_width = width;
+	*aligned_height = height;
+
+	hash = (unsigned int) width * 31 + (unsigned int) height;
+	hash = hash * 31 + (unsigned int) format;
+	hash = hash * 31 + (unsigned int) (usage & GRALLOC_DRM_USAGE_CLASS_MASK);
+
+	return (int) (hash % GRALLOC_DRM_BO_CACHE_BUCKETS);
+}
+
+/*
+ * Initialize the bo cache.  The size of the cache, in KiB, can be overridden
+ * by debug.drm.bo_cache_kb; 0 disables it.  Recycled bo's are zeroed in the
+ * background unless debug.drm.zero is "sync".
+ */
+static void bo_cache_init(struct gralloc_drm_t *drm)
+{
+	struct gralloc_drm_bo_cache *cache = &drm->bo_cache;
+	char value[PROPERTY_VALUE_MAX];
+
+	pthread_mutex_init(&cache->mutex, NULL);
+	pthread_cond_init(&cache->zero_cond, NULL);
+
+	cache->max_size = GRALLOC_DRM_BO_CACHE_MAX_SIZE;
+	cache->max_age_ms = GRALLOC_DRM_BO_CACHE_MAX_AGE_MS;
+	cache->zero_mode = GRALLOC_DRM_ZERO_ASYNC;
+
+	if (property_get("debug.drm.bo_cache_kb", value, NULL))
+		cache->max_size = atol(value) * 1024;
+	if (property_get("debug.drm.zero", value, NULL) &&
+	    !strcmp(value, "sync"))
+		cache->zero_mode = GRALLOC_DRM_ZERO_SYNC;
+	/* for systems where all the clients of gralloc trust each other */
+	if (property_get("debug.drm.bo_cache_exported", value, NULL))
+		cache->keep_exported = atoi(value);
+}
+
+/*
+ * Link a bo into its bucket, keeping the bucket sorted from the most recently
+ * freed bo to the least.  The cache must be locked.
+ */
+static void bo_cache_link_locked(struct gralloc_drm_bo_cache *cache,
+		struct gralloc_drm_bo_t *bo)
+{
+	int bucket = bo->cache_bucket;
+	struct gralloc_drm_bo_t *next = cache->heads[bucket];
+
+	while (next && next->cache_time > bo->cache_time)
+		next = next->cache_next;
+
+	bo->cache_next = next;
+	bo->cache_prev = (next) ? next->cache_prev : cache->tails[bucket];
+
+	if (bo->cache_prev)
+		bo->cache_prev->cache_next = bo;
+	else
+		cache->heads[bucket] = bo;
+
+	if (next)
+		next->cache_prev = bo;
+	else
+		cache->tails[bucket] = bo;
+
+	cache->count++;
+	cache->size += bo->cache_size;
+	if (bo->needs_zero)
+		cache->dirty++;
+
+	bo->parked = GRALLOC_DRM_BO_CACHED;
+}
+
+/*
+ * Unlink a bo from its bucket.  The cache must be locked.
+ */
+static void bo_cache_unlink_locked(struct gralloc_drm_bo_cache *cache,
+		struct gralloc_drm_bo_t *bo)
+{
+	int bucket = bo->cache_bucket;
+
+	if (bo->cache_prev)
+		bo->cache_prev->cache_next = bo->cache_next;
+	else
+		cache->heads[bucket] = bo->cache_next;
+
+	if (bo->cache_next)
+		bo->cache_next->cache_prev = bo->cache_prev;
+	else
+		cache->tails[bucket] = bo->cache_prev;
+
+	bo->cache_prev = NULL;
+	bo->cache_next = NULL;
+
+	cache->count--;
+	cache->size -= bo->cache_size;
+	if (bo->needs_zero)
+		cache->dirty--;
+
+	bo->parked = GRALLOC_DRM_BO_LIVE;
+}
+
+/*
+ * Evict bo's until the cache size is no more than max_size and no bo is older
+ * than max_age_ms.  The evicted bo's are returned as a list, to be freed
+ * after the cache is unlocked.
+ */
+static struct gralloc_drm_bo_t *bo_cache_evict_locked(
+		struct gralloc_drm_bo_cache *cache, long max_size, int64_t now)
+{
+	struct gralloc_drm_bo_t *evicted = NULL;
+
+	while (cache->count) {
+		struct gralloc_drm_bo_t *oldest = NULL;
+		int i;
+
+		/* the tail of each bucket is its oldest bo */
+		for (i = 0; i < GRALLOC_DRM_BO_CACHE_BUCKETS; i++) {
+			struct gralloc_drm_bo_t *bo = cache->tails[i];
+
+			if (bo && (!oldest || bo->cache_time < oldest->cache_time))
+				oldest = bo;
+		}
+
+		if (cache->size <= max_size &&
+		    now - oldest->cache_time <= cache->max_age_ms)
+			break;
+
+		bo_cache_unlink_locked(cache, oldest);
+		oldest->cache_next = evicted;
+		evicted = oldest;
+
+		cache->evictions++;
+	}
+
+	return evicted;
+}
+
+static void bo_cache_free_list(struct gralloc_drm_bo_t *list)
+{
+	while (list) {
+		struct gralloc_drm_bo_t *next = list->cache_next;
+
+		list->cache_next = NULL;
+		bo_free(list);
+		list = next;
+	}
+}
+
+/*
+ * Free all bo's in the cache and report its statistics.
+ */
+void gralloc_drm_bo_cache_trim(struct gralloc_drm_t *drm)
+{
+	struct gralloc_drm_bo_cache *cache = &drm->bo_cache;
+	struct gralloc_drm_bo_t *evicted;
+
+	pthread_mutex_lock(&cache->mutex);
+	evicted = bo_cache_evict_locked(cache, -1, gralloc_drm_get_time_ms());
+	LOGI("bo cache: %u hits, %u misses, %u evictions",
+			cache->hits, cache->misses, cache->evictions);
+	pthread_mutex_unlock(&cache->mutex);
+
+	bo_cache_free_list(evicted);
+}
+
+static void bo_cache_fini(struct gralloc_drm_t *drm)
+{
+	struct gralloc_drm_bo_cache *cache = &drm->bo_cache;
+
+	if (cache->zero_worker_started) {
+		pthread_mutex_lock(&cache->mutex);
+		cache->zero_worker_quit = 1;
+		pthread_cond_signal(&cache->zero_cond);
+		pthread_mutex_unlock(&cache->mutex);
+
+		pthread_join(cache->zero_worker, NULL);
+	}
+
+	gralloc_drm_bo_cache_trim(drm);
+	pthread_cond_destroy(&cache->zero_cond);
+	pthread_mutex_destroy(&cache->mutex);
+}
+
+/*
+ * Get the cache statistics.
+ */
+void gralloc_drm_bo_cache_get_stats(struct gralloc_drm_t *drm,
+		unsigned int *hits, unsigned int *misses, long *size)
+{
+	struct gralloc_drm_bo_cache *cache = &drm->bo_cache;
+
+	pthread_mutex_lock(&cache->mutex);
+	*hits = cache->hits;
+	*misses = cache->misses;
+	*size = cache->size;
+	pthread_mutex_unlock(&cache->mutex);
+}
+
+/*
+ * End CPU access to a mapped bo.  Nothing is to be ended when an async lock
+ * has not prepared the bo.
+ */
+static void bo_finish(struct gralloc_drm_bo_t *bo)
+{
+	struct gralloc_drm_drv_t *drv = bo->drm->drv;
+
+	if (bo->prepare_pending)
+		bo->prepare_pending = 0;
+	else if (drv->finish)
+		drv->finish(drv, bo);
+}
+
+/*
+ * Unmap a bo that is accessed by the CPU.
+ */
+static void bo_unmap(struct gralloc_drm_bo_t *bo)
+{
+	bo_finish(bo);
+	bo->drm->drv->unmap(bo->drm->drv, bo);
+}
+
+/*
+ * Zero a bo so that no content leaks between its users.
+ */
+static void bo_zero(struct gralloc_drm_bo_t *bo)
+{
+	long size = bo_get_size(bo);
+	void *addr;
+
+	/* the map cache may be unmapping the bo */
+	pthread_mutex_lock(&bo->lock_mutex);
+
+	if (!bo->drm->drv->map(bo->drm->drv, bo, 0, 0,
+				bo->handle->width, bo->handle->height,
+				1, &addr)) {
+		memset(addr, 0, size);
+		bo_unmap(bo);
+		bo->needs_zero = 0;
+	}
+	else {
+		LOGE("failed to map bo %p for zeroing", bo);
+	}
+
+	pthread_mutex_unlock(&bo->lock_mutex);
+}
+
+/*
+ * Zero the bo's in the cache in the background, so that bo_cache_get() can
+ * hand them out without paying for it.
+ */
+static void *bo_cache_zero_worker(void *arg)
+{
+	struct gralloc_drm_t *drm = (struct gralloc_drm_t *) arg;
+	struct gralloc_drm_bo_cache *cache = &drm->bo_cache;
+
+	setpriority(PRIO_PROCESS, 0, GRALLOC_DRM_WORKER_PRIORITY);
+
+	pthread_mutex_lock(&cache->mutex);
+
+	while (!cache->zero_worker_quit) {
+		struct gralloc_drm_bo_t *bo = NULL;
+		int i;
+
+		for (i = 0; cache->dirty && i < GRALLOC_DRM_BO_CACHE_BUCKETS; i++) {
+			for (bo = cache->heads[i]; bo; bo = bo->cache_next) {
+				if (bo->needs_zero)
+					break;
+			}
+			if (bo)
+				break;
+		}
+
+		if (!bo) {
+			pthread_cond_wait(&cache->zero_cond, &cache->mutex);
+			continue;
+		}
+
+		/* keep it away from bo_cache_get() while zeroing */
+		bo_cache_unlink_locked(cache, bo);
+		pthread_mutex_unlock(&cache->mutex);
+
+		bo_zero(bo);
+
+		pthread_mutex_lock(&cache->mutex);
+		bo_cache_link_locked(cache, bo);
+
+		/* give up on bo's that cannot be mapped */
+		if (bo->needs_zero)
+			pthread_cond_wait(&cache->zero_cond, &cache->mutex);
+	}
+
+	pthread_mutex_unlock(&cache->mutex);
+
+	return NULL;
+}
+
+/*
+ * Take a bo matching the parameters out of the cache.
+ */
+static struct gralloc_drm_bo_t *bo_cache_get(struct gralloc_drm_t *drm,
+		int width, int height, int format, int usage)
+{
+	struct gralloc_drm_bo_cache *cache = &drm->bo_cache;
+	struct gralloc_drm_bo_t *bo, *match, *evicted;
+	int aligned_width, aligned_height, bucket;
+	int64_t now;
+
+	if (!cache->max_size)
+		return NULL;
+
+	bucket = bo_cache_bucket(width, height, format, usage,
+			&aligned_width, &aligned_height);
+	now = gralloc_drm_get_time_ms();
+
+	pthread_mutex_lock(&cache->mutex);
+
+	evicted = bo_cache_evict_locked(cache, cache->max_size, now);
+
+	/* prefer a bo that is already zeroed */
+	match = NULL;
+	for (bo = cache->heads[bucket]; bo; bo = bo->cache_next) {
+		if (bo_match(bo, aligned_width, aligned_height, format, usage)) {
+			if (!bo->needs_zero)
+				break;
+			if (!match)
+				match = bo;
+		}
+	}
+	if (!bo)
+		bo = match;
+
+	if (bo) {
+		bo_cache_unlink_locked(cache, bo);
+		cache->hits++;
+	}
+	else {
+		cache->misses++;
+	}
+
+	pthread_mutex_unlock(&cache->mutex);
+
+	bo_cache_free_list(evicted);
+
+	if (bo) {
+		bo_retarget(bo, width, height, usage);
+		if (bo->needs_zero)
+			bo_zero(bo);
+	}
+
+	return bo;
+}
+
+/*
+ * Put a bo into the cache.  Return 0 when the cache takes the ownership of the
+ * bo.
+ */
+static int bo_cache_put(struct gralloc_drm_bo_t *bo)
+{
+	struct gralloc_drm_bo_cache *cache = &bo->drm->bo_cache;
+	struct gralloc_drm_handle_t *handle = bo->handle;
+	struct gralloc_drm_bo_t *evicted;
+	int aligned_width, aligned_height;
+
+	if (bo->imported || bo->lock_count || !cache->max_size)
+		return -EINVAL;
+
+	/*
+	 * a process that was given the handle may still hold the dma-buf, or
+	 * a GEM handle opened from the name, and would see what the next owner
+	 * writes
+	 */
+	if (bo->exported && !cache->keep_exported)
+		return -EPERM;
+
+	bo->cache_bucket = bo_cache_bucket(handle->width, handle->height,
+			handle->format, handle->usage,
+			&aligned_width, &aligned_height);
+
+	bo->cache_size = bo_get_size(bo);
+	if (bo->cache_size > cache->max_size)
+		return -ENOSPC;
+
+	bo->cache_time = gralloc_drm_get_time_ms();
+	bo->needs_zero = 1;
+
+	/* copies of the handle must not resolve to the bo once it is reused */
+	slot_retire(handle, 1);
+
+	/* a parked bo keeps no mapping; bo_zero maps it on its own */
+	map_cache_drop(bo);
+
+	pthread_mutex_lock(&cache->mutex);
+
+	bo_cache_link_locked(cache, bo);
+
+	if (cache->zero_mode == GRALLOC_DRM_ZERO_ASYNC) {
+		if (!cache->zero_worker_started) {
+			cache->zero_worker_started = !pthread_create(
+					&cache->zero_worker, NULL,
+					bo_cache_zero_worker, bo->drm);
+		}
+		pthread_cond_signal(&cache->zero_cond);
+	}
+
+	evicted = bo_cache_evict_locked(cache, cache->max_size, bo->cache_time);
+
+	pthread_mutex_unlock(&cache->mutex);
+
+	bo_cache_free_list(evicted);
+
+	return 0;
+}
+
+/*
+ * Export a bo as a dma-buf.  The GEM name set by the driver stays in the
+ * handle as the fallback for importers without PRIME.
+ */
+static void export_prime_fd(struct gralloc_drm_bo_t *bo)
+{
+	struct gralloc_drm_t *drm = bo->drm;
+	int fd;
+
+	if (!(drm->prime_caps & DRM_PRIME_CAP_EXPORT) || !bo->fb_handle)
+		return;
+
+	if (drmPrimeHandleToFD(drm->fd, bo->fb_handle, DRM_CLOEXEC, &fd)) {
+		LOGW("failed to export bo %p as dma-buf", bo);
+		return;
+	}
+
+	gralloc_drm_handle_set_prime_fd(bo->handle, fd);
+}
+
+/*
+ * Allocate a new bo from the driver.
+ */
+static struct gralloc_drm_bo_t *bo_alloc(struct gralloc_drm_t *drm,
+		int width, int height, int format, int usage)
+{
+	struct gralloc_drm_bo_t *bo;
+	struct gralloc_drm_handle_t *handle;
+
+	handle = create_bo_handle(width, height, format, usage, &bo);
+	if (!handle)
+		return NULL;
+
+	if (drm->drv->alloc(drm->drv, handle, bo)) {
+		slot_retire(handle, 0);
+		return NULL;
+	}
+
+	bo->drm = drm;
+	bo->imported = 0;
+	bo->handle = handle;
+	bo->create_time = gralloc_drm_get_time_ms();
+
+	/* Android expects the buffer to be zeroed */
+	if (bo->needs_zero)
+		bo_zero(bo);
+
+	mem_account(bo, 1);
+
+	handle->data_owner = gralloc_drm_get_pid();
+	slot_publish(bo);
+
+	return bo;
+}
+
+/*
+ * Initialize the warm pool.  The pool keeps a few bo's of the shapes that are
+ * allocated over and over (the display sized buffers mostly) allocated ahead
+ * of time, so that such allocations do not wait for the driver.  Its size, in
+ * KiB, can be overridden by debug.drm.bo_pool_kb; 0 disables it.
+ */
+static void bo_pool_init(struct gralloc_drm_t *drm)
+{
+	struct gralloc_drm_bo_pool *pool = &drm->bo_pool;
+	char value[PROPERTY_VALUE_MAX];
+
+	pthread_mutex_init(&pool->mutex, NULL);
+	pthread_cond_init(&pool->cond, NULL);
+
+	pool->max_size = GRALLOC_DRM_BO_POOL_MAX_SIZE;
+	if (property_get("debug.drm.bo_pool_kb", value, NULL))
+		pool->max_size = atol(value) * 1024;
+}
+
+/*
+ * Return the shape with the given aligned geometry, format and usage class,
+ * or NULL.  The pool must be locked.
+ */
+static struct gralloc_drm_bo_pool_shape *bo_pool_find_shape_locked(
+		struct gralloc_drm_bo_pool *pool, int aligned_width,
+		int aligned_height, int format, int usage)
+{
+	int i;
+
+	usage &= GRALLOC_DRM_USAGE_CLASS_MASK;
+	for (i = 0; i < GRALLOC_DRM_BO_POOL_SHAPES; i++) {
+		struct gralloc_drm_bo_pool_shape *shape = &pool->shapes[i];
+		int w = shape->width, h = shape->height;
+
+		if (!w || shape->format != format || shape->usage != usage)
+			continue;
+
+		/* shapes keep the requested geometry, which bo's are made of */
+		gralloc_drm_align_geometry(format, &w, &h);
+		if (w == aligned_width && h == aligned_height)
+			return shape;
+	}
+
+	return NULL;
+}
+
+static int bo_pool_shape_is_warm(const struct gralloc_drm_bo_pool_shape *shape)
+{
+	return (shape->pinned ||
+		shape->requests >= GRALLOC_DRM_BO_POOL_MIN_REQUESTS);
+}
+
+/*
+ * Take the bo's of a shape out of the pool.  They are returned as a list, to
+ * be freed after the pool is unlocked.
+ */
+static struct gralloc_drm_bo_t *bo_pool_drain_locked(
+		struct gralloc_drm_bo_pool *pool,
+		const struct gralloc_drm_bo_pool_shape *shape)
+{
+	struct gralloc_drm_bo_t **link = &pool->bos, *drained = NULL;
+	int w = 0, h = 0;
+
+	if (shape) {
+		w = shape->width;
+		h = shape->height;
+		gralloc_drm_align_geometry(shape->format, &w, &h);
+	}
+
+	while (*link) {
+		struct gralloc_drm_bo_t *bo = *link;
+
+		if (!shape || bo_match(bo, w, h, shape->format, shape->usage)) {
+			*link = bo->cache_next;
+			bo->cache_next = drained;
+			drained = bo;
+			pool->size -= bo->cache_size;
+		}
+		else {
+			link = &bo->cache_next;
+		}
+	}
+
+	return drained;
+}
+
+/*
+ * Forget the shapes that have not been allocated for a while, together with
+ * their bo's.
+ */
+static struct gralloc_drm_bo_t *bo_pool_expire_locked(
+		struct gralloc_drm_bo_pool *pool, int64_t now)
+{
+	struct gralloc_drm_bo_t *expired = NULL;
+	int i;
+
+	for (i = 0; i < GRALLOC_DRM_BO_POOL_SHAPES; i++) {
+		struct gralloc_drm_bo_pool_shape *shape = &pool->shapes[i];
+		struct gralloc_drm_bo_t *drained, *tail;
+
+		if (!shape->width || shape->pinned ||
+		    now - shape->last_use <= GRALLOC_DRM_BO_POOL_IDLE_MS)
+			continue;
+
+		drained = bo_pool_drain_locked(pool, shape);
+		if (drained) {
+			for (tail = drained; tail->cache_next; tail = tail->cache_next)
+				;
+			tail->cache_next = expired;
+			expired = drained;
+		}
+
+		memset(shape, 0, sizeof(*shape));
+	}
+
+	return expired;
+}
+
+/*
+ * Return a warm shape that is short of bo's and fits in the pool and the
+ * memory budget.
+ */
+static struct gralloc_drm_bo_pool_shape *bo_pool_next_shape_locked(
+		struct gralloc_drm_t *drm, struct gralloc_drm_bo_pool *pool)
+{
+	int i;
+
+	if (pool->suspended)
+		return NULL;
+
+	for (i = 0; i < GRALLOC_DRM_BO_POOL_SHAPES; i++) {
+		struct gralloc_drm_bo_pool_shape *shape = &pool->shapes[i];
+		long size;
+
+		if (!shape->width || !bo_pool_shape_is_warm(shape) ||
+		    shape->count >= GRALLOC_DRM_BO_POOL_DEPTH)
+			continue;
+
+		size = bo_estimate_size(shape->width, shape->height,
+				shape->format);
+		if (pool->size + size <= pool->max_size &&
+		    mem_fits(drm, size))
+			return shape;
+	}
+
+	return NULL;
+}
+
+/*
+ * Keep the pool filled in the background.
+ */
+static void *bo_pool_worker(void *arg)
+{
+	struct gralloc_drm_t *drm = (struct gralloc_drm_t *) arg;
+	struct gralloc_drm_bo_pool *pool = &drm->bo_pool;
+
+	setpriority(PRIO_PROCESS, 0, GRALLOC_DRM_WORKER_PRIORITY);
+
+	pthread_mutex_lock(&pool->mutex);
+
+	while (!pool->worker_quit) {
+		struct gralloc_drm_bo_pool_shape *shape, wanted;
+		struct gralloc_drm_bo_t *bo;
+		struct timespec ts;
+
+		bo = bo_pool_expire_locked(pool, gralloc_drm_get_time_ms());
+		if (bo) {
+			pthread_mutex_unlock(&pool->mutex);
+			bo_cache_free_list(bo);
+			pthread_mutex_lock(&pool->mutex);
+			continue;
+		}
+
+		shape = bo_pool_next_shape_locked(drm, pool);
+		if (!shape) {
+			clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_sec += GRALLOC_DRM_BO_POOL_PERIOD_MS / 1000;
+			pthread_cond_timedwait(&pool->cond, &pool->mutex, &ts);
+			continue;
+		}
+
+		wanted = *shape;
+		pthread_mutex_unlock(&pool->mutex);
+
+		bo = bo_alloc(drm, wanted.width, wanted.height,
+				wanted.format, wanted.usage);
+
+		pthread_mutex_lock(&pool->mutex);
+
+		if (!bo) {
+			LOGW("failed to pre-allocate a %dx%d bo",
+					wanted.width, wanted.height);
+			pool->suspended = 1;
+			continue;
+		}
+
+		bo->cache_size = bo_get_size(bo);
+
+		/* the shape may have expired, or the pool been trimmed */
+		gralloc_drm_align_geometry(wanted.format,
+				&wanted.width, &wanted.height);
+		shape = bo_pool_find_shape_locked(pool, wanted.width,
+				wanted.height, wanted.format, wanted.usage);
+		if (!shape || pool->suspended ||
+		    pool->size + bo->cache_size > pool->max_size) {
+			pool->suspended = 1;
+			pthread_mutex_unlock(&pool->mutex);
+			bo_free(bo);
+			pthread_mutex_lock(&pool->mutex);
+			continue;
+		}
+
+		bo->cache_next = pool->bos;
+		pool->bos = bo;
+		pool->size += bo->cache_size;
+		bo->parked = GRALLOC_DRM_BO_POOLED;
+		shape->count++;
+	}
+
+	pthread_mutex_unlock(&pool->mutex);
+
+	return NULL;
+}
+
+/*
+ * Add a shape to the pool, replacing the least recently used one when the
+ * pool is full.  The worker is woken up when the shape turns warm.
+ */
+static void bo_pool_add_shape(struct gralloc_drm_t *drm,
+		int width, int height, int format, int usage, int pinned)
+{
+	struct gralloc_drm_bo_pool *pool = &drm->bo_pool;
+	struct gralloc_drm_bo_pool_shape *shape;
+	struct gralloc_drm_bo_t *drained = NULL;
+	int aligned_width = width, aligned_height = height;
+	int64_t now;
+	int i;
+
+	if (!pool->max_size)
+		return;
+
+	gralloc_drm_align_geometry(format, &aligned_width, &aligned_height);
+	usage &= GRALLOC_DRM_USAGE_CLASS_MASK;
+	now = gralloc_drm_get_time_ms();
+
+	pthread_mutex_lock(&pool->mutex);
+
+	shape = bo_pool_find_shape_locked(pool, aligned_width, aligned_height,
+			format, usage);
+	if (!shape) {
+		for (i = 0; i < GRALLOC_DRM_BO_POOL_SHAPES; i++) {
+			struct gralloc_drm_bo_pool_shape *s = &pool->shapes[i];
+
+			if (!s->width) {
+				shape = s;
+				break;
+			}
+			if (!s->pinned &&
+			    (!shape || s->last_use < shape->last_use))
+				shape = s;
+		}
+		if (!shape) {
+			pthread_mutex_unlock(&pool->mutex);
+			return;
+		}
+
+		if (shape->width)
+			drained = bo_pool_drain_locked(pool, shape);
+
+		memset(shape, 0, sizeof(*shape));
+		shape->width = width;
+		shape->height = height;
+		shape->format = format;
+		shape->usage = usage;
+	}
+
+	if (pinned)
+		shape->pinned = 1;
+	else
+		shape->requests++;
+	shape->last_use = now;
+
+	if (bo_pool_shape_is_warm(shape)) {
+		pool->suspended = 0;
+		if (!pool->worker_started) {
+			pool->worker_started = !pthread_create(&pool->worker,
+					NULL, bo_pool_worker, drm);
+		}
+		pthread_cond_signal(&pool->cond);
+	}
+
+	pthread_mutex_unlock(&pool->mutex);
+
+	bo_cache_free_list(drained);
+}
+
+/*
+ * Make the pool keep bo's of the given shape, for as long as it lives.
+ */
+void gralloc_drm_bo_pool_add_shape(struct gralloc_drm_t *drm,
+		int width, int height, int format, int usage)
+{
+	bo_pool_add_shape(drm, width, height, format, usage, 1);
+}
+
+/*
+ * Take a bo matching the parameters out of the pool.
+ */
+static struct gralloc_drm_bo_t *bo_pool_get(struct gralloc_drm_t *drm,
+		int width, int height, int format, int usage)
+{
+	struct gralloc_drm_bo_pool *pool = &drm->bo_pool;
+	struct gralloc_drm_bo_pool_shape *shape;
+	struct gralloc_drm_bo_t **link, *bo = NULL;
+	int aligned_width = width, aligned_height = height;
+
+	if (!pool->max_size)
+		return NULL;
+
+	gralloc_drm_align_geometry(format, &aligned_width, &aligned_height);
+
+	pthread_mutex_lock(&pool->mutex);
+
+	shape = bo_pool_find_shape_locked(pool, aligned_width, aligned_height,
+			format, usage);
+	if (shape) {
+		for (link = &pool->bos; *link; link = &(*link)->cache_next) {
+			if (bo_match(*link, aligned_width, aligned_height,
+						format, usage)) {
+				bo = *link;
+				*link = bo->cache_next;
+				bo->cache_next = NULL;
+				bo->parked = GRALLOC_DRM_BO_LIVE;
+				break;
+			}
+		}
+
+		shape->last_use = gralloc_drm_get_time_ms();
+	}
+
+	if (bo) {
+		pool->size -= bo->cache_size;
+		shape->count--;
+		pool->hits++;
+
+		/* refill */
+		pool->suspended = 0;
+		pthread_cond_signal(&pool->cond);
+	}
+	else {
+		pool->misses++;
+	}
+
+	pthread_mutex_unlock(&pool->mutex);
+
+	if (bo)
+		bo_retarget(bo, width, height, usage);
+
+	return bo;
+}
+
+/*
+ * Free all bo's in the pool and report its statistics.  The pool is not
+ * refilled until the next allocation.
+ */
+void gralloc_drm_bo_pool_trim(struct gralloc_drm_t *drm)
+{
+	struct gralloc_drm_bo_pool *pool = &drm->bo_pool;
+	struct gralloc_drm_bo_t *drained;
+	int i;
+
+	pthread_mutex_lock(&pool->mutex);
+	drained = bo_pool_drain_locked(pool, NULL);
+	for (i = 0; i < GRALLOC_DRM_BO_POOL_SHAPES; i++)
+		pool->shapes[i].count = 0;
+	pool->suspended = 1;
+	LOGI("bo pool: %u hits, %u misses", pool->hits, pool->misses);
+	pthread_mutex_unlock(&pool->mutex);
+
+	bo_cache_free_list(drained);
+}
+
+static void bo_pool_fini(struct gralloc_drm_t *drm)
+{
+	struct gralloc_drm_bo_pool *pool = &drm->bo_pool;
+
+	if (pool->worker_started) {
+		pthread_mutex_lock(&pool->mutex);
+		pool->worker_quit = 1;
+		pthread_cond_signal(&pool->cond);
+		pthread_mutex_unlock(&pool->mutex);
+
+		pthread_join(pool->worker, NULL);
+	}
+
+	gralloc_drm_bo_pool_trim(drm);
+	pthread_cond_destroy(&pool->cond);
+	pthread_mutex_destroy(&pool->mutex);
+}
+
+/*
+ * Return a dma-buf fd of a bo.  The fd is exported for the occasion, and owned
+ * by the caller, when the handle of the bo has none.
+ */
+static int bo_get_dma_buf(struct gralloc_drm_bo_t *bo, int *owned)
+{
+	struct gralloc_drm_t *drm = bo->drm;
+	int fd = gralloc_drm_handle_prime_fd(bo->handle);
+
+	*owned = 0;
+	if (fd >= 0)
+		return fd;
+
+	if (!(drm->prime_caps & DRM_PRIME_CAP_EXPORT) || !bo->fb_handle ||
+	    drmPrimeHandleToFD(drm->fd, bo->fb_handle, DRM_CLOEXEC, &fd))
+		return -1;
+
+	*owned = 1;
+
+	return fd;
+}
+
+/*
+ * Get the GEM handle of a bo on the primary node, for the fb objects.  That
+ * is fb_handle unless the bo is from the render node, in which case the bo is
+ * imported by its dma-buf.  The handle is put back once the fb holds the bo.
+ */
+int gralloc_drm_bo_get_kms_handle(struct gralloc_drm_bo_t *bo, uint32_t *handle)
+{
+	struct gralloc_drm_t *drm = bo->drm;
+	int fd, owned, ret;
+
+	if (!drm->render_node) {
+		*handle = bo->fb_handle;
+		return 0;
+	}
+
+	fd = bo_get_dma_buf(bo, &owned);
+	if (fd < 0) {
+		LOGE("bo %p has no dma-buf to scan out from", bo);
+		return -EINVAL;
+	}
+
+	ret = drmPrimeFDToHandle(drm->kms_fd, fd, handle);
+	if (owned)
+		close(fd);
+
+	if (ret) {
+		LOGE("failed to import bo %p to %s", bo, GRALLOC_DRM_DEVICE);
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+/*
+ * Put back a handle from gralloc_drm_bo_get_kms_handle().
+ */
+void gralloc_drm_bo_put_kms_handle(struct gralloc_drm_bo_t *bo, uint32_t handle)
+{
+	struct drm_gem_close args;
+
+	if (!bo->drm->render_node)
+		return;
+
+	memset(&args, 0, sizeof(args));
+	args.handle = handle;
+	drmIoctl(bo->drm->kms_fd, DRM_IOCTL_GEM_CLOSE, &args);
+}
+
+/*
+ * Create a bo.  Recently freed bo's are reused first, then bo's from the
+ * warm pool.  Shapes that keep missing both are taught to the pool.
+ */
+struct gralloc_drm_bo_t *gralloc_drm_bo_create(struct gralloc_drm_t *drm,
+		int width, int height, int format, int usage)
+{
+	struct gralloc_drm_bo_t *bo;
+
+	GRALLOC_DRM_TRACE_BEGIN(ALLOC);
+
+	bo = bo_cache_get(drm, width, height, format, usage);
+	if (!bo)
+		bo = bo_pool_get(drm, width, height, format, usage);
+
+	if (!bo && !mem_reserve(drm, bo_estimate_size(width, height, format))) {
+		bo = bo_alloc(drm, width, height, format, usage);
+		if (bo)
+			bo_pool_add_shape(drm, width, height, format, usage, 0);
+	}
+
+	GRALLOC_DRM_TRACE_END(ALLOC);
+
+	return bo;
+}
+
+/*
+ * Destroy a bo.  Locally created bo's are recycled through the bo cache, and
+ * imported bo's are freed with their last reference.
+ */
+void gralloc_drm_bo_destroy(struct gralloc_drm_bo_t *bo)
+{
+	/* the presenter may still post it, or have it on screen */
+	if (gralloc_drm_bo_defer_destroy(bo))
+		return;
+	bo->present_doomed = 0;
+
+	if (bo->imported)
+		import_unref(bo);
+	else if (bo_cache_put(bo))
+		bo_free(bo);
+}
+
+/*
+ * Return the bo of a registered handle.
+ */
+struct gralloc_drm_bo_t *gralloc_drm_bo_from_handle(buffer_handle_t handle)
+{
+	return validate_handle(handle, NULL);
+}
+
+/*
+ * Export a bo before its handle is first given out.  The dma-buf is made only
+ * now, and only bo's that were never given out are recycled: whoever got the
+ * handle may keep the bo open after it is destroyed.
+ */
+int gralloc_drm_bo_export(struct gralloc_drm_bo_t *bo)
+{
+	struct gralloc_drm_handle_t *handle = bo->handle;
+
+	if (bo->imported || bo->exported)
+		return 0;
+
+	if (gralloc_drm_handle_prime_fd(handle) < 0)
+		export_prime_fd(bo);
+
+	/* there are no GEM names on render nodes */
+	if (!handle->name && gralloc_drm_handle_prime_fd(handle) < 0) {
+		LOGE("bo %p can be shared neither by name nor by dma-buf", bo);
+		return -EINVAL;
+	}
+
+	bo->exported = 1;
+
+	return 0;
+}
+
+/*
+ * Get the buffer handle and stride of a bo.  The bo is exported, as the
+ * handle may be shared from now on.
+ */
+buffer_handle_t gralloc_drm_bo_get_handle(struct gralloc_drm_bo_t *bo, int *stride)
+{
+	gralloc_drm_bo_export(bo);
+
+	if (stride)
+		*stride = bo->handle->stride;
+	return &bo->handle->base;
+}
+
+/*
+ * Clip a lock rectangle to the bo.  Planar bo's are always locked as a whole
+ * as their chroma planes lie outside of the rectangle.
+ */
+static void bo_clip_rect(const struct gralloc_drm_bo_t *bo,
+		int *x, int *y, int *w, int *h)
+{
+	const struct gralloc_drm_format *fmt =
+		gralloc_drm_get_format(bo->handle->format);
+	int width = bo->handle->width, height = bo->handle->height;
+
+	if (fmt && fmt->plane_count > 1)
+		*w = 0;
+
+	if (*x < 0) {
+		*w += *x;
+		*x = 0;
+	}
+	if (*y < 0) {
+		*h += *y;
+		*y = 0;
+	}
+	if (*x + *w > width)
+		*w = width - *x;
+	if (*y + *h > height)
+		*h = height - *y;
+
+	if (*w <= 0 || *h <= 0) {
+		*x = 0;
+		*y = 0;
+		*w = width;
+		*h = height;
+	}
+}
+
+/*
+ * Return true if the mapping of a bo covers the given rectangle.
+ */
+static int bo_map_covers(const struct gralloc_drm_bo_t *bo,
+		int x, int y, int w, int h)
+{
+	return (x >= bo->map_x && y >= bo->map_y &&
+		x + w <= bo->map_x + bo->map_w &&
+		y + h <= bo->map_y + bo->map_h);
+}
+
+/*
+ * Map a box of a bo.  The lock mutex must be held.
+ */
+static int bo_map_locked(struct gralloc_drm_bo_t *bo,
+		int x, int y, int w, int h, int write)
+{
+	/* the driver is supposed to wait for the bo */
+	int err = bo->drm->drv->map(bo->drm->drv, bo,
+			x, y, w, h, write, &bo->map_addr);
+
+	if (!err) {
+		bo->map_write = write;
+		bo->map_x = x;
+		bo->map_y = y;
+		bo->map_w = w;
+		bo->map_h = h;
 	}
 
-	bo->drm = drm;
-	bo->imported = 0;
-	bo->handle = handle;
+	return err;
+}
 
-	handle->data_owner = gralloc_drm_get_pid();
-	handle->data = (int) bo;
+/*
+ * Initialize the map cache.  Mappings of unlocked bo's are kept so that the
+ * next lock does not pay for mmap and page faults again, for drivers that
+ * can prepare a mapped bo for CPU access.  The address space the cache may
+ * hold, in KiB, can be overridden by debug.drm.map_cache_kb; 0 disables it.
+ */
+static void map_cache_init(struct gralloc_drm_t *drm)
+{
+	struct gralloc_drm_map_cache *cache = &drm->map_cache;
+	char value[PROPERTY_VALUE_MAX];
 
-	return bo;
+	pthread_mutex_init(&cache->mutex, NULL);
+
+	cache->max_size = GRALLOC_DRM_MAP_CACHE_MAX_SIZE;
+	if (property_get("debug.drm.map_cache_kb", value, NULL))
+		cache->max_size = atol(value) * 1024;
+	if (!drm->drv->prepare)
+		cache->max_size = 0;
+}
+
+static void map_cache_unlink_locked(struct gralloc_drm_map_cache *cache,
+		struct gralloc_drm_bo_t *bo)
+{
+	if (bo->map_prev)
+		bo->map_prev->map_next = bo->map_next;
+	else
+		cache->head = bo->map_next;
+
+	if (bo->map_next)
+		bo->map_next->map_prev = bo->map_prev;
+	else
+		cache->tail = bo->map_prev;
+
+	bo->map_prev = NULL;
+	bo->map_next = NULL;
+	bo->map_cached = 0;
+
+	cache->count--;
+	cache->size -= bo->map_size;
 }
 
 /*
- * Destroy a bo.
+ * Unmap the least recently unlocked bo's until the cache size is no more
+ * than max_size.  Bo's that are being locked are skipped, as their lock
+ * mutexes cannot be taken in this order.
  */
-void gralloc_drm_bo_destroy(struct gralloc_drm_bo_t *bo)
+static void map_cache_evict_locked(struct gralloc_drm_map_cache *cache,
+		long max_size)
 {
-	struct gralloc_drm_handle_t *handle = bo->handle;
-	int imported = bo->imported;
+	struct gralloc_drm_bo_t *bo, *prev;
 
-	bo->drm->drv->free(bo->drm->drv, bo);
-	if (imported) {
-		handle->data_owner = 0;
-		handle->data = 0;
+	for (bo = cache->tail; bo && cache->size > max_size; bo = prev) {
+		prev = bo->map_prev;
+
+		if (pthread_mutex_trylock(&bo->lock_mutex))
+			continue;
+
+		map_cache_unlink_locked(cache, bo);
+		bo->drm->drv->unmap(bo->drm->drv, bo);
+		bo->map_addr = NULL;
+		cache->evictions++;
+
+		pthread_mutex_unlock(&bo->lock_mutex);
 	}
-	else {
-		free(handle);
+}
+
+/*
+ * Keep the mapping of a bo that is no longer locked.  Return 0 when the
+ * cache takes the mapping.  The lock mutex of the bo must be held.
+ */
+static int map_cache_put(struct gralloc_drm_bo_t *bo)
+{
+	struct gralloc_drm_map_cache *cache = &bo->drm->map_cache;
+
+	bo->map_size = bo_get_size(bo);
+	if (bo->map_size > cache->max_size)
+		return -ENOSPC;
+
+	bo_finish(bo);
+
+	pthread_mutex_lock(&cache->mutex);
+
+	bo->map_prev = NULL;
+	bo->map_next = cache->head;
+	if (cache->head)
+		cache->head->map_prev = bo;
+	else
+		cache->tail = bo;
+	cache->head = bo;
+	bo->map_cached = 1;
+
+	cache->count++;
+	cache->size += bo->map_size;
+
+	map_cache_evict_locked(cache, cache->max_size);
+
+	pthread_mutex_unlock(&cache->mutex);
+
+	return 0;
+}
+
+/*
+ * Take the kept mapping of a bo out of the cache, and reuse it when it covers
+ * the rectangle.  Return 0 when the mapping is reused; it is unmapped
+ * otherwise.  Unless prepare is false, the bo is prepared for CPU access.
+ * The lock mutex of the bo must be held.
+ */
+static int map_cache_reuse(struct gralloc_drm_bo_t *bo,
+		int x, int y, int w, int h, int write, int prepare)
+{
+	struct gralloc_drm_map_cache *cache = &bo->drm->map_cache;
+	struct gralloc_drm_drv_t *drv = bo->drm->drv;
+	int err = -EINVAL;
+
+	pthread_mutex_lock(&cache->mutex);
+	map_cache_unlink_locked(cache, bo);
+	pthread_mutex_unlock(&cache->mutex);
+
+	if (bo_map_covers(bo, x, y, w, h) && (!write || bo->map_write))
+		err = (prepare) ? drv->prepare(drv, bo, x, y, w, h, write) : 0;
+
+	if (err) {
+		drv->unmap(drv, bo);
+		bo->map_addr = NULL;
+	}
+
+	pthread_mutex_lock(&cache->mutex);
+	if (!err)
+		cache->hits++;
+	else
+		cache->misses++;
+	pthread_mutex_unlock(&cache->mutex);
+
+	return err;
+}
+
+/*
+ * Drop the kept mapping of a bo that is being freed.
+ */
+static void map_cache_drop(struct gralloc_drm_bo_t *bo)
+{
+	struct gralloc_drm_map_cache *cache = &bo->drm->map_cache;
+
+	pthread_mutex_lock(&cache->mutex);
+	if (bo->map_cached) {
+		map_cache_unlink_locked(cache, bo);
+		bo->drm->drv->unmap(bo->drm->drv, bo);
+		bo->map_addr = NULL;
 	}
+	pthread_mutex_unlock(&cache->mutex);
 }
 
 /*
- * Return the bo of a registered handle.
+ * Unmap all bo's in the map cache that are not being locked, and report its
+ * statistics.
  */
-struct gralloc_drm_bo_t *gralloc_drm_bo_from_handle(buffer_handle_t handle)
+void gralloc_drm_map_cache_trim(struct gralloc_drm_t *drm)
 {
-	return validate_handle(handle, NULL);
+	struct gralloc_drm_map_cache *cache = &drm->map_cache;
+
+	pthread_mutex_lock(&cache->mutex);
+	map_cache_evict_locked(cache, -1);
+	LOGI("map cache: %u hits, %u misses, %u evictions",
+			cache->hits, cache->misses, cache->evictions);
+	pthread_mutex_unlock(&cache->mutex);
+}
+
+static void map_cache_fini(struct gralloc_drm_t *drm)
+{
+	gralloc_drm_map_cache_trim(drm);
+	pthread_mutex_destroy(&drm->map_cache.mutex);
 }
 
 /*
- * Get the buffer handle and stride of a bo.
+ * Return 1 if the GPU is still using a bo in a way that conflicts with CPU
+ * access, 0 if not, or a negative errno when that cannot be told.  The
+ * driver is asked first, and then the dma-buf of the bo is polled.
  */
-buffer_handle_t gralloc_drm_bo_get_handle(struct gralloc_drm_bo_t *bo, int *stride)
+static int bo_busy(struct gralloc_drm_bo_t *bo, int write)
 {
-	if (stride)
-		*stride = bo->handle->stride;
-	return &bo->handle->base;
+	struct gralloc_drm_drv_t *drv = bo->drm->drv;
+	struct pollfd pfd;
+	int busy, owned;
+
+	if (drv->busy) {
+		busy = drv->busy(drv, bo, write);
+		if (busy >= 0)
+			return busy;
+	}
+
+	pfd.fd = bo_get_dma_buf(bo, &owned);
+	if (pfd.fd < 0)
+		return -ENOSYS;
+
+	/* readable when the writes are done, writable when all access is */
+	pfd.events = (write) ? POLLOUT : POLLIN;
+	pfd.revents = 0;
+	busy = poll(&pfd, 1, 0);
+	if (busy >= 0)
+		busy = !busy;
+	else
+		busy = -errno;
+
+	if (owned)
+		close(pfd.fd);
+
+	return busy;
 }
 
 /*
- * Lock a bo.  XXX thread-safety?
+ * Export a sync file that signals when the CPU may access a bo.
  */
-int gralloc_drm_bo_lock(struct gralloc_drm_bo_t *bo,
+static int bo_export_fence(struct gralloc_drm_bo_t *bo, int write)
+{
+	struct dma_buf_export_sync_file arg;
+	int fd, owned, err;
+
+	fd = bo_get_dma_buf(bo, &owned);
+	if (fd < 0)
+		return -ENOSYS;
+
+	memset(&arg, 0, sizeof(arg));
+	arg.flags = (write) ? DMA_BUF_SYNC_WRITE : DMA_BUF_SYNC_READ;
+	arg.fd = -1;
+	err = ioctl(fd, DMA_BUF_IOCTL_EXPORT_SYNC_FILE, &arg);
+
+	if (owned)
+		close(fd);
+
+	return (err) ? -errno : arg.fd;
+}
+
+/*
+ * Return the read locks of a bo that a thread holds.
+ */
+static int bo_reader_count(struct gralloc_drm_bo_t *bo, pthread_t thread)
+{
+	int i;
+
+	for (i = 0; i < GRALLOC_DRM_LOCK_READERS; i++) {
+		if (bo->readers[i].count &&
+		    pthread_equal(bo->readers[i].thread, thread))
+			return bo->readers[i].count;
+	}
+
+	return 0;
+}
+
+/*
+ * Add read locks of a thread.  Those of threads beyond readers[] are only
+ * counted; a lock that conflicts with them fails with -EDEADLK rather than
+ * wait, as its thread may hold one of them.
+ */
+static void bo_reader_add(struct gralloc_drm_bo_t *bo, pthread_t thread,
+		int count)
+{
+	int i, free = -1;
+
+	for (i = 0; i < GRALLOC_DRM_LOCK_READERS; i++) {
+		if (!bo->readers[i].count) {
+			if (free < 0)
+				free = i;
+		}
+		else if (pthread_equal(bo->readers[i].thread, thread)) {
+			bo->readers[i].count += count;
+			return;
+		}
+	}
+
+	if (free >= 0) {
+		bo->readers[free].thread = thread;
+		bo->readers[free].count = count;
+	}
+	else {
+		bo->untracked_readers += count;
+	}
+}
+
+/*
+ * Remove read locks of a thread.  A thread without read locks unlocks for
+ * another thread; an untracked lock is released then, or else one of the
+ * first reader.
+ */
+static void bo_reader_remove(struct gralloc_drm_bo_t *bo, pthread_t thread,
+		int count)
+{
+	int i;
+
+	for (i = 0; i < GRALLOC_DRM_LOCK_READERS; i++) {
+		if (bo->readers[i].count &&
+		    pthread_equal(bo->readers[i].thread, thread)) {
+			bo->readers[i].count -= count;
+			return;
+		}
+	}
+
+	if (bo->untracked_readers) {
+		bo->untracked_readers--;
+		return;
+	}
+
+	for (i = 0; i < GRALLOC_DRM_LOCK_READERS; i++) {
+		if (bo->readers[i].count) {
+			bo->readers[i].count--;
+			return;
+		}
+	}
+}
+
+/*
+ * Lock a bo.  SW readers share the lock and a single mapping of the bo, while
+ * a SW writer holds the lock exclusively and may lock the bo again.  Locks
+ * that conflict with the holders wait for them to unlock, or fail with
+ * -EBUSY for GRALLOC_DRM_LOCK_NONBLOCK.  The read locks of a thread are
+ * upgraded in place once the thread is the only holder.  A second holder
+ * that would wait for the others, to upgrade or to grow the mapping, fails
+ * with -EDEADLK, as the two would wait for each other.
+ *
+ * Only the locked rectangle is mapped.  A lock outside of the mapped box
+ * waits for the other threads to unlock, and then grows the mapping.
+ *
+ * The first SW lock makes device writes visible to the CPU, through map or
+ * prepare, and the last unlock makes CPU writes visible to the device,
+ * through finish.  GRALLOC_DRM_LOCK_NONBLOCK fails with -EBUSY instead of
+ * waiting for the GPU.  GRALLOC_DRM_LOCK_ASYNC does not wait for the GPU
+ * when the bo still has a kept mapping, and returns a sync file that the
+ * caller must wait for before accessing the bo; fence_fd is -1 otherwise.
+ * BO_LOCK_ANY_USAGE, for the copies of the core, skips the usage check.
+ */
+#define BO_LOCK_ANY_USAGE (1 << 16)
+
+static int bo_lock(struct gralloc_drm_bo_t *bo,
 		int usage, int x, int y, int w, int h,
-		void **addr)
+		void **addr, int flags, int *fence_fd)
 {
-	if ((bo->handle->usage & usage) != usage) {
+	pthread_t self = pthread_self();
+	int write = !!(usage & GRALLOC_USAGE_SW_WRITE_MASK);
+	int sw = !!(usage & (GRALLOC_USAGE_SW_WRITE_MASK |
+			     GRALLOC_USAGE_SW_READ_MASK));
+	int held, upgraded = 0, fence = -1;
+	int err = 0;
+
+	if ((bo->handle->usage & usage) != usage &&
+	    !(flags & BO_LOCK_ANY_USAGE)) {
 		/* make FB special for testing software renderer with */
 		if (!(bo->handle->usage & GRALLOC_USAGE_HW_FB))
 			return -EINVAL;
 	}
 
-	/* allow multiple locks with compatible usages */
-	if (bo->lock_count && (bo->locked_for & usage) != usage)
-		return -EINVAL;
+	bo_clip_rect(bo, &x, &y, &w, &h);
 
-	usage |= bo->locked_for;
+	/* a posted bo is written only once the presenter is done with it */
+	if (write && bo->present_pending) {
+		if (flags & GRALLOC_DRM_LOCK_NONBLOCK)
+			return -EBUSY;
+		gralloc_drm_bo_wait_release(bo);
+	}
 
-	if (usage & (GRALLOC_USAGE_SW_WRITE_MASK |
-		     GRALLOC_USAGE_SW_READ_MASK)) {
-		/* the driver is supposed to wait for the bo */
-		int write = !!(usage & GRALLOC_USAGE_SW_WRITE_MASK);
-		int err = bo->drm->drv->map(bo->drm->drv, bo,
-				x, y, w, h, write, addr);
-		if (err)
-			return err;
+	pthread_mutex_lock(&bo->lock_mutex);
+
+	for (;;) {
+		int owner = (bo->writer_depth &&
+			     pthread_equal(bo->writer, self));
+		int alone, conflict = 0;
+
+		/* another thread may have unlocked for this one */
+		held = bo_reader_count(bo, self);
+		alone = owner || (held && held == bo->lock_count);
+
+		if (!owner) {
+			if (write && alone) {
+				/* upgrade */
+				bo_reader_remove(bo, self, held);
+				bo->writer_depth = held;
+				bo->writer = self;
+				upgraded = 1;
+			}
+			else if (bo->writer_depth ||
+				 (write && bo->lock_count)) {
+				conflict = 1;
+			}
+		}
+
+		if (!conflict && sw && bo->map_count && !alone &&
+		    !bo_map_covers(bo, x, y, w, h))
+			conflict = 1;
+
+		if (!conflict)
+			break;
+
+		if (flags & GRALLOC_DRM_LOCK_NONBLOCK) {
+			pthread_mutex_unlock(&bo->lock_mutex);
+			return -EBUSY;
+		}
+
+		/* two holders waiting for each other would never wake */
+		if ((held && bo->holder_waiting) ||
+		    (!held && bo->untracked_readers)) {
+			pthread_mutex_unlock(&bo->lock_mutex);
+			return -EDEADLK;
+		}
+
+		if (held)
+			bo->holder_waiting = 1;
+
+		pthread_cond_wait(&bo->lock_cond, &bo->lock_mutex);
+
+		if (held)
+			bo->holder_waiting = 0;
+	}
+
+	/* only a new or grown mapping waits for the GPU */
+	if (sw && (flags & (GRALLOC_DRM_LOCK_NONBLOCK |
+			    GRALLOC_DRM_LOCK_ASYNC)) &&
+	    (!bo->map_count || (write && !bo->map_write) ||
+	     !bo_map_covers(bo, x, y, w, h)) &&
+	    bo_busy(bo, write) > 0) {
+		if (flags & GRALLOC_DRM_LOCK_NONBLOCK) {
+			err = -EBUSY;
+		}
+		else if (!bo->map_count && bo->map_cached &&
+			 bo_map_covers(bo, x, y, w, h) &&
+			 (!write || bo->map_write)) {
+			fence = bo_export_fence(bo, write);
+			if (fence >= 0) {
+				map_cache_reuse(bo, x, y, w, h, write, 0);
+				bo->prepare_pending = 1;
+			}
+		}
+	}
+
+	if (err) {
+		/* nothing to map */
+	}
+	else if (fence >= 0) {
+		/* mapped without waiting */
+		bo->map_count++;
+		*addr = bo->map_addr;
+	}
+	else if (sw) {
+		int map_count = bo->map_count;
+
+		/*
+		 * Remap when the mapping is read-only or too small.  Only this
+		 * thread holds it, and keeps its box.
+		 */
+		if (map_count && ((write && !bo->map_write) ||
+				  !bo_map_covers(bo, x, y, w, h))) {
+			int old_x = bo->map_x, old_y = bo->map_y;
+			int old_w = bo->map_w, old_h = bo->map_h;
+			int old_write = bo->map_write;
+			int x2 = x + w, y2 = y + h;
+
+			if (x > old_x)
+				x = old_x;
+			if (y > old_y)
+				y = old_y;
+			if (x2 < old_x + old_w)
+				x2 = old_x + old_w;
+			if (y2 < old_y + old_h)
+				y2 = old_y + old_h;
+
+			bo_unmap(bo);
+
+			err = bo_map_locked(bo, x, y, x2 - x, y2 - y,
+					write || old_write);
+			if (err && bo_map_locked(bo, old_x, old_y,
+						old_w, old_h, old_write))
+				bo->map_count = 0;
+		}
+		else if (!map_count) {
+			if (!bo->map_cached ||
+			    map_cache_reuse(bo, x, y, w, h, write, 1))
+				err = bo_map_locked(bo, x, y, w, h, write);
+		}
+		else if (bo->prepare_pending) {
+			/* shared with an async lock; this one must wait */
+			err = bo->drm->drv->prepare(bo->drm->drv, bo,
+					bo->map_x, bo->map_y,
+					bo->map_w, bo->map_h, bo->map_write);
+			if (!err)
+				bo->prepare_pending = 0;
+		}
+
+		if (!err) {
+			bo->map_count++;
+			*addr = bo->map_addr;
+		}
 	}
 	else {
 		/* kernel handles the synchronization here */
 	}
 
-	bo->lock_count++;
-	bo->locked_for |= usage;
+	if (!err) {
+		if (write || bo->writer_depth) {
+			bo->writer_depth++;
+			bo->writer = self;
+		}
+		else {
+			/* remember who holds the lock for upgrades */
+			bo_reader_add(bo, self, 1);
+		}
+
+		bo->lock_count++;
+		bo->locked_for |= usage;
+	}
+	else if (upgraded) {
+		bo->writer_depth = 0;
+		bo_reader_add(bo, self, held);
+	}
+
+	pthread_mutex_unlock(&bo->lock_mutex);
+
+	if (fence_fd)
+		*fence_fd = fence;
+
+	return err;
+}
+
+/*
+ * Lock a bo, waiting for other threads and the GPU.
+ */
+int gralloc_drm_bo_lock(struct gralloc_drm_bo_t *bo,
+		int usage, int x, int y, int w, int h,
+		void **addr)
+{
+	int err;
+
+	GRALLOC_DRM_TRACE_BEGIN(LOCK);
+	err = bo_lock(bo, usage, x, y, w, h, addr, 0, NULL);
+	GRALLOC_DRM_TRACE_END(LOCK);
+
+	return err;
+}
+
+/*
+ * Lock a bo with GRALLOC_DRM_LOCK_* flags.  See bo_lock().
+ */
+int gralloc_drm_bo_lock_flags(struct gralloc_drm_bo_t *bo,
+		int usage, int x, int y, int w, int h,
+		int flags, void **addr, int *fence_fd)
+{
+	int err;
+
+	GRALLOC_DRM_TRACE_BEGIN(LOCK);
+	err = bo_lock(bo, usage, x, y, w, h, addr, flags, fence_fd);
+	GRALLOC_DRM_TRACE_END(LOCK);
+
+	return err;
+}
+
+/*
+ * Lock a planar YUV bo, and get where its planes are.  The planes follow the
+ * layout of the format at the stride the driver has chosen, and the whole bo
+ * is locked whatever the rectangle.
+ */
+int gralloc_drm_bo_lock_ycbcr(struct gralloc_drm_bo_t *bo,
+		int usage, int x, int y, int w, int h,
+		struct gralloc_drm_ycbcr *ycbcr)
+{
+	const struct gralloc_drm_handle_t *handle = bo->handle;
+	const struct gralloc_drm_format *fmt =
+		gralloc_drm_get_format(handle->format);
+	int offsets[GRALLOC_DRM_MAX_PLANES], pitches[GRALLOC_DRM_MAX_PLANES];
+	char *addr;
+	int err;
+
+	if (!fmt || fmt->plane_count < 2)
+		return -EINVAL;
+
+	gralloc_drm_format_get_layout(handle->format, handle->height,
+			handle->stride, offsets, pitches);
+
+	err = gralloc_drm_bo_lock(bo, usage, x, y, w, h, (void **) &addr);
+	if (err)
+		return err;
+
+	memset(ycbcr, 0, sizeof(*ycbcr));
+	ycbcr->y = addr;
+	ycbcr->ystride = pitches[0];
+	ycbcr->cstride = pitches[1];
+
+	if (fmt->plane_count == 3) {
+		ycbcr->cb = addr + offsets[(fmt->cr_first) ? 2 : 1];
+		ycbcr->cr = addr + offsets[(fmt->cr_first) ? 1 : 2];
+		ycbcr->chroma_step = 1;
+	}
+	else {
+		/* Cb and Cr are interleaved */
+		ycbcr->cb = addr + offsets[1] + ((fmt->cr_first) ? 1 : 0);
+		ycbcr->cr = addr + offsets[1] + ((fmt->cr_first) ? 0 : 1);
+		ycbcr->chroma_step = 2;
+	}
 
 	return 0;
 }
 
 /*
- * Unlock a bo.
+ * Copy a rectangle between two bo's of the same single-plane format with the
+ * CPU.  The bo's are locked like any other, so that the copy shares their
+ * mappings and waits for the GPU and the other lockers.
+ */
+void gralloc_drm_cpu_copy(struct gralloc_drm_drv_t *drv,
+		struct gralloc_drm_bo_t *dst,
+		struct gralloc_drm_bo_t *src,
+		short x1, short y1, short x2, short y2)
+{
+	const struct gralloc_drm_format *fmt =
+		gralloc_drm_get_format(src->handle->format);
+	int cpp, w, h, flags;
+	char *d, *s;
+
+	if (!fmt || fmt->plane_count != 1 ||
+	    dst->handle->format != src->handle->format) {
+		LOGE("cannot copy from format 0x%x to 0x%x",
+				src->handle->format, dst->handle->format);
+		return;
+	}
+	cpp = fmt->planes[0].cpp;
+
+	if (x1 < 0)
+		x1 = 0;
+	if (y1 < 0)
+		y1 = 0;
+	if (x2 > src->handle->width)
+		x2 = src->handle->width;
+	if (x2 > dst->handle->width)
+		x2 = dst->handle->width;
+	if (y2 > src->handle->height)
+		y2 = src->handle->height;
+	if (y2 > dst->handle->height)
+		y2 = dst->handle->height;
+	if (x1 >= x2 || y1 >= y2)
+		return;
+
+	w = x2 - x1;
+	h = y2 - y1;
+
+	if (bo_lock(src, GRALLOC_USAGE_SW_READ_OFTEN, x1, y1, w, h,
+				(void **) &s, BO_LOCK_ANY_USAGE, NULL)) {
+		LOGE("failed to lock bo %p for copying", src);
+		return;
+	}
+	if (bo_lock(dst, GRALLOC_USAGE_SW_WRITE_OFTEN, x1, y1, w, h,
+				(void **) &d, BO_LOCK_ANY_USAGE, NULL)) {
+		LOGE("failed to lock bo %p for copying", dst);
+		gralloc_drm_bo_unlock(src);
+		return;
+	}
+
+	flags = (dst->domain != GRALLOC_DRM_DOMAIN_CACHED) ?
+		GRALLOC_DRM_BLIT_STREAM : 0;
+
+	gralloc_drm_blit(d + dst->handle->stride * y1 + cpp * x1,
+			dst->handle->stride,
+			s + src->handle->stride * y1 + cpp * x1,
+			src->handle->stride, cpp * w, h, flags);
+
+	gralloc_drm_bo_unlock(dst);
+	gralloc_drm_bo_unlock(src);
+}
+
+/*
+ * Unlock a bo.  The mapping is released with the last holder that may use it,
+ * and kept in the map cache if possible.
  */
 void gralloc_drm_bo_unlock(struct gralloc_drm_bo_t *bo)
 {
-	int mapped = bo->locked_for &
-		(GRALLOC_USAGE_SW_WRITE_MASK | GRALLOC_USAGE_SW_READ_MASK);
+	GRALLOC_DRM_TRACE_BEGIN(UNLOCK);
 
-	if (!bo->lock_count)
+	pthread_mutex_lock(&bo->lock_mutex);
+
+	if (!bo->lock_count) {
+		pthread_mutex_unlock(&bo->lock_mutex);
+		GRALLOC_DRM_TRACE_END(UNLOCK);
 		return;
+	}
 
-	if (mapped)
-		bo->drm->drv->unmap(bo->drm->drv, bo);
+	/* the writer may be unlocked by another thread when it is alone */
+	if (bo->writer_depth && (pthread_equal(bo->writer, pthread_self()) ||
+				 bo->writer_depth == bo->lock_count))
+		bo->writer_depth--;
+	else
+		bo_reader_remove(bo, pthread_self(), 1);
 
+	/*
+	 * Unlock does not tell which lock is released; the mapping is kept
+	 * until there are fewer holders than users of the mapping.
+	 */
 	bo->lock_count--;
+	if (bo->map_count > bo->lock_count) {
+		bo->map_count = bo->lock_count;
+		if (!bo->map_count && map_cache_put(bo)) {
+			bo_unmap(bo);
+			bo->map_addr = NULL;
+		}
+	}
 	if (!bo->lock_count)
 		bo->locked_for = 0;
+
+	pthread_cond_broadcast(&bo->lock_cond);
+	pthread_mutex_unlock(&bo->lock_mutex);
+
+	GRALLOC_DRM_TRACE_END(UNLOCK);
+}
+
+/*
+ * Clean and/or invalidate the CPU caches for a rectangle of a locked bo, for
+ * clients that share a SW_READ_OFTEN or SW_WRITE_OFTEN bo with a device while
+ * keeping it locked.  Lock and unlock do the same for the whole mapping.
+ * After the fence of an async lock, this prepares the bo for CPU access.
+ */
+int gralloc_drm_bo_sync(struct gralloc_drm_bo_t *bo, int flags,
+		int x, int y, int w, int h)
+{
+	struct gralloc_drm_drv_t *drv = bo->drm->drv;
+	int err = 0;
+
+	if (!(flags & (GRALLOC_DRM_SYNC_CLEAN | GRALLOC_DRM_SYNC_INVALIDATE)))
+		return -EINVAL;
+
+	bo_clip_rect(bo, &x, &y, &w, &h);
+
+	pthread_mutex_lock(&bo->lock_mutex);
+
+	if (!bo->map_count || !bo_map_covers(bo, x, y, w, h)) {
+		err = -EINVAL;
+	}
+	else if (bo->prepare_pending) {
+		/* after the fence of an async lock */
+		err = drv->prepare(drv, bo, bo->map_x, bo->map_y,
+				bo->map_w, bo->map_h, bo->map_write);
+		if (!err)
+			bo->prepare_pending = 0;
+	}
+	else if (drv->sync) {
+		err = drv->sync(drv, bo, x, y, w, h, flags);
+	}
+
+	pthread_mutex_unlock(&bo->lock_mutex);
+
+	return err;
+}
+
+/*
+ * Return the dma-buf fd of a handle, or -1 if it is shared by name only.
+ */
+int
+gralloc_drm_get_prime_fd(buffer_handle_t _handle)
+{
+	struct gralloc_drm_handle_t *handle = gralloc_drm_handle(_handle);
+
+	return (handle) ? gralloc_drm_handle_prime_fd(handle) : -1;
 }
 
 /*
@@ -24,6 +24,7 @@
 #ifndef _GRALLOC_DRM_H_
 #define _GRALLOC_DRM_H_
 
+#include <stdint.h>
 #include <hardware/gralloc.h>
 
 #ifndef LOGE
@@ -48,7 +49,7 @@
 struct gralloc_drm_t;
 struct gralloc_drm_bo_t;
 
-struct gralloc_drm_t *gralloc_drm_create(void);
+struct gralloc_drm_t *gralloc_drm_create(int primary);
 void gralloc_drm_destroy(struct gralloc_drm_t *drm);
 
 int gralloc_drm_get_fd(struct gralloc_drm_t *drm);
@@ -64,91 +65,244 @@ int gralloc_drm_is_kms_initialized(struct gralloc_drm_t *drm);
 void gralloc_drm_get_kms_info(struct gralloc_drm_t *drm, struct framebuffer_device_t *fb);
 int gralloc_drm_is_kms_pipelined(struct gralloc_drm_t *drm);
 
+#define GRALLOC_DRM_MAX_PLANES 3
+
+/* the layout of a HAL pixel format, see gralloc_drm_format.c */
+struct gralloc_drm_format {
+	int format;      /* HAL_PIXEL_FORMAT_*, 0 for an unused slot */
+	uint32_t fourcc; /* DRM_FORMAT_*, 0 if KMS has none */
+	int align_w;     /* of the dimensions of the first plane, in pixels */
+	int align_h;
+	int cr_first;    /* Cr comes before Cb, in the planes or interleaved */
+	int plane_count;
+	struct {
+		int cpp;        /* bytes per pixel of the plane */
+		int hsub, vsub; /* subsampling against the first plane */
+	} planes[GRALLOC_DRM_MAX_PLANES];
+};
+
+/*
+ * HAL pixel formats are small numbers, except YV12 which is a fourcc and is
+ * given the last slot.
+ */
+#define GRALLOC_DRM_FORMAT_SLOTS 32
+
+extern const struct gralloc_drm_format gralloc_drm_formats[GRALLOC_DRM_FORMAT_SLOTS];
+
+/*
+ * Return the layout of a HAL pixel format, or NULL if it is not supported.
+ */
+static inline const struct gralloc_drm_format *gralloc_drm_get_format(int format)
+{
+	const struct gralloc_drm_format *fmt;
+
+	if (format > 0 && format < GRALLOC_DRM_FORMAT_SLOTS - 1)
+		fmt = &gralloc_drm_formats[format];
+	else if (format == HAL_PIXEL_FORMAT_YV12)
+		fmt = &gralloc_drm_formats[GRALLOC_DRM_FORMAT_SLOTS - 1];
+	else
+		return NULL;
+
+	return (fmt->format) ? fmt : NULL;
+}
+
+/*
+ * Return the bytes per pixel of a format, of the first plane for planar
+ * formats, or 0 if it is not supported.
+ */
 static inline int gralloc_drm_get_bpp(int format)
 {
-	int bpp;
-
-	switch (format) {
-	case HAL_PIXEL_FORMAT_RGBA_8888:
-	case HAL_PIXEL_FORMAT_RGBX_8888:
-	case HAL_PIXEL_FORMAT_BGRA_8888:
-		bpp = 4;
-		break;
-	case HAL_PIXEL_FORMAT_RGB_888:
-		bpp = 3;
-		break;
-	case HAL_PIXEL_FORMAT_RGB_565:
-	case HAL_PIXEL_FORMAT_RGBA_5551:
-	case HAL_PIXEL_FORMAT_RGBA_4444:
-	case HAL_PIXEL_FORMAT_YCbCr_422_I:
-		bpp = 2;
-		break;
-	/* planar; only Y is considered */
-	case HAL_PIXEL_FORMAT_YV12:
-	case HAL_PIXEL_FORMAT_YCbCr_422_SP:
-	case HAL_PIXEL_FORMAT_YCrCb_420_SP:
-		bpp = 1;
-		break;
-	default:
-		bpp = 0;
-		break;
-	}
+	const struct gralloc_drm_format *fmt = gralloc_drm_get_format(format);
 
-	return bpp;
+	return (fmt) ? fmt->planes[0].cpp : 0;
 }
 
+/*
+ * Align the dimensions of a bo of a format.  The height is then the number
+ * of rows, at the pitch of the first plane, that all the planes take.
+ */
 static inline void gralloc_drm_align_geometry(int format, int *width, int *height)
 {
-	int align_w = 1, align_h = 1, extra_height_div = 0;
-
-	switch (format) {
-	case HAL_PIXEL_FORMAT_YV12:
-		align_w = 32;
-		align_h = 2;
-		extra_height_div = 2;
-		break;
-	case HAL_PIXEL_FORMAT_YCbCr_422_SP:
-		align_w = 2;
-		extra_height_div = 1;
-		break;
-	case HAL_PIXEL_FORMAT_YCrCb_420_SP:
-		align_w = 2;
-		align_h = 2;
-		extra_height_div = 2;
-		break;
-	case HAL_PIXEL_FORMAT_YCbCr_422_I:
-		align_w = 2;
-		break;
-	}
+	const struct gralloc_drm_format *fmt = gralloc_drm_get_format(format);
+	int rows, num, den, i;
 
-	*width = ALIGN(*width, align_w);
-	*height = ALIGN(*height, align_h);
+	if (!fmt)
+		return;
 
-	if (extra_height_div)
-		*height += *height / extra_height_div;
+	*width = ALIGN(*width, fmt->align_w);
+	*height = ALIGN(*height, fmt->align_h);
+
+	/*
+	 * sum the rows of the planes as a fraction and round up, as a plane
+	 * of subsampled rows may end in the middle of a row of the first
+	 */
+	num = *height;
+	den = 1;
+	for (i = 1; i < fmt->plane_count; i++) {
+		int n = (*height / fmt->planes[i].vsub) * fmt->planes[i].cpp;
+		int d = fmt->planes[0].cpp * fmt->planes[i].hsub;
+
+		num = num * d + n * den;
+		den *= d;
+	}
+	rows = (num + den - 1) / den;
+
+	*height = rows;
 }
 
+int gralloc_drm_format_get_layout(int format, int height, int stride,
+		int offsets[GRALLOC_DRM_MAX_PLANES],
+		int pitches[GRALLOC_DRM_MAX_PLANES]);
+
 int gralloc_drm_handle_register(buffer_handle_t handle, struct gralloc_drm_t *drm);
 int gralloc_drm_handle_unregister(buffer_handle_t handle);
 
 struct gralloc_drm_bo_t *gralloc_drm_bo_create(struct gralloc_drm_t *drm, int width, int height, int format, int usage);
 void gralloc_drm_bo_destroy(struct gralloc_drm_bo_t *bo);
 
+void gralloc_drm_bo_cache_trim(struct gralloc_drm_t *drm);
+void gralloc_drm_bo_cache_get_stats(struct gralloc_drm_t *drm, unsigned int *hits, unsigned int *misses, long *size);
+void gralloc_drm_bo_pool_add_shape(struct gralloc_drm_t *drm, int width, int height, int format, int usage);
+void gralloc_drm_bo_pool_trim(struct gralloc_drm_t *drm);
+void gralloc_drm_map_cache_trim(struct gralloc_drm_t *drm);
+
+/* usage classes of the memory accounting */
+enum {
+	GRALLOC_DRM_MEM_FB,
+	GRALLOC_DRM_MEM_RENDER,
+	GRALLOC_DRM_MEM_TEXTURE,
+	GRALLOC_DRM_MEM_SW,
+	GRALLOC_DRM_MEM_OTHER,
+	GRALLOC_DRM_MEM_CLASS_COUNT
+};
+
+/* where the memory of a bo lives, as far as the driver tells */
+enum {
+	GRALLOC_DRM_DOMAIN_DEFAULT,
+	GRALLOC_DRM_DOMAIN_CACHED,      /* CPU cached */
+	GRALLOC_DRM_DOMAIN_WC,          /* write-combined or uncached */
+	GRALLOC_DRM_DOMAIN_VRAM,
+	GRALLOC_DRM_DOMAIN_COUNT
+};
+
+/* graphics memory of the process, in bytes */
+struct gralloc_drm_mem_info {
+	long owned;     /* allocated here, cached bo's included */
+	long imported;  /* registered from other processes */
+	long peak;      /* of owned + imported */
+	long cached;    /* in the bo cache and the warm pool */
+	long budget;    /* 0 when unlimited */
+	int count;      /* bo's */
+
+	long by_class[GRALLOC_DRM_MEM_CLASS_COUNT];
+	long by_domain[GRALLOC_DRM_DOMAIN_COUNT];
+	long tiled;
+};
+
+/* asked to release memory when an allocation would exceed the budget */
+typedef void (*gralloc_drm_mem_pressure_t)(void *data, long needed);
+
+void gralloc_drm_get_mem_info(struct gralloc_drm_t *drm, struct gralloc_drm_mem_info *info);
+void gralloc_drm_set_mem_pressure_callback(struct gralloc_drm_t *drm, gralloc_drm_mem_pressure_t callback, void *data);
+
+int gralloc_drm_dump(struct gralloc_drm_t *drm, char *buf, int len);
+
+/* hot paths that are traced */
+enum {
+	GRALLOC_DRM_TRACE_ALLOC,
+	GRALLOC_DRM_TRACE_REGISTER,
+	GRALLOC_DRM_TRACE_LOCK,
+	GRALLOC_DRM_TRACE_UNLOCK,
+	GRALLOC_DRM_TRACE_POST,
+	GRALLOC_DRM_TRACE_FLIP_WAIT,
+	GRALLOC_DRM_TRACE_VBLANK_WAIT,
+	GRALLOC_DRM_TRACE_COUNT
+};
+
+/* what tracing does, see gralloc_drm_trace_set_mode() */
+enum {
+	GRALLOC_DRM_TRACE_HISTOGRAMS = 1 << 0,
+	GRALLOC_DRM_TRACE_MARKERS    = 1 << 1, /* for systrace */
+};
+
+/*
+ * latencies of a trace point, in microseconds, of all threads; the
+ * percentiles are the largest latency of a histogram bucket, which is less
+ * than 25% above the true one, and max_us is exact
+ */
+struct gralloc_drm_trace_stats {
+	unsigned int count;
+	unsigned int p50_us;
+	unsigned int p99_us;
+	unsigned int max_us;
+};
+
+int gralloc_drm_trace_set_mode(int mode);
+int gralloc_drm_trace_get_stats(struct gralloc_drm_trace_stats *stats, int count);
+
 struct gralloc_drm_bo_t *gralloc_drm_bo_from_handle(buffer_handle_t handle);
+int gralloc_drm_bo_export(struct gralloc_drm_bo_t *bo);
 buffer_handle_t gralloc_drm_bo_get_handle(struct gralloc_drm_bo_t *bo, int *stride);
 
-int gralloc_drm_bo_lock(struct gralloc_drm_bo_t *bo, int x, int y, int w, int h, int enable_write, void **addr);
+int gralloc_drm_bo_lock(struct gralloc_drm_bo_t *bo, int usage, int x, int y, int w, int h, void **addr);
 void gralloc_drm_bo_unlock(struct gralloc_drm_bo_t *bo);
 
+enum {
+	GRALLOC_DRM_LOCK_NONBLOCK   = 1 << 0, /* fail with -EBUSY */
+	GRALLOC_DRM_LOCK_ASYNC      = 1 << 1, /* return a fence instead */
+};
+
+int gralloc_drm_bo_lock_flags(struct gralloc_drm_bo_t *bo, int usage, int x, int y, int w, int h, int flags, void **addr, int *fence_fd);
+
+/* the planes of a locked YUV bo, laid out as struct android_ycbcr */
+struct gralloc_drm_ycbcr {
+	void *y;
+	void *cb;
+	void *cr;
+	size_t ystride;
+	size_t cstride;
+	size_t chroma_step; /* between the samples of a chroma plane */
+	uint32_t reserved[8];
+};
+
+int gralloc_drm_bo_lock_ycbcr(struct gralloc_drm_bo_t *bo, int usage, int x, int y, int w, int h, struct gralloc_drm_ycbcr *ycbcr);
+
+enum {
+	GRALLOC_DRM_SYNC_CLEAN      = 1 << 0, /* make CPU writes visible */
+	GRALLOC_DRM_SYNC_INVALIDATE = 1 << 1, /* make device writes visible */
+};
+
+int gralloc_drm_bo_sync(struct gralloc_drm_bo_t *bo, int flags, int x, int y, int w, int h);
+
+enum {
+	GRALLOC_DRM_BLIT_STREAM     = 1 << 0, /* the destination is not cached */
+};
+
+void gralloc_drm_blit(void *dst, int dst_stride, const void *src, int src_stride, int size, int height, int flags);
+
 int gralloc_drm_bo_need_fb(const struct gralloc_drm_bo_t *bo);
 int gralloc_drm_bo_add_fb(struct gralloc_drm_bo_t *bo);
+int gralloc_drm_get_kms_fd(struct gralloc_drm_t *drm);
+int gralloc_drm_bo_get_kms_handle(struct gralloc_drm_bo_t *bo, uint32_t *handle);
+void gralloc_drm_bo_put_kms_handle(struct gralloc_drm_bo_t *bo, uint32_t handle);
 void gralloc_drm_bo_rm_fb(struct gralloc_drm_bo_t *bo);
 int gralloc_drm_bo_post(struct gralloc_drm_bo_t *bo);
 
-int gralloc_hal_to_drm_format(int hal_format);
-int gralloc_drm_format_bpp(int drm_format);
+/* a rectangle of the next post that changed; right and bottom are exclusive */
+struct gralloc_drm_rect {
+	int left, top, right, bottom;
+};
+
+int gralloc_drm_set_damage(struct gralloc_drm_t *drm, const struct gralloc_drm_rect *rects, int count);
+
+/* told when a posted bo has been presented, with the error of the post */
+typedef void (*gralloc_drm_release_t)(void *data, buffer_handle_t handle, int err);
+
+void gralloc_drm_set_release_callback(struct gralloc_drm_t *drm, gralloc_drm_release_t callback, void *data);
+void gralloc_drm_bo_wait_release(struct gralloc_drm_bo_t *bo);
 
 int gralloc_drm_gem_name(buffer_handle_t handle);
+int gralloc_drm_get_prime_fd(buffer_handle_t handle);
 
 int gralloc_kms_planes_init(struct gralloc_drm_t *drm);
 
@@ -0,0 +1,250 @@
+/*
+ * Copyright (C) 2010-2011 Chia-I Wu <olvaffe@gmail.com>
+ * Copyright (C) 2010-2011 LunarG Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * The row copies of the CPU blits.  Destinations that are not CPU cached,
+ * scanout buffers mostly, are written in whole cache lines with streaming
+ * stores so that the write-combining buffers are flushed full.
+ */
+
+#define LOG_TAG "GRALLOC-BLIT"
+
+#include <cutils/log.h>
+#include <cutils/properties.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#define BLIT_HAVE_NEON
+#endif
+
+/* AVX2 is picked at runtime, as the builds target plain SSE2 */
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__SSE2__) && \
+	(defined(__clang__) || __GNUC__ > 4 || \
+	 (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#include <immintrin.h>
+#define BLIT_HAVE_AVX2
+#endif
+
+#include "gralloc_drm.h"
+
+typedef void (*copy_row_func)(uint8_t *dst, const uint8_t *src, size_t size);
+
+static pthread_once_t blit_once = PTHREAD_ONCE_INIT;
+static copy_row_func copy_row_stream;
+static const char *copy_row_stream_name;
+static int blit_fence; /* streaming stores need a fence after the blit */
+
+static void copy_row_c(uint8_t *dst, const uint8_t *src, size_t size)
+{
+	memcpy(dst, src, size);
+}
+
+#ifdef __SSE2__
+static void copy_row_sse2_stream(uint8_t *dst, const uint8_t *src,
+		size_t size)
+{
+	size_t head = (16 - ((uintptr_t) dst & 15)) & 15;
+
+	/* the streaming stores need an aligned destination */
+	if (head > size)
+		head = size;
+	memcpy(dst, src, head);
+	dst += head;
+	src += head;
+	size -= head;
+
+	for (; size >= 64; size -= 64) {
+		__m128i a = _mm_loadu_si128((const __m128i *) (src + 0));
+		__m128i b = _mm_loadu_si128((const __m128i *) (src + 16));
+		__m128i c = _mm_loadu_si128((const __m128i *) (src + 32));
+		__m128i d = _mm_loadu_si128((const __m128i *) (src + 48));
+
+		_mm_stream_si128((__m128i *) (dst + 0), a);
+		_mm_stream_si128((__m128i *) (dst + 16), b);
+		_mm_stream_si128((__m128i *) (dst + 32), c);
+		_mm_stream_si128((__m128i *) (dst + 48), d);
+
+		dst += 64;
+		src += 64;
+	}
+
+	for (; size >= 16; size -= 16) {
+		_mm_stream_si128((__m128i *) dst,
+				_mm_loadu_si128((const __m128i *) src));
+		dst += 16;
+		src += 16;
+	}
+
+	memcpy(dst, src, size);
+}
+#endif /* __SSE2__ */
+
+#ifdef BLIT_HAVE_AVX2
+__attribute__((target("avx2")))
+static void copy_row_avx2_stream(uint8_t *dst, const uint8_t *src,
+		size_t size)
+{
+	size_t head = (32 - ((uintptr_t) dst & 31)) & 31;
+
+	if (head > size)
+		head = size;
+	memcpy(dst, src, head);
+	dst += head;
+	src += head;
+	size -= head;
+
+	for (; size >= 128; size -= 128) {
+		__m256i a = _mm256_loadu_si256((const __m256i *) (src + 0));
+		__m256i b = _mm256_loadu_si256((const __m256i *) (src + 32));
+		__m256i c = _mm256_loadu_si256((const __m256i *) (src + 64));
+		__m256i d = _mm256_loadu_si256((const __m256i *) (src + 96));
+
+		_mm256_stream_si256((__m256i *) (dst + 0), a);
+		_mm256_stream_si256((__m256i *) (dst + 32), b);
+		_mm256_stream_si256((__m256i *) (dst + 64), c);
+		_mm256_stream_si256((__m256i *) (dst + 96), d);
+
+		dst += 128;
+		src += 128;
+	}
+
+	for (; size >= 32; size -= 32) {
+		_mm256_stream_si256((__m256i *) dst,
+				_mm256_loadu_si256((const __m256i *) src));
+		dst += 32;
+		src += 32;
+	}
+
+	memcpy(dst, src, size);
+}
+#endif /* BLIT_HAVE_AVX2 */
+
+#ifdef BLIT_HAVE_NEON
+/*
+ * ARM has no streaming stores, but writing a whole 64-byte line at a time
+ * keeps the write buffer of a WC mapping full.
+ */
+static void copy_row_neon(uint8_t *dst, const uint8_t *src, size_t size)
+{
+	for (; size >= 64; size -= 64) {
+		uint8x16_t a = vld1q_u8(src + 0);
+		uint8x16_t b = vld1q_u8(src + 16);
+		uint8x16_t c = vld1q_u8(src + 32);
+		uint8x16_t d = vld1q_u8(src + 48);
+
+		__builtin_prefetch(src + 256);
+
+		vst1q_u8(dst + 0, a);
+		vst1q_u8(dst + 16, b);
+		vst1q_u8(dst + 32, c);
+		vst1q_u8(dst + 48, d);
+
+		dst += 64;
+		src += 64;
+	}
+
+	memcpy(dst, src, size);
+}
+#endif /* BLIT_HAVE_NEON */
+
+/*
+ * Pick the row copy for uncached destinations.  debug.drm.blit=c forces
+ * plain memcpy.
+ */
+static void blit_init(void)
+{
+	char value[PROPERTY_VALUE_MAX];
+
+	copy_row_stream = copy_row_c;
+	copy_row_stream_name = "c";
+
+	property_get("debug.drm.blit", value, "");
+	if (!strcmp(value, "c"))
+		goto out;
+
+#if defined(__SSE2__)
+	copy_row_stream = copy_row_sse2_stream;
+	copy_row_stream_name = "sse2";
+	blit_fence = 1;
+#endif
+#ifdef BLIT_HAVE_AVX2
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		copy_row_stream = copy_row_avx2_stream;
+		copy_row_stream_name = "avx2";
+	}
+#endif
+#ifdef BLIT_HAVE_NEON
+	copy_row_stream = copy_row_neon;
+	copy_row_stream_name = "neon";
+#endif
+
+out:
+	LOGI("using %s row copies for uncached destinations",
+			copy_row_stream_name);
+}
+
+/*
+ * Copy a rectangle of size bytes by height rows between two mappings.  The
+ * pointers are to the first row of the rectangle.
+ */
+void gralloc_drm_blit(void *dst, int dst_stride,
+		const void *src, int src_stride,
+		int size, int height, int flags)
+{
+	copy_row_func copy_row = copy_row_c;
+	uint8_t *d = (uint8_t *) dst;
+	const uint8_t *s = (const uint8_t *) src;
+	int y;
+
+	if (size <= 0 || height <= 0)
+		return;
+
+	if (flags & GRALLOC_DRM_BLIT_STREAM) {
+		pthread_once(&blit_once, blit_init);
+		copy_row = copy_row_stream;
+	}
+
+	/* whole rows are one copy */
+	if (dst_stride == size && src_stride == size) {
+		copy_row(d, s, (size_t) size * height);
+	}
+	else {
+		for (y = 0; y < height; y++) {
+			copy_row(d, s, size);
+			d += dst_stride;
+			s += src_stride;
+		}
+	}
+
+#ifdef __SSE2__
+	if (copy_row != copy_row_c && blit_fence)
+		_mm_sfence();
+#endif
+}
@@ -0,0 +1,303 @@
+/*
+ * Copyright (C) 2010-2011 Chia-I Wu <olvaffe@gmail.com>
+ * Copyright (C) 2010-2011 LunarG Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * A driver for any KMS device, with buffers from the generic dumb buffer
+ * ioctls.  There is no acceleration; the core copies with the CPU.
+ */
+
+#define LOG_TAG "HWDRM-DUMB"
+
+#include <cutils/log.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <drm.h>
+#include <xf86drm.h>
+
+#include "gralloc_drm.h"
+#include "gralloc_drm_priv.h"
+
+struct dumb_info {
+	struct gralloc_drm_drv_t base;
+	int fd;
+};
+
+struct dumb_buffer {
+	struct gralloc_drm_bo_t base;
+	uint32_t handle;
+	int created;    /* by CREATE_DUMB, not imported */
+	void *ptr;      /* mapped on first use until the bo is freed */
+};
+
+/*
+ * Create a dumb buffer for a new handle.
+ */
+static int dumb_create(struct dumb_info *info, struct dumb_buffer *buf,
+		struct gralloc_drm_handle_t *handle)
+{
+	struct drm_mode_create_dumb create;
+	struct drm_gem_flink flink;
+	int width = handle->width, height = handle->height;
+	int cpp = gralloc_drm_get_bpp(handle->format);
+
+	if (!cpp) {
+		LOGE("unrecognized format 0x%x", handle->format);
+		return -EINVAL;
+	}
+
+	gralloc_drm_align_geometry(handle->format, &width, &height);
+
+	memset(&create, 0, sizeof(create));
+	create.height = height;
+	/* bpp must be a power of two for some drivers */
+	if (cpp == 2 || cpp == 4) {
+		create.width = width;
+		create.bpp = cpp * 8;
+	}
+	else {
+		create.width = width * cpp;
+		create.bpp = 8;
+	}
+
+	if (drmIoctl(info->fd, DRM_IOCTL_MODE_CREATE_DUMB, &create)) {
+		LOGE("failed to create dumb buffer %dx%d (format %d)",
+				handle->width, handle->height, handle->format);
+		return -ENOMEM;
+	}
+
+	buf->handle = create.handle;
+	buf->created = 1;
+	buf->base.size = create.size;
+
+	memset(&flink, 0, sizeof(flink));
+	flink.handle = create.handle;
+	if (drmIoctl(info->fd, DRM_IOCTL_GEM_FLINK, &flink)) {
+		struct drm_mode_destroy_dumb destroy;
+
+		LOGE("failed to flink dumb buffer");
+		memset(&destroy, 0, sizeof(destroy));
+		destroy.handle = create.handle;
+		drmIoctl(info->fd, DRM_IOCTL_MODE_DESTROY_DUMB, &destroy);
+
+		return -EINVAL;
+	}
+
+	handle->name = flink.name;
+	handle->stride = create.pitch;
+
+	return 0;
+}
+
+/*
+ * Open the buffer of a handle from another process.
+ */
+static int dumb_import(struct dumb_info *info, struct dumb_buffer *buf,
+		struct gralloc_drm_handle_t *handle)
+{
+	if (gralloc_drm_handle_prime_fd(handle) >= 0) {
+		off_t size;
+
+		if (drmPrimeFDToHandle(info->fd, handle->prime_fd,
+					&buf->handle)) {
+			LOGE("failed to import dma-buf %d", handle->prime_fd);
+			return -EINVAL;
+		}
+
+		size = lseek(handle->prime_fd, 0, SEEK_END);
+		buf->base.size = (size > 0) ? size : 0;
+	}
+	else {
+		struct drm_gem_open open_arg;
+
+		memset(&open_arg, 0, sizeof(open_arg));
+		open_arg.name = handle->name;
+		if (drmIoctl(info->fd, DRM_IOCTL_GEM_OPEN, &open_arg)) {
+			LOGE("failed to open bo from name %u", handle->name);
+			return -EINVAL;
+		}
+
+		buf->handle = open_arg.handle;
+		buf->base.size = open_arg.size;
+	}
+
+	return 0;
+}
+
+static int dumb_alloc(struct gralloc_drm_drv_t *drv,
+		struct gralloc_drm_handle_t *handle,
+		struct gralloc_drm_bo_t *bo)
+{
+	struct dumb_info *info = (struct dumb_info *) drv;
+	struct dumb_buffer *buf = (struct dumb_buffer *) bo;
+	int err;
+
+	if (gralloc_drm_handle_prime_fd(handle) >= 0 || handle->name)
+		err = dumb_import(info, buf, handle);
+	else
+		err = dumb_create(info, buf, handle);
+	if (err)
+		return err;
+
+	/* dumb buffers are zeroed by the kernel */
+	buf->base.fb_handle = buf->handle;
+	buf->base.handle = handle;
+
+	return 0;
+}
+
+static void dumb_free(struct gralloc_drm_drv_t *drv,
+		struct gralloc_drm_bo_t *bo)
+{
+	struct dumb_info *info = (struct dumb_info *) drv;
+	struct dumb_buffer *buf = (struct dumb_buffer *) bo;
+
+	if (buf->ptr)
+		munmap(buf->ptr, buf->base.size);
+
+	if (buf->created) {
+		struct drm_mode_destroy_dumb destroy;
+
+		memset(&destroy, 0, sizeof(destroy));
+		destroy.handle = buf->handle;
+		drmIoctl(info->fd, DRM_IOCTL_MODE_DESTROY_DUMB, &destroy);
+	}
+	else {
+		struct drm_gem_close close_arg;
+
+		memset(&close_arg, 0, sizeof(close_arg));
+		close_arg.handle = buf->handle;
+		drmIoctl(info->fd, DRM_IOCTL_GEM_CLOSE, &close_arg);
+	}
+}
+
+static int dumb_map(struct gralloc_drm_drv_t *drv,
+		struct gralloc_drm_bo_t *bo, int x, int y, int w, int h,
+		int enable_write, void **addr)
+{
+	struct dumb_info *info = (struct dumb_info *) drv;
+	struct dumb_buffer *buf = (struct dumb_buffer *) bo;
+
+	if (!buf->ptr) {
+		struct drm_mode_map_dumb map;
+		void *ptr;
+
+		if (!buf->base.size)
+			return -EINVAL;
+
+		memset(&map, 0, sizeof(map));
+		map.handle = buf->handle;
+		if (drmIoctl(info->fd, DRM_IOCTL_MODE_MAP_DUMB, &map)) {
+			LOGE("failed to get the mmap offset of bo %u",
+					buf->handle);
+			return -errno;
+		}
+
+		ptr = mmap(NULL, buf->base.size, PROT_READ | PROT_WRITE,
+				MAP_SHARED, info->fd, map.offset);
+		if (ptr == MAP_FAILED) {
+			LOGE("failed to mmap bo %u", buf->handle);
+			return -errno;
+		}
+
+		/* another thread may have mapped the bo meanwhile */
+		if (!__sync_bool_compare_and_swap(&buf->ptr, NULL, ptr))
+			munmap(ptr, buf->base.size);
+	}
+
+	*addr = buf->ptr;
+
+	return 0;
+}
+
+static void dumb_unmap(struct gralloc_drm_drv_t *drv,
+		struct gralloc_drm_bo_t *bo)
+{
+	/* the mapping is kept until the bo is freed */
+}
+
+static void dumb_init_kms_features(struct gralloc_drm_drv_t *drv,
+		struct gralloc_drm_t *drm)
+{
+	switch (drm->fb_format) {
+	case HAL_PIXEL_FORMAT_BGRA_8888:
+	case HAL_PIXEL_FORMAT_RGB_565:
+		break;
+	default:
+		drm->fb_format = HAL_PIXEL_FORMAT_BGRA_8888;
+		break;
+	}
+
+	drm->mode_quirk_vmwgfx = 0;
+	drm->swap_mode = DRM_SWAP_FLIP;
+	drm->mode_sync_flip = 1;
+	drm->swap_interval = 1;
+	drm->vblank_secondary = 0;
+}
+
+static void dumb_destroy(struct gralloc_drm_drv_t *drv)
+{
+	struct dumb_info *info = (struct dumb_info *) drv;
+
+	free(info);
+}
+
+static struct gralloc_drm_drv_t *dumb_drv_create(const struct gralloc_drm_device *dev)
+{
+	struct dumb_info *info;
+
+	info = calloc(1, sizeof(*info));
+	if (!info) {
+		LOGE("failed to allocate driver info for dumb buffers");
+		return NULL;
+	}
+
+	info->fd = dev->fd;
+
+	info->base.bo_size = sizeof(struct dumb_buffer);
+	info->base.destroy = dumb_destroy;
+	info->base.init_kms_features = dumb_init_kms_features;
+	info->base.alloc = dumb_alloc;
+	info->base.free = dumb_free;
+	info->base.map = dumb_map;
+	info->base.unmap = dumb_unmap;
+
+	return &info->base;
+}
+
+/*
+ * Any device with dumb buffers will do, but only when nothing faster does.
+ */
+static int dumb_drv_probe(const struct gralloc_drm_device *dev)
+{
+	return (dev->dumb_buffer) ? GRALLOC_DRM_PROBE_FALLBACK : -1;
+}
+
+const struct gralloc_drm_backend gralloc_drm_backend_dumb = {
+	.version = GRALLOC_DRM_BACKEND_VERSION,
+	.name = "dumb",
+	.probe = dumb_drv_probe,
+	.create = dumb_drv_create,
+};
@@ -0,0 +1,113 @@
+/*
+ * Copyright (C) 2010-2011 Chia-I Wu <olvaffe@gmail.com>
+ * Copyright (C) 2010-2011 LunarG Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * The layouts of the supported pixel formats.  The planes of a bo follow
+ * each other, each starting at the offset where the previous one ends, with
+ * the pitch of the first plane scaled by the cpp and the subsampling.
+ */
+
+#include <drm_fourcc.h>
+
+#include "gralloc_drm.h"
+
+#define PLANE(cpp, hsub, vsub) { (cpp), (hsub), (vsub) }
+
+const struct gralloc_drm_format gralloc_drm_formats[GRALLOC_DRM_FORMAT_SLOTS] = {
+	[HAL_PIXEL_FORMAT_RGBA_8888] = {
+		HAL_PIXEL_FORMAT_RGBA_8888, DRM_FORMAT_ABGR8888, 1, 1, 0,
+		1, { PLANE(4, 1, 1) },
+	},
+	[HAL_PIXEL_FORMAT_RGBX_8888] = {
+		HAL_PIXEL_FORMAT_RGBX_8888, DRM_FORMAT_XBGR8888, 1, 1, 0,
+		1, { PLANE(4, 1, 1) },
+	},
+	[HAL_PIXEL_FORMAT_RGB_888] = {
+		HAL_PIXEL_FORMAT_RGB_888, DRM_FORMAT_BGR888, 1, 1, 0,
+		1, { PLANE(3, 1, 1) },
+	},
+	[HAL_PIXEL_FORMAT_RGB_565] = {
+		HAL_PIXEL_FORMAT_RGB_565, DRM_FORMAT_RGB565, 1, 1, 0,
+		1, { PLANE(2, 1, 1) },
+	},
+	[HAL_PIXEL_FORMAT_BGRA_8888] = {
+		HAL_PIXEL_FORMAT_BGRA_8888, DRM_FORMAT_ARGB8888, 1, 1, 0,
+		1, { PLANE(4, 1, 1) },
+	},
+	[HAL_PIXEL_FORMAT_RGBA_5551] = {
+		HAL_PIXEL_FORMAT_RGBA_5551, DRM_FORMAT_RGBA5551, 1, 1, 0,
+		1, { PLANE(2, 1, 1) },
+	},
+	[HAL_PIXEL_FORMAT_RGBA_4444] = {
+		HAL_PIXEL_FORMAT_RGBA_4444, DRM_FORMAT_RGBA4444, 1, 1, 0,
+		1, { PLANE(2, 1, 1) },
+	},
+
+	/* legacy formats (deprecated), used by ImageFormat.java */
+	[HAL_PIXEL_FORMAT_YCbCr_422_SP] = {
+		HAL_PIXEL_FORMAT_YCbCr_422_SP, DRM_FORMAT_NV16, 2, 1, 0,
+		2, { PLANE(1, 1, 1), PLANE(2, 2, 1) },
+	},
+	[HAL_PIXEL_FORMAT_YCrCb_420_SP] = {
+		HAL_PIXEL_FORMAT_YCrCb_420_SP, DRM_FORMAT_NV21, 2, 2, 1,
+		2, { PLANE(1, 1, 1), PLANE(2, 2, 2) },
+	},
+	[HAL_PIXEL_FORMAT_YCbCr_422_I] = {
+		HAL_PIXEL_FORMAT_YCbCr_422_I, DRM_FORMAT_YUYV, 2, 1, 0,
+		1, { PLANE(2, 1, 1) },
+	},
+
+	/* Y, then Cr, then Cb, the chroma pitches half the Y pitch */
+	[GRALLOC_DRM_FORMAT_SLOTS - 1] = {
+		HAL_PIXEL_FORMAT_YV12, DRM_FORMAT_YVU420, 32, 2, 1,
+		3, { PLANE(1, 1, 1), PLANE(1, 2, 2), PLANE(1, 2, 2) },
+	},
+};
+
+/*
+ * Get the offsets and pitches of the planes of a bo of a format, from the
+ * unaligned height and the pitch of the first plane.  Return the number of
+ * planes, or 0 if the format is not supported.
+ */
+int gralloc_drm_format_get_layout(int format, int height, int stride,
+		int offsets[GRALLOC_DRM_MAX_PLANES],
+		int pitches[GRALLOC_DRM_MAX_PLANES])
+{
+	const struct gralloc_drm_format *fmt = gralloc_drm_get_format(format);
+	int offset = 0, i;
+
+	if (!fmt)
+		return 0;
+
+	height = ALIGN(height, fmt->align_h);
+
+	for (i = 0; i < fmt->plane_count; i++) {
+		pitches[i] = stride * fmt->planes[i].cpp /
+			(fmt->planes[0].cpp * fmt->planes[i].hsub);
+		offsets[i] = offset;
+
+		offset += pitches[i] * (height / fmt->planes[i].vsub);
+	}
+
+	return fmt->plane_count;
+}
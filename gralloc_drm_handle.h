@@ -29,9 +29,15 @@
 struct gralloc_drm_handle_t {
 	native_handle_t base;
 
+	/*
+	 * The dma-buf fd of the bo.  Without PRIME, the handle carries no fd
+	 * and prime_fd is counted as an int holding -1.
+	 */
+	int prime_fd;
+
 #define GRALLOC_DRM_HANDLE_MAGIC 0x12345678
 #define GRALLOC_DRM_HANDLE_NUM_INTS 9
-#define GRALLOC_DRM_HANDLE_NUM_FDS 0
+#define GRALLOC_DRM_HANDLE_NUM_FDS 1
 	int magic;
 
 	int width;
@@ -43,7 +49,7 @@ struct gralloc_drm_handle_t {
 	int stride; /* the stride in bytes */
 
 	int data_owner; /* owner of data (for validation) */
-	int data;       /* pointer to struct gralloc_drm_bo_t */
+	int data;       /* slot id (index and generation) of the bo */
 };
 
 static inline struct gralloc_drm_handle_t *gralloc_drm_handle(buffer_handle_t _handle)
@@ -52,12 +58,40 @@ static inline struct gralloc_drm_handle_t *gralloc_drm_handle(buffer_handle_t _h
 		(struct gralloc_drm_handle_t *) _handle;
 
 	if (handle && (handle->base.version != sizeof(handle->base) ||
-	               handle->base.numInts != GRALLOC_DRM_HANDLE_NUM_INTS ||
-	               handle->base.numFds != GRALLOC_DRM_HANDLE_NUM_FDS ||
+	               handle->base.numInts + handle->base.numFds !=
+	               GRALLOC_DRM_HANDLE_NUM_INTS + GRALLOC_DRM_HANDLE_NUM_FDS ||
+	               handle->base.numFds > GRALLOC_DRM_HANDLE_NUM_FDS ||
 	               handle->magic != GRALLOC_DRM_HANDLE_MAGIC))
 		handle = NULL;
 
 	return handle;
 }
 
+/*
+ * Return the dma-buf fd of a handle, or -1.
+ */
+static inline int gralloc_drm_handle_prime_fd(const struct gralloc_drm_handle_t *handle)
+{
+	return (handle->base.numFds) ? handle->prime_fd : -1;
+}
+
+/*
+ * Set the dma-buf fd of a handle.  A negative fd switches the handle to the
+ * name-only layout.
+ */
+static inline void gralloc_drm_handle_set_prime_fd(struct gralloc_drm_handle_t *handle, int fd)
+{
+	if (fd >= 0) {
+		handle->base.numFds = GRALLOC_DRM_HANDLE_NUM_FDS;
+		handle->base.numInts = GRALLOC_DRM_HANDLE_NUM_INTS;
+		handle->prime_fd = fd;
+	}
+	else {
+		handle->base.numFds = 0;
+		handle->base.numInts = GRALLOC_DRM_HANDLE_NUM_INTS +
+			GRALLOC_DRM_HANDLE_NUM_FDS;
+		handle->prime_fd = -1;
+	}
+}
+
 #endif /* _GRALLOC_DRM_HANDLE_H_ */
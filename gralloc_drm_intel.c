@@ -31,8 +31,11 @@
 
 #include <cutils/log.h>
 #include <stdlib.h>
+#include <string.h>
 #include <errno.h>
 #include <assert.h>
+#include <unistd.h>
+#include <xf86drm.h>
 #include <drm.h>
 #include <intel_bufmgr.h>
 #include <i915_drm.h>
@@ -390,33 +393,43 @@ static drm_intel_bo *alloc_ibo(struct intel_info *info,
 	return ibo;
 }
 
-static struct gralloc_drm_bo_t *intel_alloc(struct gralloc_drm_drv_t *drv,
-		struct gralloc_drm_handle_t *handle)
+static int intel_alloc(struct gralloc_drm_drv_t *drv,
+		struct gralloc_drm_handle_t *handle,
+		struct gralloc_drm_bo_t *bo)
 {
 	struct intel_info *info = (struct intel_info *) drv;
-	struct intel_buffer *ib;
-
-	ib = calloc(1, sizeof(*ib));
-	if (!ib)
-		return NULL;
+	struct intel_buffer *ib = (struct intel_buffer *) bo;
 
-	if (handle->name) {
+	if (gralloc_drm_handle_prime_fd(handle) >= 0 || handle->name) {
 		uint32_t dummy;
-
-		ib->ibo = drm_intel_bo_gem_create_from_name(info->bufmgr,
-				"gralloc-r", handle->name);
-		if (!ib->ibo) {
-			LOGE("failed to create ibo from name %u",
+		off_t size;
+
+		size = (gralloc_drm_handle_prime_fd(handle) >= 0) ?
+			lseek(handle->prime_fd, 0, SEEK_END) : -1;
+		if (size > 0) {
+			ib->ibo = drm_intel_bo_gem_create_from_prime(
+					info->bufmgr, handle->prime_fd, size);
+			if (!ib->ibo) {
+				LOGE("failed to create ibo from dma-buf %d",
+						handle->prime_fd);
+				return -EINVAL;
+			}
+		}
+		else {
+			ib->ibo = drm_intel_bo_gem_create_from_name(
+					info->bufmgr, "gralloc-r",
 					handle->name);
-			free(ib);
-			return NULL;
+			if (!ib->ibo) {
+				LOGE("failed to create ibo from name %u",
+						handle->name);
+				return -EINVAL;
+			}
 		}
 
 		if (drm_intel_bo_get_tiling(ib->ibo, &ib->tiling, &dummy)) {
 			LOGE("failed to get ibo tiling");
 			drm_intel_bo_unreference(ib->ibo);
-			free(ib);
-			return NULL;
+			return -EINVAL;
 		}
 	}
 	else {
@@ -428,26 +441,23 @@ static struct gralloc_drm_bo_t *intel_alloc(struct gralloc_drm_drv_t *drv,
 					handle->width,
 					handle->height,
 					handle->format);
-			free(ib);
-			return NULL;
+			return -ENOMEM;
 		}
 
 		handle->stride = stride;
 
-		if (drm_intel_bo_flink(ib->ibo, (uint32_t *) &handle->name)) {
-			LOGE("failed to flink ibo");
-			drm_intel_bo_unreference(ib->ibo);
-			free(ib);
-			return NULL;
-		}
+		/* there are no GEM names on render nodes; dma-buf will do */
+		if (drm_intel_bo_flink(ib->ibo, (uint32_t *) &handle->name))
+			handle->name = 0;
 	}
 
-	if (handle->usage & GRALLOC_USAGE_HW_FB)
-		ib->base.fb_handle = ib->ibo->handle;
+	ib->base.fb_handle = ib->ibo->handle;
+	ib->base.size = ib->ibo->size;
+	ib->base.tiled = (ib->tiling != I915_TILING_NONE);
 
 	ib->base.handle = handle;
 
-	return &ib->base;
+	return 0;
 }
 
 static void intel_free(struct gralloc_drm_drv_t *drv,
@@ -456,7 +466,6 @@ static void intel_free(struct gralloc_drm_drv_t *drv,
 	struct intel_buffer *ib = (struct intel_buffer *) bo;
 
 	drm_intel_bo_unreference(ib->ibo);
-	free(ib);
 }
 
 static int intel_map(struct gralloc_drm_drv_t *drv,
@@ -490,6 +499,79 @@ static void intel_unmap(struct gralloc_drm_drv_t *drv,
 		drm_intel_bo_unmap(ib->ibo);
 }
 
+static int intel_prepare(struct gralloc_drm_drv_t *drv,
+		struct gralloc_drm_bo_t *bo,
+		int x, int y, int w, int h, int enable_write)
+{
+	struct intel_info *info = (struct intel_info *) drv;
+	struct intel_buffer *ib = (struct intel_buffer *) bo;
+	struct drm_i915_gem_set_domain sd;
+	uint32_t domain;
+
+	if (ib->tiling != I915_TILING_NONE ||
+	    (ib->base.handle->usage & GRALLOC_USAGE_HW_FB))
+		domain = I915_GEM_DOMAIN_GTT;
+	else
+		domain = I915_GEM_DOMAIN_CPU;
+
+	/* wait for the GPU and move the bo to the domain of the mapping */
+	memset(&sd, 0, sizeof(sd));
+	sd.handle = ib->ibo->handle;
+	sd.read_domains = domain;
+	sd.write_domain = (enable_write) ? domain : 0;
+
+	return drmIoctl(info->fd, DRM_IOCTL_I915_GEM_SET_DOMAIN, &sd);
+}
+
+static void intel_finish(struct gralloc_drm_drv_t *drv,
+		struct gralloc_drm_bo_t *bo)
+{
+	struct intel_info *info = (struct intel_info *) drv;
+	struct intel_buffer *ib = (struct intel_buffer *) bo;
+	struct drm_i915_gem_sw_finish sf;
+
+	/* only scanout needs to be told about CPU writes */
+	if (!(ib->base.handle->usage & GRALLOC_USAGE_HW_FB) || !bo->map_write)
+		return;
+
+	memset(&sf, 0, sizeof(sf));
+	sf.handle = ib->ibo->handle;
+	drmIoctl(info->fd, DRM_IOCTL_I915_GEM_SW_FINISH, &sf);
+}
+
+static int intel_busy(struct gralloc_drm_drv_t *drv,
+		struct gralloc_drm_bo_t *bo, int enable_write)
+{
+	struct intel_buffer *ib = (struct intel_buffer *) bo;
+
+	return drm_intel_bo_busy(ib->ibo) ? 1 : 0;
+}
+
+static int intel_sync(struct gralloc_drm_drv_t *drv,
+		struct gralloc_drm_bo_t *bo,
+		int x, int y, int w, int h, int flags)
+{
+	struct intel_info *info = (struct intel_info *) drv;
+	struct intel_buffer *ib = (struct intel_buffer *) bo;
+
+	/* leaving the CPU domain flushes the CPU writes */
+	if ((flags & GRALLOC_DRM_SYNC_CLEAN) && bo->map_write &&
+	    ib->tiling == I915_TILING_NONE &&
+	    !(ib->base.handle->usage & GRALLOC_USAGE_HW_FB)) {
+		struct drm_i915_gem_set_domain sd;
+
+		memset(&sd, 0, sizeof(sd));
+		sd.handle = ib->ibo->handle;
+		sd.read_domains = I915_GEM_DOMAIN_GTT;
+		drmIoctl(info->fd, DRM_IOCTL_I915_GEM_SET_DOMAIN, &sd);
+	}
+	if (flags & GRALLOC_DRM_SYNC_CLEAN)
+		intel_finish(drv, bo);
+
+	/* and back to the domain of the mapping, waiting for the GPU */
+	return intel_prepare(drv, bo, x, y, w, h, bo->map_write);
+}
+
 #include "dri/intel_chipset.h" /* for IS_965() */
 static void intel_init_kms_features(struct gralloc_drm_drv_t *drv,
 		struct gralloc_drm_t *drm)
@@ -564,7 +646,7 @@ static void intel_destroy(struct gralloc_drm_drv_t *drv)
 	free(info);
 }
 
-struct gralloc_drm_drv_t *gralloc_drm_drv_create_for_intel(int fd)
+static struct gralloc_drm_drv_t *intel_drv_create(const struct gralloc_drm_device *dev)
 {
 	struct intel_info *info;
 
@@ -574,7 +656,7 @@ struct gralloc_drm_drv_t *gralloc_drm_drv_create_for_intel(int fd)
 		return NULL;
 	}
 
-	info->fd = fd;
+	info->fd = dev->fd;
 	info->bufmgr = drm_intel_bufmgr_gem_init(info->fd, 16 * 1024);
 	if (!info->bufmgr) {
 		LOGE("failed to create buffer manager");
@@ -584,13 +666,32 @@ struct gralloc_drm_drv_t *gralloc_drm_drv_create_for_intel(int fd)
 
 	batch_init(info);
 
+	info->base.bo_size = sizeof(struct intel_buffer);
+	info->base.render_node = 1;
 	info->base.destroy = intel_destroy;
 	info->base.init_kms_features = intel_init_kms_features;
 	info->base.alloc = intel_alloc;
 	info->base.free = intel_free;
 	info->base.map = intel_map;
 	info->base.unmap = intel_unmap;
+	info->base.prepare = intel_prepare;
+	info->base.finish = intel_finish;
+	info->base.busy = intel_busy;
+	info->base.sync = intel_sync;
 	info->base.copy = intel_copy;
 
 	return &info->base;
 }
+
+static int intel_drv_probe(const struct gralloc_drm_device *dev)
+{
+	return (strcmp(dev->name, "i915") == 0) ?
+		GRALLOC_DRM_PROBE_NATIVE : -1;
+}
+
+const struct gralloc_drm_backend gralloc_drm_backend_intel = {
+	.version = GRALLOC_DRM_BACKEND_VERSION,
+	.name = "intel",
+	.probe = intel_drv_probe,
+	.create = intel_drv_create,
+};
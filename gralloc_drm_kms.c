@@ -27,62 +27,22 @@
 #include <cutils/log.h>
 #include <errno.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
 #include <signal.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 
 #include <system/graphics.h>
-
 #include <drm_fourcc.h>
 
 #include "gralloc_drm.h"
 #include "gralloc_drm_priv.h"
+#include "gralloc_drm_trace.h"
 
-static struct hal_to_drm_format {
-	int hal;
-	int drm;
-	int bpp;
-} hal_to_drm_formats[] = {
-	{HAL_PIXEL_FORMAT_RGBA_8888,    DRM_FORMAT_ABGR8888, 32},
-	{HAL_PIXEL_FORMAT_RGBX_8888,    DRM_FORMAT_RGBX8888, 32},
-	{HAL_PIXEL_FORMAT_RGB_888,      DRM_FORMAT_RGB888,   24},
-	{HAL_PIXEL_FORMAT_RGB_565,      DRM_FORMAT_RGB565,   16},
-	{HAL_PIXEL_FORMAT_BGRA_8888,    DRM_FORMAT_ARGB8888, 32},
-	{HAL_PIXEL_FORMAT_RGBA_5551,    DRM_FORMAT_RGBA5551, 16},
-	{HAL_PIXEL_FORMAT_RGBA_4444,    DRM_FORMAT_RGBA4444, 16},
-	{HAL_PIXEL_FORMAT_YV12,         DRM_FORMAT_YVU420,    0},
-
-	/* Legacy formats (deprecated), used by ImageFormat.java */
-	{HAL_PIXEL_FORMAT_YCbCr_422_SP, DRM_FORMAT_NV16,      0},
-	{HAL_PIXEL_FORMAT_YCrCb_420_SP, DRM_FORMAT_NV21,      0},
-	//{HAL_PIXEL_FORMAT_YCbCr_422_I, , 0}, /* YUY2 */
-
-	{0, 0, 0}, /* end marker */
-};
-
-int
-gralloc_hal_to_drm_format(int hal)
-{
-	int i;
-
-	for (i = 0; hal_to_drm_formats[i].hal; i++)
-		if (hal_to_drm_formats[i].hal == hal)
-			return hal_to_drm_formats[i].drm;
-
-	return 0;
-}
-
-int
-gralloc_drm_format_bpp(int drm)
-{
-	int i;
-
-	for (i = 0; hal_to_drm_formats[i].drm; i++)
-		if (hal_to_drm_formats[i].drm == drm)
-			return hal_to_drm_formats[i].bpp;
-
-	return 0;
-}
+#define MIN(a, b) (((a) < (b)) ? (a) : (b))
+#define MAX(a, b) (((a) > (b)) ? (a) : (b))
 
 /*
  * Return true if a bo needs fb.
@@ -94,21 +54,62 @@ int gralloc_drm_bo_need_fb(const struct gralloc_drm_bo_t *bo)
 }
 
 /*
- * Add a fb object for a bo.
+ * Add a fb object for a bo.  The planes of a planar bo are all in the one
+ * GEM object, at the offsets of the format layout.
  */
 int gralloc_drm_bo_add_fb(struct gralloc_drm_bo_t *bo)
 {
-	uint8_t bpp;
+	const struct gralloc_drm_handle_t *handle = bo->handle;
+	const struct gralloc_drm_format *fmt =
+		gralloc_drm_get_format(handle->format);
+	uint32_t handles[4], pitches[4], offsets[4];
+	int plane_offsets[GRALLOC_DRM_MAX_PLANES];
+	int plane_pitches[GRALLOC_DRM_MAX_PLANES];
+	uint32_t gem_handle;
+	int count, i, ret;
 
 	if (bo->fb_id)
 		return 0;
 
-	bpp = gralloc_drm_get_bpp(bo->handle->format) * 8;
+	if (!fmt || !fmt->fourcc) {
+		LOGE("format 0x%x cannot be scanned out", handle->format);
+		return -EINVAL;
+	}
+
+	ret = gralloc_drm_bo_get_kms_handle(bo, &gem_handle);
+	if (ret)
+		return ret;
+
+	memset(handles, 0, sizeof(handles));
+	memset(pitches, 0, sizeof(pitches));
+	memset(offsets, 0, sizeof(offsets));
+
+	count = gralloc_drm_format_get_layout(handle->format, handle->height,
+			handle->stride, plane_offsets, plane_pitches);
+	for (i = 0; i < count; i++) {
+		handles[i] = gem_handle;
+		pitches[i] = plane_pitches[i];
+		offsets[i] = plane_offsets[i];
+	}
+
+	ret = drmModeAddFB2(bo->drm->kms_fd, handle->width, handle->height,
+			fmt->fourcc, handles, pitches, offsets,
+			(uint32_t *) &bo->fb_id, 0);
+
+	/* kernels without AddFB2 still take RGB formats by depth and bpp */
+	if (ret && count == 1 && fmt->fourcc != DRM_FORMAT_YUYV) {
+		uint8_t bpp = fmt->planes[0].cpp * 8;
+
+		ret = drmModeAddFB(bo->drm->kms_fd,
+				handle->width, handle->height, bpp, bpp,
+				handle->stride, gem_handle,
+				(uint32_t *) &bo->fb_id);
+	}
 
-	return drmModeAddFB(bo->drm->fd,
-			bo->handle->width, bo->handle->height, bpp, bpp,
-			bo->handle->stride, bo->fb_handle,
-			(uint32_t *) &bo->fb_id);
+	/* the fb object holds its own reference */
+	gralloc_drm_bo_put_kms_handle(bo, gem_handle);
+
+	return ret;
 }
 
 /*
@@ -117,7 +118,7 @@ int gralloc_drm_bo_add_fb(struct gralloc_drm_bo_t *bo)
 void gralloc_drm_bo_rm_fb(struct gralloc_drm_bo_t *bo)
 {
 	if (bo->fb_id) {
-		drmModeRmFB(bo->drm->fd, bo->fb_id);
+		drmModeRmFB(bo->drm->kms_fd, bo->fb_id);
 		bo->fb_id = 0;
 	}
 }
@@ -129,7 +130,7 @@ static int drm_kms_set_crtc(struct gralloc_drm_t *drm, int fb_id)
 {
 	int ret;
 
-	ret = drmModeSetCrtc(drm->fd, drm->crtc_id, fb_id,
+	ret = drmModeSetCrtc(drm->kms_fd, drm->crtc_id, fb_id,
 			0, 0, &drm->connector_id, 1, &drm->mode);
 	if (ret) {
 		LOGE("failed to set crtc");
@@ -137,11 +138,101 @@ static int drm_kms_set_crtc(struct gralloc_drm_t *drm, int fb_id)
 	}
 
 	if (drm->mode_quirk_vmwgfx)
-		ret = drmModeDirtyFB(drm->fd, fb_id, &drm->clip, 1);
+		ret = drmModeDirtyFB(drm->kms_fd, fb_id, &drm->clip, 1);
 
 	return ret;
 }
 
+/*
+ * Tell the release callback that a bo is free again.
+ */
+static void drm_kms_release(struct gralloc_drm_t *drm,
+		struct gralloc_drm_bo_t *bo, int err)
+{
+	gralloc_drm_release_t callback;
+	void *data;
+
+	pthread_mutex_lock(&drm->present.mutex);
+	callback = drm->present.release_callback;
+	data = drm->present.release_data;
+	pthread_mutex_unlock(&drm->present.mutex);
+
+	if (callback)
+		callback(data, &bo->handle->base, err);
+}
+
+/*
+ * Mark a post of a bo as done.  Its bo may still be on screen.
+ */
+static void drm_kms_post_done(struct gralloc_drm_t *drm,
+		struct gralloc_drm_bo_t *bo)
+{
+	struct gralloc_drm_present *present = &drm->present;
+
+	pthread_mutex_lock(&present->mutex);
+	bo->present_pending--;
+	present->pending--;
+	pthread_cond_broadcast(&present->cond);
+	pthread_mutex_unlock(&present->mutex);
+}
+
+/*
+ * Make a new bo the front buffer.  The old front leaves the screen and is
+ * released, or destroyed if that was asked for while it was on screen.
+ */
+static void drm_kms_set_front(struct gralloc_drm_t *drm,
+		struct gralloc_drm_bo_t *bo)
+{
+	struct gralloc_drm_bo_t *old;
+	int doomed;
+
+	pthread_mutex_lock(&drm->present.mutex);
+	old = drm->current_front;
+	drm->current_front = bo;
+	doomed = (old && old != bo && old->present_doomed);
+	pthread_mutex_unlock(&drm->present.mutex);
+
+	if (doomed)
+		gralloc_drm_bo_destroy(old);
+	else if (old && old != bo)
+		drm_kms_release(drm, old, 0);
+}
+
+/*
+ * Get ready to destroy a bo.  Wait until no post of the bo is queued or
+ * flipping.  Return true if the bo is on screen, in which case it is
+ * destroyed when it leaves the screen instead.
+ */
+int gralloc_drm_bo_defer_destroy(struct gralloc_drm_bo_t *bo)
+{
+	struct gralloc_drm_t *drm = bo->drm;
+	struct gralloc_drm_present *present = &drm->present;
+	int defer;
+
+	pthread_mutex_lock(&present->mutex);
+	while (bo->present_pending)
+		pthread_cond_wait(&present->cond, &present->mutex);
+
+	defer = (bo == drm->current_front && !bo->present_doomed);
+	if (defer)
+		bo->present_doomed = 1;
+	pthread_mutex_unlock(&present->mutex);
+
+	return defer;
+}
+
+/*
+ * Ack the scheduled flip.
+ */
+static void drm_kms_flip_done(struct gralloc_drm_t *drm)
+{
+	struct gralloc_drm_bo_t *bo = drm->next_front;
+
+	drm->next_front = NULL;
+	drm_kms_post_done(drm, bo);
+	drm_kms_set_front(drm, bo);
+}
+
 /*
  * Callback for a page flip event.
  */
@@ -151,9 +242,7 @@ static void page_flip_handler(int fd, unsigned int sequence,
 {
 	struct gralloc_drm_t *drm = (struct gralloc_drm_t *) user_data;
 
-	/* ack the last scheduled flip */
-	drm->current_front = drm->next_front;
-	drm->next_front = NULL;
+	drm_kms_flip_done(drm);
 }
 
 /*
@@ -166,21 +255,22 @@ static int drm_kms_page_flip(struct gralloc_drm_t *drm,
 
 	/* there is another flip pending */
 	while (drm->next_front) {
+		GRALLOC_DRM_TRACE_BEGIN(FLIP_WAIT);
 		drm->waiting_flip = 1;
-		drmHandleEvent(drm->fd, &drm->evctx);
+		drmHandleEvent(drm->kms_fd, &drm->evctx);
 		drm->waiting_flip = 0;
+		GRALLOC_DRM_TRACE_END(FLIP_WAIT);
 		if (drm->next_front) {
 			/* record an error and break */
 			LOGE("drmHandleEvent returned without flipping");
-			drm->current_front = drm->next_front;
-			drm->next_front = NULL;
+			drm_kms_flip_done(drm);
 		}
 	}
 
 	if (!bo)
 		return 0;
 
-	ret = drmModePageFlip(drm->fd, drm->crtc_id, bo->fb_id,
+	ret = drmModePageFlip(drm->kms_fd, drm->crtc_id, bo->fb_id,
 			DRM_MODE_PAGE_FLIP_EVENT, (void *) drm);
 	if (ret)
 		LOGE("failed to perform page flip");
@@ -211,7 +301,7 @@ static void drm_kms_wait_for_post(struct gralloc_drm_t *drm, int flip)
 	vbl.request.sequence = 0;
 
 	/* get the current vblank */
-	ret = drmWaitVBlank(drm->fd, &vbl);
+	ret = drmWaitVBlank(drm->kms_fd, &vbl);
 	if (ret) {
 		LOGW("failed to get vblank");
 		return;
@@ -237,7 +327,9 @@ static void drm_kms_wait_for_post(struct gralloc_drm_t *drm, int flip)
 
 		vbl.request.sequence = target;
 
-		ret = drmWaitVBlank(drm->fd, &vbl);
+		GRALLOC_DRM_TRACE_BEGIN(VBLANK_WAIT);
+		ret = drmWaitVBlank(drm->kms_fd, &vbl);
+		GRALLOC_DRM_TRACE_END(VBLANK_WAIT);
 		if (ret) {
 			LOGW("failed to wait vblank");
 			return;
@@ -248,19 +340,112 @@ static void drm_kms_wait_for_post(struct gralloc_drm_t *drm, int flip)
 }
 
 /*
- * Post a bo.  This is not thread-safe.
+ * Copy the damage of a bo to the front buffer, and tell vmwgfx about it.
+ * A negative count copies the whole bo.
  */
-int gralloc_drm_bo_post(struct gralloc_drm_bo_t *bo)
+static void drm_kms_copy_damage(struct gralloc_drm_t *drm,
+		struct gralloc_drm_bo_t *dst, struct gralloc_drm_bo_t *src,
+		const drmModeClip *damage, int count)
 {
-	struct gralloc_drm_t *drm = bo->drm;
-	int ret;
+	drmModeClip full;
+	const drmModeClip *clips = damage;
+	int i;
 
-	if (!bo->fb_id && drm->swap_mode != DRM_SWAP_COPY) {
-		LOGE("unable to post bo %p without fb", bo);
+	if (count < 0) {
+		full.x1 = 0;
+		full.y1 = 0;
+		full.x2 = src->handle->width;
+		full.y2 = src->handle->height;
+		clips = &full;
+		count = 1;
+	}
+
+	for (i = 0; i < count; i++)
+		drm->drv->copy(drm->drv, dst, src,
+				clips[i].x1, clips[i].y1,
+				clips[i].x2, clips[i].y2);
+
+	if (drm->mode_quirk_vmwgfx && count) {
+		if (clips == &full)
+			clips = &drm->clip;
+		drmModeDirtyFB(drm->kms_fd, dst->fb_id,
+				(drmModeClip *) clips, count);
+	}
+}
+
+/*
+ * Set the rects that changed since the last post, to limit the copy of the
+ * next post in DRM_SWAP_COPY.  A NULL rects marks the whole bo as changed.
+ * The rects are clipped to the screen; like post, this is not thread-safe.
+ */
+int gralloc_drm_set_damage(struct gralloc_drm_t *drm,
+		const struct gralloc_drm_rect *rects, int count)
+{
+	drmModeClip *box = &drm->damage[0];
+	int i, n = 0, merged = 0;
+
+	/* the screen size is not known yet */
+	if (!drm->resources)
 		return -EINVAL;
+
+	if (!rects || count < 0) {
+		drm->damage_count = -1;
+		return 0;
+	}
+
+	for (i = 0; i < count; i++) {
+		int x1 = MAX(rects[i].left, 0);
+		int y1 = MAX(rects[i].top, 0);
+		int x2 = MIN(rects[i].right, drm->mode.hdisplay);
+		int y2 = MIN(rects[i].bottom, drm->mode.vdisplay);
+
+		if (x1 >= x2 || y1 >= y2)
+			continue;
+
+		/* too many to copy one by one; copy their bounding box */
+		if (n == GRALLOC_DRM_MAX_DAMAGE && !merged) {
+			int j;
+
+			for (j = 1; j < n; j++) {
+				box->x1 = MIN(box->x1, drm->damage[j].x1);
+				box->y1 = MIN(box->y1, drm->damage[j].y1);
+				box->x2 = MAX(box->x2, drm->damage[j].x2);
+				box->y2 = MAX(box->y2, drm->damage[j].y2);
+			}
+			n = 1;
+			merged = 1;
+		}
+
+		if (merged) {
+			box->x1 = MIN(box->x1, x1);
+			box->y1 = MIN(box->y1, y1);
+			box->x2 = MAX(box->x2, x2);
+			box->y2 = MAX(box->y2, y2);
+			continue;
+		}
+
+		drm->damage[n].x1 = x1;
+		drm->damage[n].y1 = y1;
+		drm->damage[n].x2 = x2;
+		drm->damage[n].y2 = y2;
+		n++;
 	}
 
-	/* TODO spawn a thread to avoid waiting and race */
+	drm->damage_count = n;
+
+	return 0;
+}
+
+/*
+ * Post a bo.  The post is done when this returns, except for a scheduled
+ * flip, which is done when the flip is.  sync is false in the presenter,
+ * which waits for the flips itself.
+ */
+static int drm_kms_post(struct gralloc_drm_t *drm,
+		const struct gralloc_drm_post *post, int sync)
+{
+	struct gralloc_drm_bo_t *bo = post->bo;
+	int ret;
 
 	if (drm->first_post) {
 		if (drm->swap_mode == DRM_SWAP_COPY) {
@@ -269,18 +454,34 @@ int gralloc_drm_bo_post(struct gralloc_drm_bo_t *bo)
 			dst = (drm->next_front) ?
 				drm->next_front :
 				drm->current_front;
-			drm->drv->copy(drm->drv, dst, bo, 0, 0,
-					bo->handle->width,
-					bo->handle->height);
-			bo = dst;
+			/* the front buffer has nothing of the last frame */
+			drm_kms_copy_damage(drm, dst, bo, NULL, -1);
+
+			ret = drm_kms_set_crtc(drm, dst->fb_id);
+			if (!ret) {
+				drm->first_post = 0;
+				drm->current_front = dst;
+				if (drm->next_front == dst)
+					drm->next_front = NULL;
+			}
+			drm_kms_post_done(drm, bo);
+			drm_kms_release(drm, bo, ret);
+
+			return ret;
 		}
 
+		/* the flip of before a VT switch */
+		if (drm->swap_mode == DRM_SWAP_FLIP)
+			drm_kms_page_flip(drm, NULL);
+
 		ret = drm_kms_set_crtc(drm, bo->fb_id);
+		drm_kms_post_done(drm, bo);
 		if (!ret) {
 			drm->first_post = 0;
-			drm->current_front = bo;
-			if (drm->next_front == bo)
-				drm->next_front = NULL;
+			drm_kms_set_front(drm, bo);
+		}
+		else {
+			drm_kms_release(drm, bo, ret);
 		}
 
 		return ret;
@@ -291,7 +492,11 @@ int gralloc_drm_bo_post(struct gralloc_drm_bo_t *bo)
 		if (drm->swap_interval > 1)
 			drm_kms_wait_for_post(drm, 1);
 		ret = drm_kms_page_flip(drm, bo);
-		if (drm->next_front) {
+		if (ret) {
+			drm_kms_post_done(drm, bo);
+			drm_kms_release(drm, bo, ret);
+		}
+		else if (sync) {
 			/*
 			 * wait if the driver says so or the current front
 			 * will be written by CPU
@@ -304,21 +509,25 @@ int gralloc_drm_bo_post(struct gralloc_drm_bo_t *bo)
 		break;
 	case DRM_SWAP_COPY:
 		drm_kms_wait_for_post(drm, 0);
-		drm->drv->copy(drm->drv, drm->current_front,
-				bo, 0, 0,
-				bo->handle->width,
-				bo->handle->height);
-		if (drm->mode_quirk_vmwgfx)
-			ret = drmModeDirtyFB(drm->fd, drm->current_front->fb_id, &drm->clip, 1);
+		drm_kms_copy_damage(drm, drm->current_front, bo,
+				post->damage, post->damage_count);
+		drm_kms_post_done(drm, bo);
+		drm_kms_release(drm, bo, 0);
 		ret = 0;
 		break;
 	case DRM_SWAP_SETCRTC:
 		drm_kms_wait_for_post(drm, 0);
 		ret = drm_kms_set_crtc(drm, bo->fb_id);
-		drm->current_front = bo;
+		drm_kms_post_done(drm, bo);
+		if (!ret)
+			drm_kms_set_front(drm, bo);
+		else
+			drm_kms_release(drm, bo, ret);
 		break;
 	default:
 		/* no-op */
+		drm_kms_post_done(drm, bo);
+		drm_kms_release(drm, bo, 0);
 		ret = 0;
 		break;
 	}
@@ -326,6 +535,222 @@ int gralloc_drm_bo_post(struct gralloc_drm_bo_t *bo)
 	return ret;
 }
 
+/*
+ * Make a post.
+ */
+static int drm_kms_present(struct gralloc_drm_t *drm,
+		const struct gralloc_drm_post *post, int sync)
+{
+	int ret;
+
+	GRALLOC_DRM_TRACE_BEGIN(POST);
+	ret = drm_kms_post(drm, post, sync);
+	GRALLOC_DRM_TRACE_END(POST);
+
+	return ret;
+}
+
+/*
+ * The presenter thread.  It runs until stopped and the queue is empty.
+ * When idle, it waits for the scheduled flip so that the bo leaving the
+ * screen is released without waiting for the next post.
+ */
+static void *drm_kms_presenter(void *arg)
+{
+	struct gralloc_drm_t *drm = (struct gralloc_drm_t *) arg;
+	struct gralloc_drm_present *present = &drm->present;
+	struct sched_param param;
+
+	/* a late flip costs a whole frame */
+	memset(&param, 0, sizeof(param));
+	param.sched_priority = 1;
+	if (pthread_setschedparam(pthread_self(), SCHED_FIFO, &param))
+		LOGW("presenting without real-time priority");
+
+	pthread_mutex_lock(&present->mutex);
+	for (;;) {
+		struct gralloc_drm_post post;
+		/*
+		 * only this thread flips; next_front holds the front buffer
+		 * before the first post in DRM_SWAP_COPY
+		 */
+		int flipping = (drm->swap_mode == DRM_SWAP_FLIP &&
+				drm->next_front);
+
+		while (!present->count && !present->stop && !flipping)
+			pthread_cond_wait(&present->cond, &present->mutex);
+
+		if (!present->count && flipping) {
+			pthread_mutex_unlock(&present->mutex);
+			drm_kms_page_flip(drm, NULL);
+			pthread_mutex_lock(&present->mutex);
+			continue;
+		}
+
+		if (!present->count)
+			break;
+
+		post = present->queue[present->head];
+		present->head = (present->head + 1) % GRALLOC_DRM_PRESENT_QUEUE;
+		present->count--;
+		pthread_cond_broadcast(&present->cond);
+		pthread_mutex_unlock(&present->mutex);
+
+		drm_kms_present(drm, &post, 0);
+
+		pthread_mutex_lock(&present->mutex);
+	}
+	pthread_mutex_unlock(&present->mutex);
+
+	return NULL;
+}
+
+/*
+ * Start the presenter for a client with a release callback, unless
+ * debug.drm.present is "sync".  The depth of the flip queue, the posts that
+ * may be queued or flipping before post blocks, is from debug.drm.flip_queue.
+ * It is 0 by default, which keeps posts synchronous and honors
+ * mode_sync_flip.  A client renders without waiting only when it has depth +
+ * 2 buffers, which fb0 with its 2 does not; set a depth only for clients
+ * that allocate their own.
+ */
+static void drm_kms_start_presenter(struct gralloc_drm_t *drm)
+{
+	struct gralloc_drm_present *present = &drm->present;
+	char value[PROPERTY_VALUE_MAX];
+	int depth;
+
+	property_get("debug.drm.present", value, "thread");
+	if (!strcmp(value, "sync"))
+		return;
+
+	property_get("debug.drm.flip_queue", value, "0");
+	depth = atoi(value);
+	if (depth < 1)
+		return;
+	else if (depth > GRALLOC_DRM_PRESENT_QUEUE)
+		depth = GRALLOC_DRM_PRESENT_QUEUE;
+	present->depth = depth;
+
+	LOGD("will queue %d post%s", depth, (depth > 1) ? "s" : "");
+
+	pthread_mutex_lock(&present->mutex);
+	if (!present->running) {
+		present->stop = 0;
+		if (!pthread_create(&present->thread, NULL,
+					drm_kms_presenter, drm))
+			present->running = 1;
+		else
+			LOGW("failed to start the presenter; posting in the caller");
+	}
+	pthread_mutex_unlock(&present->mutex);
+}
+
+/*
+ * Stop the presenter after it has made the queued posts.
+ */
+static void drm_kms_stop_presenter(struct gralloc_drm_t *drm)
+{
+	struct gralloc_drm_present *present = &drm->present;
+	int running;
+
+	pthread_mutex_lock(&present->mutex);
+	running = present->running;
+	present->running = 0;
+	present->stop = 1;
+	pthread_cond_broadcast(&present->cond);
+	pthread_mutex_unlock(&present->mutex);
+
+	if (running)
+		pthread_join(present->thread, NULL);
+}
+
+/*
+ * Post a bo.  With the presenter, the post is queued and made later; the
+ * caller waits only when as many posts as the flip queue is deep are queued
+ * or flipping, and learns of the result from the release callback.  Post
+ * and set_damage are not thread-safe.
+ */
+int gralloc_drm_bo_post(struct gralloc_drm_bo_t *bo)
+{
+	struct gralloc_drm_t *drm = bo->drm;
+	struct gralloc_drm_present *present = &drm->present;
+	struct gralloc_drm_post now, *post = &now;
+
+	if (!bo->fb_id && drm->swap_mode != DRM_SWAP_COPY) {
+		LOGE("unable to post bo %p without fb", bo);
+		return -EINVAL;
+	}
+
+	pthread_mutex_lock(&present->mutex);
+
+	/* the presenter may be stopped while we wait */
+	while (present->running && present->pending >= present->depth)
+		pthread_cond_wait(&present->cond, &present->mutex);
+	if (present->running)
+		post = &present->queue[(present->head + present->count) %
+			GRALLOC_DRM_PRESENT_QUEUE];
+
+	post->bo = bo;
+	post->damage_count = drm->damage_count;
+	if (post->damage_count > 0)
+		memcpy(post->damage, drm->damage,
+				sizeof(drm->damage[0]) * post->damage_count);
+	drm->damage_count = -1;
+	bo->present_pending++;
+	present->pending++;
+
+	if (post != &now) {
+		present->count++;
+		pthread_cond_broadcast(&present->cond);
+		pthread_mutex_unlock(&present->mutex);
+		return 0;
+	}
+
+	pthread_mutex_unlock(&present->mutex);
+
+	return drm_kms_present(drm, post, 1);
+}
+
+/*
+ * Wait until all posts of a bo are done: none is queued or flipping.
+ */
+void gralloc_drm_bo_wait_release(struct gralloc_drm_bo_t *bo)
+{
+	struct gralloc_drm_present *present = &bo->drm->present;
+
+	pthread_mutex_lock(&present->mutex);
+	while (bo->present_pending)
+		pthread_cond_wait(&present->cond, &present->mutex);
+	pthread_mutex_unlock(&present->mutex);
+}
+
+/*
+ * Set the callback that is told when a posted bo is free again: copied to
+ * the screen, replaced on the screen by another bo, or failed to post.  It
+ * is called from the presenter thread, or from post without the presenter.
+ *
+ * Only a client with a callback knows when it may render into a posted bo
+ * again, so the presenter runs only while there is one.  The others, like
+ * FramebufferNativeWindow with its 2 buffers, get synchronous posts.
+ */
+void gralloc_drm_set_release_callback(struct gralloc_drm_t *drm,
+		gralloc_drm_release_t callback, void *data)
+{
+	pthread_mutex_lock(&drm->present.mutex);
+	drm->present.release_callback = callback;
+	drm->present.release_data = data;
+	pthread_mutex_unlock(&drm->present.mutex);
+
+	/* or when KMS is initialized */
+	if (drm->resources) {
+		if (callback)
+			drm_kms_start_presenter(drm);
+		else
+			drm_kms_stop_presenter(drm);
+	}
+}
+
 static struct gralloc_drm_t *drm_singleton;
 
 static void on_signal(int sig)
@@ -479,7 +904,7 @@ static int drm_kms_init_with_connector(struct gralloc_drm_t *drm,
 	if (!connector->count_modes)
 		return -EINVAL;
 
-	encoder = drmModeGetEncoder(drm->fd, connector->encoders[0]);
+	encoder = drmModeGetEncoder(drm->kms_fd, connector->encoders[0]);
 	if (!encoder)
 		return -EINVAL;
 
@@ -552,7 +977,10 @@ int gralloc_drm_init_kms(struct gralloc_drm_t *drm)
 	if (drm->resources)
 		return 0;
 
-	drm->resources = drmModeGetResources(drm->fd);
+	if (gralloc_drm_get_kms_fd(drm) < 0)
+		return -EINVAL;
+
+	drm->resources = drmModeGetResources(drm->kms_fd);
 	if (!drm->resources) {
 		LOGE("failed to get modeset resources");
 		return -EINVAL;
@@ -562,7 +990,7 @@ int gralloc_drm_init_kms(struct gralloc_drm_t *drm)
 	for (i = 0; i < drm->resources->count_connectors; i++) {
 		drmModeConnectorPtr connector;
 
-		connector = drmModeGetConnector(drm->fd,
+		connector = drmModeGetConnector(drm->kms_fd,
 				drm->resources->connectors[i]);
 		if (connector) {
 			if (connector->connection == DRM_MODE_CONNECTED) {
@@ -584,24 +1012,40 @@ int gralloc_drm_init_kms(struct gralloc_drm_t *drm)
 
 	drm_kms_init_features(drm);
 	drm->first_post = 1;
+	drm->damage_count = -1;
+	if (drm->present.release_callback)
+		drm_kms_start_presenter(drm);
 
 	return 0;
 }
 
 void gralloc_drm_fini_kms(struct gralloc_drm_t *drm)
 {
+	drm_kms_stop_presenter(drm);
+
 	switch (drm->swap_mode) {
 	case DRM_SWAP_FLIP:
 		drm_kms_page_flip(drm, NULL);
+		/* fall through */
+	case DRM_SWAP_SETCRTC:
+		/* a front that was destroyed while on screen */
+		if (drm->current_front && drm->current_front->present_doomed) {
+			struct gralloc_drm_bo_t *bo = drm->current_front;
+
+			drm->current_front = NULL;
+			gralloc_drm_bo_destroy(bo);
+		}
 		break;
 	case DRM_SWAP_COPY:
 		{
-			struct gralloc_drm_bo_t **bo = (drm->current_front) ?
+			struct gralloc_drm_bo_t **front = (drm->current_front) ?
 				&drm->current_front : &drm->next_front;
+			struct gralloc_drm_bo_t *bo = *front;
 
-			if (*bo)
-				gralloc_drm_bo_destroy(*bo);
-			*bo = NULL;
+			/* no longer on screen, or it would not be destroyed */
+			*front = NULL;
+			if (bo)
+				gralloc_drm_bo_destroy(bo);
 		}
 		break;
 	default:
@@ -640,6 +1084,16 @@ void gralloc_drm_get_kms_info(struct gralloc_drm_t *drm,
 	*((float *)    &fb->ydpi) = drm->ydpi;
 	*((int *)      &fb->minSwapInterval) = drm->swap_interval;
 	*((int *)      &fb->maxSwapInterval) = drm->swap_interval;
+
+	/* window buffers are mostly display sized, in either orientation */
+	gralloc_drm_bo_pool_add_shape(drm, drm->mode.hdisplay,
+			drm->mode.vdisplay, drm->fb_format,
+			GRALLOC_USAGE_HW_RENDER | GRALLOC_USAGE_HW_TEXTURE);
+	if (drm->mode.hdisplay != drm->mode.vdisplay)
+		gralloc_drm_bo_pool_add_shape(drm, drm->mode.vdisplay,
+				drm->mode.hdisplay, drm->fb_format,
+				GRALLOC_USAGE_HW_RENDER |
+				GRALLOC_USAGE_HW_TEXTURE);
 }
 
 /*
@@ -701,7 +1155,10 @@ gralloc_kms_planes_init(struct gralloc_drm_t *drm)
 	/* What else than the ordering in the main resources would reliably
 	   tell us what the possible_crtcs field for the planes mean?
 	   Way to save overhead! */
-	resources = drmModeGetResources(drm->fd);
+	if (gralloc_drm_get_kms_fd(drm) < 0)
+		return -EINVAL;
+
+	resources = drmModeGetResources(drm->kms_fd);
 	if (!resources) {
 		LOGE("Failed to get KMS resources\n");
 		return -EINVAL;
@@ -719,7 +1176,7 @@ gralloc_kms_planes_init(struct gralloc_drm_t *drm)
 
 	drmModeFreeResources(resources);
 
-	planes = drmModeGetPlaneResources(drm->fd);
+	planes = drmModeGetPlaneResources(drm->kms_fd);
 	if (!planes) {
 		LOGE("Failed to get KMS Plane resources\n");
 		return -EINVAL;
@@ -727,7 +1184,7 @@ gralloc_kms_planes_init(struct gralloc_drm_t *drm)
 
 	for (i = 0; i < (int) planes->count_planes; i++) {
 		drmModePlanePtr plane =
-			drmModeGetPlane(drm->fd, planes->planes[i]);
+			drmModeGetPlane(drm->kms_fd, planes->planes[i]);
 
 		if (!plane) {
 			LOGE("Failed to get Plane %d: %s\n", planes->planes[i],
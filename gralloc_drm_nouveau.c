@@ -30,6 +30,7 @@
 
 #include <cutils/log.h>
 #include <stdlib.h>
+#include <string.h>
 #include <errno.h>
 #include <drm.h>
 #include <nouveau_drmif.h>
@@ -172,29 +173,25 @@ static struct nouveau_bo *alloc_bo(struct nouveau_info *info,
 	return bo;
 }
 
-static struct gralloc_drm_bo_t *
-nouveau_alloc(struct gralloc_drm_drv_t *drv, struct gralloc_drm_handle_t *handle)
+static int
+nouveau_alloc(struct gralloc_drm_drv_t *drv, struct gralloc_drm_handle_t *handle,
+		struct gralloc_drm_bo_t *bo)
 {
 	struct nouveau_info *info = (struct nouveau_info *) drv;
-	struct nouveau_buffer *nb;
+	struct nouveau_buffer *nb = (struct nouveau_buffer *) bo;
 	int cpp;
 
 	cpp = gralloc_drm_get_bpp(handle->format);
 	if (!cpp) {
 		LOGE("unrecognized format 0x%x", handle->format);
-		return NULL;
+		return -EINVAL;
 	}
 
-	nb = calloc(1, sizeof(*nb));
-	if (!nb)
-		return NULL;
-
 	if (handle->name) {
 		if (nouveau_bo_handle_ref(info->dev, handle->name, &nb->bo)) {
 			LOGE("failed to create nouveau bo from name %u",
 					handle->name);
-			free(nb);
-			return NULL;
+			return -EINVAL;
 		}
 	}
 	else {
@@ -209,27 +206,28 @@ nouveau_alloc(struct gralloc_drm_drv_t *drv, struct gralloc_drm_handle_t *handle
 		if (!nb->bo) {
 			LOGE("failed to allocate nouveau bo %dx%dx%d",
 					handle->width, handle->height, cpp);
-			free(nb);
-			return NULL;
+			return -ENOMEM;
 		}
 
 		if (nouveau_bo_handle_get(nb->bo,
 					(uint32_t *) &handle->name)) {
 			LOGE("failed to flink nouveau bo");
 			nouveau_bo_ref(NULL, &nb->bo);
-			free(nb);
-			return NULL;
+			return -EINVAL;
 		}
 
 		handle->stride = pitch;
 	}
 
-	if (handle->usage & GRALLOC_USAGE_HW_FB)
-		nb->base.fb_handle = nb->bo->handle;
+	nb->base.fb_handle = nb->bo->handle;
+	nb->base.size = nb->bo->size;
+	nb->base.tiled = (nb->bo->tile_flags & NOUVEAU_BO_TILE_LAYOUT_MASK) ||
+		nb->bo->tile_mode;
+	nb->base.domain = GRALLOC_DRM_DOMAIN_VRAM;
 
 	nb->base.handle = handle;
 
-	return &nb->base;
+	return 0;
 }
 
 static void nouveau_free(struct gralloc_drm_drv_t *drv,
@@ -237,7 +235,6 @@ static void nouveau_free(struct gralloc_drm_drv_t *drv,
 {
 	struct nouveau_buffer *nb = (struct nouveau_buffer *) bo;
 	nouveau_bo_ref(NULL, &nb->bo);
-	free(nb);
 }
 
 static int nouveau_map(struct gralloc_drm_drv_t *drv,
@@ -340,7 +337,7 @@ static int nouveau_init(struct nouveau_info *info)
 	return err;
 }
 
-struct gralloc_drm_drv_t *gralloc_drm_drv_create_for_nouveau(int fd)
+static struct gralloc_drm_drv_t *nouveau_drv_create(const struct gralloc_drm_device *dev)
 {
 	struct nouveau_info *info;
 	int err;
@@ -349,7 +346,7 @@ struct gralloc_drm_drv_t *gralloc_drm_drv_create_for_nouveau(int fd)
 	if (!info)
 		return NULL;
 
-	info->fd = fd;
+	info->fd = dev->fd;
 	err = nouveau_device_open_existing(&info->dev, 0, info->fd, 0);
 	if (err) {
 		LOGE("failed to create nouveau device");
@@ -374,6 +371,7 @@ struct gralloc_drm_drv_t *gralloc_drm_drv_create_for_nouveau(int fd)
 		return NULL;
 	}
 
+	info->base.bo_size = sizeof(struct nouveau_buffer);
 	info->base.destroy = nouveau_destroy;
 	info->base.init_kms_features = nouveau_init_kms_features;
 	info->base.alloc = nouveau_alloc;
@@ -383,3 +381,16 @@ struct gralloc_drm_drv_t *gralloc_drm_drv_create_for_nouveau(int fd)
 
 	return &info->base;
 }
+
+static int nouveau_drv_probe(const struct gralloc_drm_device *dev)
+{
+	return (strcmp(dev->name, "nouveau") == 0) ?
+		GRALLOC_DRM_PROBE_NATIVE : -1;
+}
+
+const struct gralloc_drm_backend gralloc_drm_backend_nouveau = {
+	.version = GRALLOC_DRM_BACKEND_VERSION,
+	.name = "nouveau",
+	.probe = nouveau_drv_probe,
+	.create = nouveau_drv_create,
+};
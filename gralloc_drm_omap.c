@@ -31,6 +31,7 @@
 
 #include <cutils/log.h>
 #include <stdlib.h>
+#include <string.h>
 #include <errno.h>
 #include <assert.h>
 #include <drm.h>
@@ -48,61 +49,83 @@ struct omap_info {
 struct omap_buffer {
 	struct gralloc_drm_bo_t base;
 	struct omap_bo *bo;
+	enum omap_gem_op cpu_op; /* of the pending omap_bo_cpu_prep() */
 };
 
-static void omap_copy(struct gralloc_drm_drv_t *drv,
-		struct gralloc_drm_bo_t *dst,
-		struct gralloc_drm_bo_t *src,
-		short x1, short y1, short x2, short y2)
+static int omap_alloc(struct gralloc_drm_drv_t *drv,
+		struct gralloc_drm_handle_t *handle,
+		struct gralloc_drm_bo_t *base)
 {
 	struct omap_info *info = (struct omap_info *) drv;
+	struct omap_buffer *bo = (struct omap_buffer *) base;
 
-	LOGE("%s needs implementation %p",
-			__func__, info->dev);
-}
-
-static struct gralloc_drm_bo_t *omap_alloc(struct gralloc_drm_drv_t *drv,
-		struct gralloc_drm_handle_t *handle)
-{
-	struct omap_info *info = (struct omap_info *) drv;
-	struct omap_buffer *bo;
-
-	bo = calloc(1, sizeof(*bo));
-	if (!bo)
-		return NULL;
-
-	if (handle->name) {
-
+	if (gralloc_drm_handle_prime_fd(handle) >= 0) {
+		bo->bo = omap_bo_from_dmabuf(info->dev, handle->prime_fd);
+		if (!bo->bo) {
+			LOGE("failed to create bo from dma-buf %d",
+					handle->prime_fd);
+			return -EINVAL;
+		}
+	}
+	else if (handle->name) {
 		bo->bo = omap_bo_from_name(info->dev, handle->name);
 		if (!bo->bo) {
 			LOGE("failed to create bo from name %u",
 					handle->name);
-			free(bo);
-			return NULL;
+			return -EINVAL;
 		}
 	}
 	else {
-		unsigned long stride = 0;
+		int width = handle->width, height = handle->height;
+		int cpp = gralloc_drm_get_bpp(handle->format);
+		uint32_t flags = OMAP_BO_WC;
+		unsigned long stride;
+
+		if (!cpp) {
+			LOGE("unrecognized format 0x%x", handle->format);
+			return -EINVAL;
+		}
 
-		bo->bo = omap_bo_new(info->dev, 0, 0);
+		gralloc_drm_align_geometry(handle->format, &width, &height);
+		stride = ALIGN(width * cpp, 64);
+
+		/*
+		 * CPU-heavy users get cached memory, with the caches maintained
+		 * on lock and unlock; scanout must not be cached.
+		 */
+		if (handle->usage & GRALLOC_USAGE_HW_FB)
+			flags |= OMAP_BO_SCANOUT;
+		else if ((handle->usage & GRALLOC_USAGE_SW_READ_MASK) ==
+			 GRALLOC_USAGE_SW_READ_OFTEN ||
+			 (handle->usage & GRALLOC_USAGE_SW_WRITE_MASK) ==
+			 GRALLOC_USAGE_SW_WRITE_OFTEN)
+			flags = OMAP_BO_CACHED;
+
+		bo->base.domain = (flags & OMAP_BO_CACHED) ?
+			GRALLOC_DRM_DOMAIN_CACHED : GRALLOC_DRM_DOMAIN_WC;
+
+		bo->bo = omap_bo_new(info->dev, stride * height, flags);
 		if (!bo->bo) {
 			LOGE("failed to allocate bo %dx%d (format %d)",
 					handle->width,
 					handle->height,
 					handle->format);
-			free(bo);
-			return NULL;
+			return -ENOMEM;
 		}
 
 		handle->stride = stride;
+
+		/* there are no GEM names on render nodes; dma-buf will do */
+		if (omap_bo_get_name(bo->bo, (uint32_t *) &handle->name))
+			handle->name = 0;
 	}
 
-	if (handle->usage & GRALLOC_USAGE_HW_FB)
-		bo->base.fb_handle = omap_bo_handle(bo->bo);
+	bo->base.fb_handle = omap_bo_handle(bo->bo);
+	bo->base.size = omap_bo_size(bo->bo);
 
 	bo->base.handle = handle;
 
-	return &bo->base;
+	return 0;
 }
 
 static void omap_free(struct gralloc_drm_drv_t *drv,
@@ -111,7 +134,19 @@ static void omap_free(struct gralloc_drm_drv_t *drv,
 	struct omap_buffer *omap_bo = (struct omap_buffer *) bo;
 
 	omap_bo_del(omap_bo->bo);
-	free(omap_bo);
+}
+
+static int omap_prepare(struct gralloc_drm_drv_t *drv,
+		struct gralloc_drm_bo_t *bo,
+		int x, int y, int w, int h, int enable_write)
+{
+	struct omap_buffer *omap_bo = (struct omap_buffer *) bo;
+
+	omap_bo->cpu_op = OMAP_GEM_READ;
+	if (enable_write)
+		omap_bo->cpu_op |= OMAP_GEM_WRITE;
+
+	return omap_bo_cpu_prep(omap_bo->bo, omap_bo->cpu_op);
 }
 
 static int omap_map(struct gralloc_drm_drv_t *drv,
@@ -120,23 +155,46 @@ static int omap_map(struct gralloc_drm_drv_t *drv,
 		int enable_write, void **addr)
 {
 	struct omap_buffer *omap_bo = (struct omap_buffer *) bo;
-	int err = 0;
+	int err;
 
 	*addr = omap_bo_map(omap_bo->bo);
+	if (!*addr)
+		return -ENOMEM;
 
-	if(!*addr)
-		err = -1;
+	err = omap_prepare(drv, bo, x, y, w, h, enable_write);
+	if (err)
+		LOGE("failed to prepare bo %p for CPU access", omap_bo->bo);
 
 	return err;
 }
 
 static void omap_unmap(struct gralloc_drm_drv_t *drv,
 		struct gralloc_drm_bo_t *bo)
+{
+	/* libdrm_omap keeps the mapping until the bo is deleted */
+}
+
+static void omap_finish(struct gralloc_drm_drv_t *drv,
+		struct gralloc_drm_bo_t *bo)
+{
+	struct omap_buffer *omap_bo = (struct omap_buffer *) bo;
+
+	omap_bo_cpu_fini(omap_bo->bo, omap_bo->cpu_op);
+}
+
+static int omap_sync(struct gralloc_drm_drv_t *drv,
+		struct gralloc_drm_bo_t *bo,
+		int x, int y, int w, int h, int flags)
 {
 	struct omap_buffer *omap_bo = (struct omap_buffer *) bo;
 
-	LOGE("%s needs implementation %p",
-			__func__, omap_bo->bo);
+	/*
+	 * The kernel maintains the caches of the whole bo when CPU access
+	 * ends and begins; end the pending access and begin it again.
+	 */
+	omap_bo_cpu_fini(omap_bo->bo, omap_bo->cpu_op);
+
+	return omap_bo_cpu_prep(omap_bo->bo, omap_bo->cpu_op);
 }
 
 static void omap_init_kms_features(struct gralloc_drm_drv_t *drv,
@@ -173,7 +231,7 @@ static void omap_destroy(struct gralloc_drm_drv_t *drv)
 	free(info);
 }
 
-struct gralloc_drm_drv_t *gralloc_drm_drv_create_for_omap(int fd)
+static struct gralloc_drm_drv_t *omap_drv_create(const struct gralloc_drm_device *dev)
 {
 	struct omap_info *info;
 
@@ -183,15 +241,32 @@ struct gralloc_drm_drv_t *gralloc_drm_drv_create_for_omap(int fd)
 		return NULL;
 	}
 
-	info->fd = fd;
+	info->fd = dev->fd;
 
+	info->base.bo_size = sizeof(struct omap_buffer);
+	info->base.render_node = 1;
 	info->base.destroy = omap_destroy;
 	info->base.init_kms_features = omap_init_kms_features;
 	info->base.alloc = omap_alloc;
 	info->base.free = omap_free;
 	info->base.map = omap_map;
 	info->base.unmap = omap_unmap;
-	info->base.copy = omap_copy;
+	info->base.prepare = omap_prepare;
+	info->base.finish = omap_finish;
+	info->base.sync = omap_sync;
 
 	return &info->base;
 }
+
+static int omap_drv_probe(const struct gralloc_drm_device *dev)
+{
+	return (strcmp(dev->name, "omapdrm") == 0) ?
+		GRALLOC_DRM_PROBE_NATIVE : -1;
+}
+
+const struct gralloc_drm_backend gralloc_drm_backend_omap = {
+	.version = GRALLOC_DRM_BACKEND_VERSION,
+	.name = "omap",
+	.probe = omap_drv_probe,
+	.create = omap_drv_create,
+};
@@ -29,6 +29,7 @@
 #include <pipe/p_screen.h>
 #include <pipe/p_context.h>
 #include <state_tracker/drm_driver.h>
+#include <util/u_format.h>
 #include <util/u_inlines.h>
 #include <util/u_memory.h>
 
@@ -108,10 +109,10 @@ static unsigned get_pipe_bind(int usage)
 	return bind;
 }
 
-static struct pipe_buffer *get_pipe_buffer_locked(struct pipe_manager *pm,
-		const struct gralloc_drm_handle_t *handle)
+static int get_pipe_buffer_locked(struct pipe_manager *pm,
+		const struct gralloc_drm_handle_t *handle,
+		struct pipe_buffer *buf)
 {
-	struct pipe_buffer *buf;
 	struct pipe_resource templ;
 
 	memset(&templ, 0, sizeof(templ));
@@ -123,13 +124,7 @@ static struct pipe_buffer *get_pipe_buffer_locked(struct pipe_manager *pm,
 	    !pm->screen->is_format_supported(pm->screen, templ.format,
 				templ.target, 0, templ.bind)) {
 		LOGE("unsupported format 0x%x", handle->format);
-		return NULL;
-	}
-
-	buf = CALLOC(1, sizeof(*buf));
-	if (!buf) {
-		LOGE("failed to allocate pipe buffer");
-		return NULL;
+		return -EINVAL;
 	}
 
 	templ.width0 = handle->width;
@@ -159,8 +154,8 @@ static struct pipe_buffer *get_pipe_buffer_locked(struct pipe_manager *pm,
 			goto fail;
 	}
 
-	/* need the gem handle for fb */
-	if (handle->usage & GRALLOC_USAGE_HW_FB) {
+	/* need the gem handle for fb and for PRIME export */
+	{
 		struct winsys_handle tmp;
 
 		memset(&tmp, 0, sizeof(tmp));
@@ -172,35 +167,36 @@ static struct pipe_buffer *get_pipe_buffer_locked(struct pipe_manager *pm,
 		buf->base.fb_handle = tmp.handle;
 	}
 
-	return buf;
+	return 0;
 
 fail:
 	LOGE("failed to allocate pipe buffer");
 	if (buf->resource)
 		pipe_resource_reference(&buf->resource, NULL);
-	FREE(buf);
 
-	return NULL;
+	return -ENOMEM;
 }
 
-static struct gralloc_drm_bo_t *pipe_alloc(struct gralloc_drm_drv_t *drv,
-		struct gralloc_drm_handle_t *handle)
+static int pipe_alloc(struct gralloc_drm_drv_t *drv,
+		struct gralloc_drm_handle_t *handle,
+		struct gralloc_drm_bo_t *bo)
 {
 	struct pipe_manager *pm = (struct pipe_manager *) drv;
-	struct pipe_buffer *buf;
+	struct pipe_buffer *buf = (struct pipe_buffer *) bo;
+	int err;
 
 	pthread_mutex_lock(&pm->mutex);
-	buf = get_pipe_buffer_locked(pm, handle);
+	err = get_pipe_buffer_locked(pm, handle, buf);
 	pthread_mutex_unlock(&pm->mutex);
 
-	if (buf) {
+	if (!err) {
 		handle->name = (int) buf->winsys.handle;
 		handle->stride = (int) buf->winsys.stride;
 
 		buf->base.handle = handle;
 	}
 
-	return &buf->base;
+	return err;
 }
 
 static void pipe_free(struct gralloc_drm_drv_t *drv, struct gralloc_drm_bo_t *bo)
@@ -215,8 +211,6 @@ static void pipe_free(struct gralloc_drm_drv_t *drv, struct gralloc_drm_bo_t *bo
 	pipe_resource_reference(&buf->resource, NULL);
 
 	pthread_mutex_unlock(&pm->mutex);
-
-	FREE(buf);
 }
 
 static int pipe_map(struct gralloc_drm_drv_t *drv,
@@ -247,17 +241,44 @@ static int pipe_map(struct gralloc_drm_drv_t *drv,
 
 		assert(!buf->transfer);
 
+		buf->transfer = pipe_get_transfer(pm->context, buf->resource,
+				0, 0, usage, x, y, w, h);
+
 		/*
-		 * ignore x, y, w and h so that returned addr points at the
-		 * start of the buffer
+		 * addr must point at the start of the buffer, which a transfer
+		 * of the box can only give when it has the stride of the
+		 * buffer; transfer the whole buffer otherwise
 		 */
-		buf->transfer = pipe_get_transfer(pm->context, buf->resource,
-				0, 0, usage, 0, 0,
-				buf->resource->width0, buf->resource->height0);
-		if (buf->transfer)
-			*addr = pipe_transfer_map(pm->context, buf->transfer);
-		else
+		if (buf->transfer && buf->transfer->stride !=
+				(unsigned) buf->base.handle->stride) {
+			pipe_transfer_destroy(pm->context, buf->transfer);
+			x = 0;
+			y = 0;
+			buf->transfer = pipe_get_transfer(pm->context,
+					buf->resource, 0, 0, usage, 0, 0,
+					buf->resource->width0,
+					buf->resource->height0);
+		}
+
+		if (buf->transfer) {
+			char *ptr = pipe_transfer_map(pm->context,
+					buf->transfer);
+
+			if (ptr) {
+				*addr = ptr - y * buf->transfer->stride -
+					x * util_format_get_blocksize(
+						buf->resource->format);
+			}
+			else {
+				pipe_transfer_destroy(pm->context,
+						buf->transfer);
+				buf->transfer = NULL;
+				err = -ENOMEM;
+			}
+		}
+		else {
 			err = -ENOMEM;
+		}
 	}
 
 	pthread_mutex_unlock(&pm->mutex);
@@ -440,121 +461,65 @@ static int pipe_init_screen(struct pipe_manager *pm)
 	return 0;
 }
 
-#include <xf86drm.h>
-#include <i915_drm.h>
-#include <radeon_drm.h>
-static int pipe_get_pci_id(struct pipe_manager *pm,
-		const char *name, int *vendor, int *device)
+/*
+ * Return the gallium driver for a device, or NULL when none of the built-in
+ * ones drives it.
+ */
+static const char *pipe_find_driver(const struct gralloc_drm_device *dev)
 {
-	int err = -EINVAL;
+	const char *driver = dev->pci_driver;
 
-	if (strcmp(name, "i915") == 0) {
-		struct drm_i915_getparam gp;
-
-		*vendor = 0x8086;
-
-		memset(&gp, 0, sizeof(gp));
-		gp.param = I915_PARAM_CHIPSET_ID;
-		gp.value = device;
-		err = drmCommandWriteRead(pm->fd, DRM_I915_GETPARAM, &gp, sizeof(gp));
-	}
-	else if (strcmp(name, "radeon") == 0) {
-		struct drm_radeon_info info;
-
-		*vendor = 0x1002;
+	/* assume SVGA II when there is no PCI id */
+	if (!driver && strcmp(dev->name, "vmwgfx") == 0)
+		driver = "vmwgfx";
+	if (!driver)
+		return NULL;
 
-		memset(&info, 0, sizeof(info));
-		info.request = RADEON_INFO_DEVICE_ID;
-		info.value = (long) device;
-		err = drmCommandWriteRead(pm->fd, DRM_RADEON_INFO, &info, sizeof(info));
-	}
-	else if (strcmp(name, "nouveau") == 0) {
-		*vendor = 0x10de;
-		*device = 0;
-		err = 0;
-	}
-	else if (strcmp(name, "vmwgfx") == 0) {
-		*vendor = 0x15ad;
-		/* assume SVGA II */
-		*device = 0x0405;
-		err = 0;
-	}
-	else {
-		err = -EINVAL;
-	}
+#ifdef ENABLE_PIPE_NOUVEAU
+	if (strcmp(driver, "nouveau") == 0)
+		return driver;
+#endif
+#ifdef ENABLE_PIPE_R300
+	if (strcmp(driver, "r300") == 0)
+		return driver;
+#endif
+#ifdef ENABLE_PIPE_R600
+	if (strcmp(driver, "r600") == 0)
+		return driver;
+#endif
+#ifdef ENABLE_PIPE_VMWGFX
+	if (strcmp(driver, "vmwgfx") == 0)
+		return driver;
+#endif
 
-	return err;
+	return NULL;
 }
 
-#define DRIVER_MAP_GALLIUM_ONLY
-#include "pci_ids/pci_id_driver_map.h"
-static int pipe_find_driver(struct pipe_manager *pm, const char *name)
+static struct gralloc_drm_drv_t *pipe_drv_create(const struct gralloc_drm_device *dev)
 {
-	int vendor, device;
-	int err;
+	struct pipe_manager *pm;
 	const char *driver;
 
-	err = pipe_get_pci_id(pm, name, &vendor, &device);
-	if (!err) {
-		int idx;
-
-		/* look up in the driver map */
-		for (idx = 0; driver_map[idx].driver; idx++) {
-			int i;
-
-			if (vendor != driver_map[idx].vendor_id)
-				continue;
-
-			if (driver_map[idx].num_chips_ids == -1)
-				break;
-
-			for (i = 0; i < driver_map[idx].num_chips_ids; i++) {
-				if (driver_map[idx].chip_ids[i] == device)
-					break;
-			}
-			if (i < driver_map[idx].num_chips_ids)
-				break;
-		}
-
-		driver = driver_map[idx].driver;
-		err = (driver) ? 0 : -ENODEV;
-	}
-	else {
-		if (strcmp(name, "vmwgfx") == 0) {
-			driver = "vmwgfx";
-			err = 0;
-		}
-	}
-
-	if (!err)
-		strncpy(pm->driver, driver, sizeof(pm->driver) - 1);
-
-	return err;
-}
-
-struct gralloc_drm_drv_t *gralloc_drm_drv_create_for_pipe(int fd, const char *name)
-{
-	struct pipe_manager *pm;
+	driver = pipe_find_driver(dev);
+	if (!driver)
+		return NULL;
 
 	pm = CALLOC(1, sizeof(*pm));
 	if (!pm) {
-		LOGE("failed to allocate pipe manager for %s", name);
+		LOGE("failed to allocate pipe manager for %s", dev->name);
 		return NULL;
 	}
 
-	pm->fd = fd;
+	pm->fd = dev->fd;
 	pthread_mutex_init(&pm->mutex, NULL);
-
-	if (pipe_find_driver(pm, name)) {
-		FREE(pm);
-		return NULL;
-	}
+	strncpy(pm->driver, driver, sizeof(pm->driver) - 1);
 
 	if (pipe_init_screen(pm)) {
 		FREE(pm);
 		return NULL;
 	}
 
+	pm->base.bo_size = sizeof(struct pipe_buffer);
 	pm->base.destroy = pipe_destroy;
 	pm->base.init_kms_features = pipe_init_kms_features;
 	pm->base.alloc = pipe_alloc;
@@ -565,3 +530,19 @@ struct gralloc_drm_drv_t *gralloc_drm_drv_create_for_pipe(int fd, const char *na
 
 	return &pm->base;
 }
+
+/*
+ * A gallium driver accelerates the copies, and is preferred to the native
+ * backend of the same device.
+ */
+static int pipe_drv_probe(const struct gralloc_drm_device *dev)
+{
+	return (pipe_find_driver(dev)) ? GRALLOC_DRM_PROBE_PIPE : -1;
+}
+
+const struct gralloc_drm_backend gralloc_drm_backend_pipe = {
+	.version = GRALLOC_DRM_BACKEND_VERSION,
+	.name = "pipe",
+	.probe = pipe_drv_probe,
+	.create = pipe_drv_create,
+};
@@ -24,6 +24,7 @@
 #ifndef _GRALLOC_DRM_PRIV_H_
 #define _GRALLOC_DRM_PRIV_H_
 
+#include <pthread.h>
 #include <xf86drm.h>
 #include <xf86drmMode.h>
 
@@ -38,6 +39,15 @@ enum drm_swap_mode {
 };
 
 struct gralloc_drm_drv_t {
+	/* size of the driver bo struct, which embeds struct gralloc_drm_bo_t */
+	size_t bo_size;
+
+	/*
+	 * the driver works on render nodes: it does without GEM names and
+	 * imports bo's from dma-bufs
+	 */
+	int render_node;
+
 	/* destroy the driver */
 	void (*destroy)(struct gralloc_drm_drv_t *drv);
 
@@ -45,15 +55,22 @@ struct gralloc_drm_drv_t {
 	void (*init_kms_features)(struct gralloc_drm_drv_t *drv,
 				  struct gralloc_drm_t *drm);
 
-	/* allocate or import a bo */
-	struct gralloc_drm_bo_t *(*alloc)(struct gralloc_drm_drv_t *drv,
-			                  struct gralloc_drm_handle_t *handle);
+	/*
+	 * allocate or import a bo; the bo struct of bo_size bytes is zeroed
+	 * and owned by the core
+	 */
+	int (*alloc)(struct gralloc_drm_drv_t *drv,
+		     struct gralloc_drm_handle_t *handle,
+		     struct gralloc_drm_bo_t *bo);
 
-	/* free a bo */
+	/* free the resources of a bo, but not the bo struct itself */
 	void (*free)(struct gralloc_drm_drv_t *drv,
 		     struct gralloc_drm_bo_t *bo);
 
-	/* map a bo for CPU access */
+	/*
+	 * map a bo for CPU access; only the box x, y, w, h needs to be made
+	 * accessible, but addr points at the start of the bo either way
+	 */
 	int (*map)(struct gralloc_drm_drv_t *drv,
 		   struct gralloc_drm_bo_t *bo,
 		   int x, int y, int w, int h, int enable_write, void **addr);
@@ -62,23 +79,221 @@ struct gralloc_drm_drv_t {
 	void (*unmap)(struct gralloc_drm_drv_t *drv,
 		      struct gralloc_drm_bo_t *bo);
 
-	/* copy between two bo's, used for DRM_SWAP_COPY */
+	/*
+	 * Optional.  Prepare a bo that is still mapped for CPU access again,
+	 * as map does for a new mapping.  Drivers providing prepare have
+	 * their mappings kept between locks.
+	 */
+	int (*prepare)(struct gralloc_drm_drv_t *drv,
+		       struct gralloc_drm_bo_t *bo,
+		       int x, int y, int w, int h, int enable_write);
+
+	/* optional; end CPU access to a mapped bo, also before unmap */
+	void (*finish)(struct gralloc_drm_drv_t *drv,
+		       struct gralloc_drm_bo_t *bo);
+
+	/*
+	 * optional; return 1 if the GPU still uses the bo in a way that
+	 * conflicts with CPU reads, or writes if enable_write is true, 0 if
+	 * not, or a negative errno to poll the dma-buf instead
+	 */
+	int (*busy)(struct gralloc_drm_drv_t *drv,
+		    struct gralloc_drm_bo_t *bo, int enable_write);
+
+	/*
+	 * optional; clean and/or invalidate the CPU caches for the box of a
+	 * bo that is being accessed by the CPU
+	 */
+	int (*sync)(struct gralloc_drm_drv_t *drv,
+		    struct gralloc_drm_bo_t *bo,
+		    int x, int y, int w, int h, int flags);
+
+	/*
+	 * optional; copy between two bo's, used for DRM_SWAP_COPY, with the
+	 * CPU copy of the core as the default
+	 */
 	void (*copy)(struct gralloc_drm_drv_t *drv,
 		     struct gralloc_drm_bo_t *dst,
 		     struct gralloc_drm_bo_t *src,
 		     short x1, short y1, short x2, short y2);
 };
 
+/* threads whose read locks of a bo are told apart, for upgrades */
+#define GRALLOC_DRM_LOCK_READERS 8
+
 struct gralloc_drm_bo_t {
 	struct gralloc_drm_t *drm;
 	struct gralloc_drm_handle_t *handle;
 
 	int imported;  /* the handle is from a remote proces when true */
-	int fb_handle; /* the GEM handle of the bo */
+	int exported;  /* the handle has been given out of the core */
+	int fb_handle; /* the GEM handle of the bo, set for all bo's */
 	int fb_id;     /* the fb id */
 
-	int lock_count;
-	int locked_for;
+	/*
+	 * lock state, protected by lock_mutex: SW readers share the lock and
+	 * the mapping, a SW writer holds them exclusively
+	 */
+	pthread_mutex_t lock_mutex;
+	pthread_cond_t lock_cond;
+	int lock_count;     /* holders, nested locks included */
+	int locked_for;     /* usages of all holders */
+	int writer_depth;   /* locks held by the writer thread */
+	pthread_t writer;
+	struct {
+		pthread_t thread;
+		int count;
+	} readers[GRALLOC_DRM_LOCK_READERS]; /* read locks of each thread */
+	int untracked_readers; /* read locks of threads beyond readers[] */
+	int holder_waiting; /* a holder waits for the others to unlock */
+	int map_count;      /* holders sharing the mapping */
+	int map_write;      /* the mapping is writable */
+	int map_x, map_y, map_w, map_h; /* the box that is mapped */
+	void *map_addr;
+	int prepare_pending; /* mapped by an async lock without prepare */
+
+	/* LRU links and bookkeeping while unlocked but mapped */
+	struct gralloc_drm_bo_t *map_prev, *map_next;
+	int map_cached;
+	long map_size;
+
+	long size;      /* the allocated size in bytes, 0 if unknown */
+	int needs_zero; /* the content is not known to be zero */
+	int tiled;      /* set by the drivers for the accounting */
+	int domain;     /* GRALLOC_DRM_DOMAIN_*, set by the drivers */
+
+	/* what the bo is accounted as, 0 mem_size when it is not */
+	int mem_class;
+	long mem_size;
+
+	int64_t create_time;
+	int parked;     /* GRALLOC_DRM_BO_{CACHED,POOLED} when not in use */
+	int present_pending; /* posts queued or flipping, under present.mutex */
+	int present_doomed;  /* destroyed while on screen, under present.mutex */
+
+	/* for imported bo's, shared by all handles of the same buffer */
+	int import_refcount;
+	uint64_t import_key;
+	struct gralloc_drm_bo_t *import_next;
+
+	/*
+	 * bucket list links and bookkeeping while in the bo cache; a bo in
+	 * the warm pool uses cache_next and cache_size the same way
+	 */
+	struct gralloc_drm_bo_t *cache_prev, *cache_next;
+	int cache_bucket;
+	long cache_size;
+	int64_t cache_time;
+};
+
+/* where an unused bo is kept, for the allocation report */
+enum {
+	GRALLOC_DRM_BO_LIVE,
+	GRALLOC_DRM_BO_CACHED,
+	GRALLOC_DRM_BO_POOLED,
+};
+
+#define GRALLOC_DRM_BO_CACHE_BUCKETS 16
+
+/* when bo's that are not known to be zero get zeroed */
+enum gralloc_drm_zero_mode {
+	GRALLOC_DRM_ZERO_SYNC,  /* when handed out */
+	GRALLOC_DRM_ZERO_ASYNC, /* by a worker while in the bo cache */
+};
+
+/* freed bo's kept around for reuse, per process */
+struct gralloc_drm_bo_cache {
+	pthread_mutex_t mutex;
+
+	enum gralloc_drm_zero_mode zero_mode;
+	pthread_cond_t zero_cond;
+	pthread_t zero_worker;
+	int zero_worker_started;
+	int zero_worker_quit;
+	int dirty;  /* number of bo's that need zeroing */
+
+	/* most recently freed bo first */
+	struct gralloc_drm_bo_t *heads[GRALLOC_DRM_BO_CACHE_BUCKETS];
+	struct gralloc_drm_bo_t *tails[GRALLOC_DRM_BO_CACHE_BUCKETS];
+
+	int count;
+	long size;
+	long max_size;  /* 0 disables the cache */
+	int max_age_ms;
+	int keep_exported; /* also recycle bo's that were given out */
+
+	unsigned int hits, misses, evictions;
+};
+
+#define GRALLOC_DRM_BO_POOL_SHAPES 8
+
+/* a buffer shape that the warm pool keeps bo's of */
+struct gralloc_drm_bo_pool_shape {
+	int width, height, format, usage;
+	int pinned;             /* learned from KMS, never expires */
+	unsigned int requests;  /* allocations that missed the pool */
+	int64_t last_use;
+	int count;              /* bo's of this shape in the pool */
+};
+
+/* bo's allocated ahead of time, per process */
+struct gralloc_drm_bo_pool {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	pthread_t worker;
+	int worker_started;
+	int worker_quit;
+	int suspended;  /* no refilling until the next allocation */
+
+	struct gralloc_drm_bo_pool_shape shapes[GRALLOC_DRM_BO_POOL_SHAPES];
+	struct gralloc_drm_bo_t *bos;
+
+	long size;
+	long max_size;  /* 0 disables the pool */
+
+	unsigned int hits, misses;
+};
+
+/* mappings of unlocked bo's kept for the next lock, per process */
+struct gralloc_drm_map_cache {
+	pthread_mutex_t mutex;
+
+	/* most recently unlocked bo first */
+	struct gralloc_drm_bo_t *head, *tail;
+
+	int count;
+	long size;
+	long max_size;  /* 0 disables the cache */
+
+	unsigned int hits, misses, evictions;
+};
+
+/* graphics memory accounting of the process */
+struct gralloc_drm_mem {
+	pthread_mutex_t mutex;
+	struct gralloc_drm_mem_info info;
+
+	gralloc_drm_mem_pressure_t pressure_callback;
+	void *pressure_data;
+};
+
+#define GRALLOC_DRM_IMPORT_BUCKETS 64
+
+/* bo's imported from other processes, keyed by GEM name or dma-buf inode */
+struct gralloc_drm_import_table {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond; /* signaled when a pending import is done */
+	struct gralloc_drm_bo_t *buckets[GRALLOC_DRM_IMPORT_BUCKETS];
+	int count;
+
+	/* buffers being opened by some thread, not in the buckets yet */
+	struct gralloc_drm_import_pending {
+		const struct gralloc_drm_handle_t *handle;
+		uint64_t key;
+		struct gralloc_drm_import_pending *next;
+	} *pending;
+
+	unsigned int hits, misses;
 };
 
 struct gralloc_kms_plane {
@@ -96,10 +311,46 @@ struct gralloc_kms_plane {
 	unsigned int formats[];
 };
 
+/* more damaged rects than this are merged into their bounding box */
+#define GRALLOC_DRM_MAX_DAMAGE 16
+
+/* the deepest flip queue */
+#define GRALLOC_DRM_PRESENT_QUEUE 4
+
+struct gralloc_drm_post {
+	struct gralloc_drm_bo_t *bo;
+	drmModeClip damage[GRALLOC_DRM_MAX_DAMAGE];
+	int damage_count; /* -1 when all of the bo changed */
+};
+
+/*
+ * The presenter, a thread that makes the KMS calls of the posts so that the
+ * caller does not wait for vblank.  Protected by mutex; cond is signaled
+ * whenever the queue or a present_pending changes.
+ */
+struct gralloc_drm_present {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	pthread_t thread;
+	int running; /* posts are queued, otherwise made by the caller */
+	int stop;
+
+	struct gralloc_drm_post queue[GRALLOC_DRM_PRESENT_QUEUE];
+	int head, count;
+	int pending; /* posts queued, being made, or flipping */
+	int depth;   /* pending posts before post blocks */
+
+	gralloc_drm_release_t release_callback;
+	void *release_data;
+};
+
 struct gralloc_drm_t {
 	/* initialized by gralloc_drm_create */
-	int fd;
+	int fd;          /* where bo's are allocated */
+	int kms_fd;      /* the primary node, -1 until needed */
+	int render_node; /* fd is a render node, not kms_fd */
 	struct gralloc_drm_drv_t *drv;
+	uint64_t prime_caps; /* DRM_PRIME_CAP_* of fd */
 
 	/* initialized by gralloc_drm_init_kms */
 	drmModeResPtr resources;
@@ -123,12 +374,22 @@ struct gralloc_drm_t {
 
 	int first_post;
 	int master;
+	/* of the next post in DRM_SWAP_COPY, -1 when all of the bo changed */
+	drmModeClip damage[GRALLOC_DRM_MAX_DAMAGE];
+	int damage_count;
 	struct gralloc_drm_bo_t *current_front, *next_front;
 	int waiting_flip;
 	unsigned int last_swap;
 
 	int plane_count;
 	struct gralloc_kms_plane **planes;
+
+	struct gralloc_drm_bo_cache bo_cache;
+	struct gralloc_drm_bo_pool bo_pool;
+	struct gralloc_drm_map_cache map_cache;
+	struct gralloc_drm_mem mem;
+	struct gralloc_drm_import_table imports;
+	struct gralloc_drm_present present;
 };
 
 struct drm_module_t {
@@ -139,10 +400,56 @@ struct drm_module_t {
 	struct gralloc_drm_t *drm;
 };
 
-struct gralloc_drm_drv_t *gralloc_drm_drv_create_for_pipe(int fd, const char *name);
-struct gralloc_drm_drv_t *gralloc_drm_drv_create_for_intel(int fd);
-struct gralloc_drm_drv_t *gralloc_drm_drv_create_for_omap(int fd);
-struct gralloc_drm_drv_t *gralloc_drm_drv_create_for_radeon(int fd);
-struct gralloc_drm_drv_t *gralloc_drm_drv_create_for_nouveau(int fd);
+/* a DRM device as the backends see it when probing */
+struct gralloc_drm_device {
+	int fd;
+	const char *name;       /* of the kernel driver */
+	int vendor_id;          /* PCI ids, 0 when not a PCI device */
+	int device_id;
+	const char *pci_driver; /* of the PCI id in pci_id_driver_map.h */
+	uint64_t dumb_buffer;   /* DRM_CAP_DUMB_BUFFER */
+	uint64_t prime_caps;    /* DRM_CAP_PRIME */
+};
+
+/* probe scores; the best backend of a device is the fastest one */
+enum {
+	GRALLOC_DRM_PROBE_FALLBACK = 0,
+	GRALLOC_DRM_PROBE_NATIVE = 10,
+	GRALLOC_DRM_PROBE_PIPE = 20,
+};
+
+#define GRALLOC_DRM_BACKEND_VERSION 1
+
+/*
+ * A backend in the registry.  A plugin, loaded from
+ * GRALLOC_DRM_PLUGIN_DIR/gralloc_drm_<kernel driver>.so, exports one as
+ * gralloc_drm_backend.
+ */
+struct gralloc_drm_backend {
+	int version; /* GRALLOC_DRM_BACKEND_VERSION */
+	const char *name;
+
+	/* return a GRALLOC_DRM_PROBE_* score, or -1 if the device is not driven */
+	int (*probe)(const struct gralloc_drm_device *dev);
+
+	/* create the driver for a device the backend has probed */
+	struct gralloc_drm_drv_t *(*create)(const struct gralloc_drm_device *dev);
+};
+
+int gralloc_drm_bo_defer_destroy(struct gralloc_drm_bo_t *bo);
+
+/* the copy of the drivers without a blitter */
+void gralloc_drm_cpu_copy(struct gralloc_drm_drv_t *drv,
+		struct gralloc_drm_bo_t *dst,
+		struct gralloc_drm_bo_t *src,
+		short x1, short y1, short x2, short y2);
+
+extern const struct gralloc_drm_backend gralloc_drm_backend_pipe;
+extern const struct gralloc_drm_backend gralloc_drm_backend_intel;
+extern const struct gralloc_drm_backend gralloc_drm_backend_omap;
+extern const struct gralloc_drm_backend gralloc_drm_backend_radeon;
+extern const struct gralloc_drm_backend gralloc_drm_backend_nouveau;
+extern const struct gralloc_drm_backend gralloc_drm_backend_dumb;
+extern const struct gralloc_drm_backend gralloc_drm_backend_bench;
 
 #endif /* _GRALLOC_DRM_PRIV_H_ */
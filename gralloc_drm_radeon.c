@@ -31,7 +31,9 @@
 
 #include <cutils/log.h>
 #include <stdlib.h>
+#include <string.h>
 #include <errno.h>
+#include <unistd.h>
 #include <drm.h>
 #include <radeon_drm.h>
 #include <radeon_bo_gem.h>
@@ -231,65 +233,66 @@ static struct radeon_bo *radeon_alloc(struct radeon_info *info,
 	if (tiling)
 		radeon_bo_set_tiling(rbo, tiling, pitch);
 
+	/* there are no GEM names on render nodes; dma-buf will do */
 	if (radeon_gem_get_kernel_name(rbo,
-				(uint32_t *) &handle->name)) {
-		LOGE("failed to flink rbo");
-		radeon_bo_unref(rbo);
-		return NULL;
-	}
+				(uint32_t *) &handle->name))
+		handle->name = 0;
 
 	handle->stride = pitch;
 
 	return rbo;
 }
 
-static void radeon_zero(struct radeon_info *info,
-		struct radeon_bo *rbo)
-{
-	/* should use HW clear... */
-	if (!radeon_bo_map(rbo, 1)) {
-		memset(rbo->ptr, 0, rbo->size);
-		radeon_bo_unmap(rbo);
-	}
-}
-
-static struct gralloc_drm_bo_t *
-drm_gem_radeon_alloc(struct gralloc_drm_drv_t *drv, struct gralloc_drm_handle_t *handle)
+static int
+drm_gem_radeon_alloc(struct gralloc_drm_drv_t *drv,
+		struct gralloc_drm_handle_t *handle,
+		struct gralloc_drm_bo_t *bo)
 {
 	struct radeon_info *info = (struct radeon_info *) drv;
-	struct radeon_buffer *rbuf;
-
-	rbuf = calloc(1, sizeof(*rbuf));
-	if (!rbuf)
-		return NULL;
-
-	if (handle->name) {
-		rbuf->rbo = radeon_bo_open(info->bufmgr,
-				handle->name, 0, 0, 0, 0);
-		if (!rbuf->rbo) {
-			LOGE("failed to create rbo from name %u",
-					handle->name);
-			free(rbuf);
-			return NULL;
+	struct radeon_buffer *rbuf = (struct radeon_buffer *) bo;
+	uint32_t tiling, pitch;
+
+	if (gralloc_drm_handle_prime_fd(handle) >= 0 || handle->name) {
+		off_t size;
+
+		size = (gralloc_drm_handle_prime_fd(handle) >= 0) ?
+			lseek(handle->prime_fd, 0, SEEK_END) : -1;
+		if (size > 0) {
+			rbuf->rbo = radeon_gem_bo_open_prime(info->bufmgr,
+					handle->prime_fd, size);
+			if (!rbuf->rbo) {
+				LOGE("failed to create rbo from dma-buf %d",
+						handle->prime_fd);
+				return -EINVAL;
+			}
+		}
+		else {
+			rbuf->rbo = radeon_bo_open(info->bufmgr,
+					handle->name, 0, 0, 0, 0);
+			if (!rbuf->rbo) {
+				LOGE("failed to create rbo from name %u",
+						handle->name);
+				return -EINVAL;
+			}
 		}
 	}
 	else {
 		rbuf->rbo = radeon_alloc(info, handle);
-		if (!rbuf->rbo) {
-			free(rbuf);
-			return NULL;
-		}
+		if (!rbuf->rbo)
+			return -ENOMEM;
 
-		/* Android expects the buffer to be zeroed */
-		radeon_zero(info, rbuf->rbo);
+		/* VRAM is not cleared by the kernel; should use HW clear... */
+		rbuf->base.needs_zero = 1;
 	}
 
-	if (handle->usage & GRALLOC_USAGE_HW_FB)
-		rbuf->base.fb_handle = rbuf->rbo->handle;
+	rbuf->base.fb_handle = rbuf->rbo->handle;
+	rbuf->base.size = rbuf->rbo->size;
+	if (!radeon_bo_get_tiling(rbuf->rbo, &tiling, &pitch))
+		rbuf->base.tiled = (tiling != 0);
 
 	rbuf->base.handle = handle;
 
-	return &rbuf->base;
+	return 0;
 }
 
 static void drm_gem_radeon_free(struct gralloc_drm_drv_t *drv,
@@ -320,6 +323,35 @@ static void drm_gem_radeon_unmap(struct gralloc_drm_drv_t *drv,
 	radeon_bo_unmap(rbuf->rbo);
 }
 
+static int drm_gem_radeon_prepare(struct gralloc_drm_drv_t *drv,
+		struct gralloc_drm_bo_t *bo, int x, int y, int w, int h,
+		int enable_write)
+{
+	struct radeon_buffer *rbuf = (struct radeon_buffer *) bo;
+	return radeon_bo_wait(rbuf->rbo);
+}
+
+static int drm_gem_radeon_busy(struct gralloc_drm_drv_t *drv,
+		struct gralloc_drm_bo_t *bo, int enable_write)
+{
+	struct radeon_buffer *rbuf = (struct radeon_buffer *) bo;
+	uint32_t domain;
+	int ret;
+
+	ret = radeon_bo_is_busy(rbuf->rbo, &domain);
+
+	return (ret == -EBUSY) ? 1 : ret;
+}
+
+static int drm_gem_radeon_sync(struct gralloc_drm_drv_t *drv,
+		struct gralloc_drm_bo_t *bo, int x, int y, int w, int h,
+		int flags)
+{
+	struct radeon_buffer *rbuf = (struct radeon_buffer *) bo;
+	return (flags & GRALLOC_DRM_SYNC_INVALIDATE) ?
+		radeon_bo_wait(rbuf->rbo) : 0;
+}
+
 static void drm_gem_radeon_init_kms_features(struct gralloc_drm_drv_t *drv,
 		struct gralloc_drm_t *drm)
 {
@@ -517,7 +549,7 @@ static int radeon_probe(struct radeon_info *info)
 	return 0;
 }
 
-struct gralloc_drm_drv_t *gralloc_drm_drv_create_for_radeon(int fd)
+static struct gralloc_drm_drv_t *radeon_drv_create(const struct gralloc_drm_device *dev)
 {
 	struct radeon_info *info;
 
@@ -525,7 +557,7 @@ struct gralloc_drm_drv_t *gralloc_drm_drv_create_for_radeon(int fd)
 	if (!info)
 		return NULL;
 
-	info->fd = fd;
+	info->fd = dev->fd;
 	if (radeon_probe(info)) {
 		free(info);
 		return NULL;
@@ -538,12 +570,31 @@ struct gralloc_drm_drv_t *gralloc_drm_drv_create_for_radeon(int fd)
 		return NULL;
 	}
 
+	info->base.bo_size = sizeof(struct radeon_buffer);
+	info->base.render_node = 1;
 	info->base.destroy = drm_gem_radeon_destroy;
 	info->base.init_kms_features = drm_gem_radeon_init_kms_features;
 	info->base.alloc = drm_gem_radeon_alloc;
 	info->base.free = drm_gem_radeon_free;
 	info->base.map = drm_gem_radeon_map;
 	info->base.unmap = drm_gem_radeon_unmap;
+	info->base.prepare = drm_gem_radeon_prepare;
+	info->base.busy = drm_gem_radeon_busy;
+	/* mappings are coherent; only GPU writes need waiting for */
+	info->base.sync = drm_gem_radeon_sync;
 
 	return &info->base;
 }
+
+static int radeon_drv_probe(const struct gralloc_drm_device *dev)
+{
+	return (strcmp(dev->name, "radeon") == 0) ?
+		GRALLOC_DRM_PROBE_NATIVE : -1;
+}
+
+const struct gralloc_drm_backend gralloc_drm_backend_radeon = {
+	.version = GRALLOC_DRM_BACKEND_VERSION,
+	.name = "radeon",
+	.probe = radeon_drv_probe,
+	.create = radeon_drv_create,
+};
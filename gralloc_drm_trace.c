@@ -0,0 +1,328 @@
+/*
+ * Copyright (C) 2010-2011 Chia-I Wu <olvaffe@gmail.com>
+ * Copyright (C) 2010-2011 LunarG Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#define LOG_TAG "HWDRM-TRACE"
+
+#include <cutils/log.h>
+#include <cutils/properties.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "gralloc_drm.h"
+#include "gralloc_drm_trace.h"
+
+#define GRALLOC_DRM_TRACE_MARKER "/sys/kernel/debug/tracing/trace_marker"
+
+/*
+ * Latencies below 4us have a bucket each; every octave above is split in 4
+ * buckets, so that a percentile is off by less than 25%.
+ */
+#define GRALLOC_DRM_TRACE_SUB_BUCKETS 4
+#define GRALLOC_DRM_TRACE_BUCKETS (GRALLOC_DRM_TRACE_SUB_BUCKETS * 31)
+
+/*
+ * The latencies recorded by a thread.  Only the thread writes to its
+ * histograms, so recording takes no lock; readers sum up the histograms of
+ * all threads and may see them a few samples behind.  The records outlive
+ * their threads and are taken over by new threads.
+ */
+struct trace_thread {
+	struct trace_thread *next;
+	volatile int in_use;
+
+	unsigned int buckets[GRALLOC_DRM_TRACE_COUNT][GRALLOC_DRM_TRACE_BUCKETS];
+	unsigned int count[GRALLOC_DRM_TRACE_COUNT];
+	unsigned int max_us[GRALLOC_DRM_TRACE_COUNT];
+};
+
+static const char *trace_names[GRALLOC_DRM_TRACE_COUNT] = {
+	"gralloc_alloc",
+	"gralloc_register",
+	"gralloc_lock",
+	"gralloc_unlock",
+	"gralloc_post",
+	"gralloc_flip_wait",
+	"gralloc_vblank_wait",
+};
+
+volatile int gralloc_drm_trace_mode;
+
+static struct trace_thread *volatile trace_threads;
+static pthread_key_t trace_key;
+static pthread_once_t trace_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t trace_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int trace_marker_fd = -1;
+
+static int64_t trace_get_time_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Hand the record of an exiting thread over to the next new thread.
+ */
+static void trace_thread_exit(void *data)
+{
+	struct trace_thread *t = (struct trace_thread *) data;
+
+	__sync_synchronize();
+	t->in_use = 0;
+}
+
+static void trace_create_key(void)
+{
+	pthread_key_create(&trace_key, trace_thread_exit);
+}
+
+/*
+ * Return the record of the calling thread.
+ */
+static struct trace_thread *trace_get_thread(void)
+{
+	struct trace_thread *t, *head;
+
+	t = (struct trace_thread *) pthread_getspecific(trace_key);
+	if (t)
+		return t;
+
+	for (t = trace_threads; t; t = t->next) {
+		if (!t->in_use && __sync_bool_compare_and_swap(&t->in_use, 0, 1))
+			break;
+	}
+
+	if (!t) {
+		t = calloc(1, sizeof(*t));
+		if (!t)
+			return NULL;
+		t->in_use = 1;
+
+		do {
+			head = trace_threads;
+			t->next = head;
+		} while (!__sync_bool_compare_and_swap(&trace_threads, head, t));
+	}
+
+	pthread_setspecific(trace_key, t);
+
+	return t;
+}
+
+static void trace_marker(const char *buf, int len)
+{
+	if (trace_marker_fd >= 0 && write(trace_marker_fd, buf, len) < 0) {
+		/* not worth a log line per trace point */
+	}
+}
+
+/*
+ * Initialize tracing.  The mode is set by debug.drm.trace, as a mask of
+ * GRALLOC_DRM_TRACE_HISTOGRAMS and GRALLOC_DRM_TRACE_MARKERS.
+ */
+void gralloc_drm_trace_init(void)
+{
+	char value[PROPERTY_VALUE_MAX];
+
+	pthread_once(&trace_once, trace_create_key);
+
+	if (property_get("debug.drm.trace", value, NULL))
+		gralloc_drm_trace_set_mode(atoi(value));
+}
+
+/*
+ * Set what tracing does, 0 to disable it.
+ */
+int gralloc_drm_trace_set_mode(int mode)
+{
+#ifdef ENABLE_TRACE
+	pthread_once(&trace_once, trace_create_key);
+
+	pthread_mutex_lock(&trace_mutex);
+	if ((mode & GRALLOC_DRM_TRACE_MARKERS) && trace_marker_fd < 0) {
+		trace_marker_fd = open(GRALLOC_DRM_TRACE_MARKER,
+				O_WRONLY | O_CLOEXEC);
+		if (trace_marker_fd < 0) {
+			LOGW("failed to open %s, no trace markers",
+					GRALLOC_DRM_TRACE_MARKER);
+			mode &= ~GRALLOC_DRM_TRACE_MARKERS;
+		}
+	}
+	gralloc_drm_trace_mode = mode;
+	pthread_mutex_unlock(&trace_mutex);
+
+	return 0;
+#else
+	return (mode) ? -ENOSYS : 0;
+#endif
+}
+
+/*
+ * Start timing a trace point.  Return the start time, never 0.
+ */
+int64_t gralloc_drm_trace_begin(int point)
+{
+	if (gralloc_drm_trace_mode & GRALLOC_DRM_TRACE_MARKERS) {
+		char buf[64];
+		int len;
+
+		len = snprintf(buf, sizeof(buf), "B|%d|%s", getpid(),
+				trace_names[point]);
+		trace_marker(buf, len);
+	}
+
+	return trace_get_time_ns() | 1;
+}
+
+/*
+ * Return the bucket of a latency: the exponent picks the octave and the two
+ * bits below the leading one the bucket in it.
+ */
+static unsigned int trace_bucket(unsigned int us)
+{
+	int shift;
+
+	if (us < GRALLOC_DRM_TRACE_SUB_BUCKETS)
+		return us;
+
+	shift = 31 - __builtin_clz(us) - 2;
+
+	return GRALLOC_DRM_TRACE_SUB_BUCKETS * (shift + 1) +
+		((us >> shift) & (GRALLOC_DRM_TRACE_SUB_BUCKETS - 1));
+}
+
+/*
+ * Return the largest latency of a bucket.
+ */
+static unsigned int trace_bucket_max(unsigned int bucket)
+{
+	unsigned int shift, sub;
+
+	if (bucket < GRALLOC_DRM_TRACE_SUB_BUCKETS)
+		return bucket;
+
+	shift = bucket / GRALLOC_DRM_TRACE_SUB_BUCKETS - 1;
+	sub = bucket % GRALLOC_DRM_TRACE_SUB_BUCKETS;
+
+	return (unsigned int) ((((unsigned long long)
+			GRALLOC_DRM_TRACE_SUB_BUCKETS + sub + 1) << shift) - 1);
+}
+
+/*
+ * Stop timing a trace point and record the latency.
+ */
+void gralloc_drm_trace_end(int point, int64_t start)
+{
+	int64_t us = (trace_get_time_ns() - start) / 1000;
+
+	if (gralloc_drm_trace_mode & GRALLOC_DRM_TRACE_MARKERS)
+		trace_marker("E", 1);
+
+	if (gralloc_drm_trace_mode & GRALLOC_DRM_TRACE_HISTOGRAMS) {
+		struct trace_thread *t = trace_get_thread();
+		unsigned int val, bucket;
+
+		if (!t)
+			return;
+
+		val = (us > 0xffffffffLL) ? 0xffffffff :
+			(us > 0) ? (unsigned int) us : 0;
+		bucket = trace_bucket(val);
+
+		t->buckets[point][bucket]++;
+		t->count[point]++;
+		if (t->max_us[point] < val)
+			t->max_us[point] = val;
+	}
+}
+
+/*
+ * Return the largest latency of the bucket where the given fraction, in
+ * percent, of the samples is reached.
+ */
+static unsigned int trace_percentile(const unsigned int *buckets,
+		unsigned int count, int percent, unsigned int max_us)
+{
+	unsigned long long target = ((unsigned long long) count * percent +
+			99) / 100;
+	unsigned long long sum = 0;
+	unsigned int bound;
+	int i;
+
+	for (i = 0; i < GRALLOC_DRM_TRACE_BUCKETS; i++) {
+		sum += buckets[i];
+		if (sum >= target)
+			break;
+	}
+
+	bound = (i < GRALLOC_DRM_TRACE_BUCKETS) ? trace_bucket_max(i) : max_us;
+
+	return (bound < max_us) ? bound : max_us;
+}
+
+/*
+ * Get the latencies of up to count trace points, summed up over all threads.
+ * Return the number of trace points.
+ */
+int gralloc_drm_trace_get_stats(struct gralloc_drm_trace_stats *stats,
+		int count)
+{
+	unsigned int buckets[GRALLOC_DRM_TRACE_BUCKETS];
+	struct trace_thread *t;
+	int point, i;
+
+	if (count > GRALLOC_DRM_TRACE_COUNT)
+		count = GRALLOC_DRM_TRACE_COUNT;
+
+	for (point = 0; point < count; point++) {
+		struct gralloc_drm_trace_stats *s = &stats[point];
+
+		memset(s, 0, sizeof(*s));
+		memset(buckets, 0, sizeof(buckets));
+
+		for (t = trace_threads; t; t = t->next) {
+			for (i = 0; i < GRALLOC_DRM_TRACE_BUCKETS; i++)
+				buckets[i] += t->buckets[point][i];
+			s->count += t->count[point];
+			if (s->max_us < t->max_us[point])
+				s->max_us = t->max_us[point];
+		}
+
+		if (s->count) {
+			s->p50_us = trace_percentile(buckets, s->count, 50,
+					s->max_us);
+			s->p99_us = trace_percentile(buckets, s->count, 99,
+					s->max_us);
+		}
+	}
+
+	return count;
+}
@@ -0,0 +1,69 @@
+/*
+ * Copyright (C) 2010-2011 Chia-I Wu <olvaffe@gmail.com>
+ * Copyright (C) 2010-2011 LunarG Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef _GRALLOC_DRM_TRACE_H_
+#define _GRALLOC_DRM_TRACE_H_
+
+#include <stdint.h>
+
+#include "gralloc_drm.h"
+
+#ifndef unlikely
+#define unlikely(x) __builtin_expect(!!(x), 0)
+#endif
+
+void gralloc_drm_trace_init(void);
+int64_t gralloc_drm_trace_begin(int point);
+void gralloc_drm_trace_end(int point, int64_t start);
+
+/*
+ * Trace points.  A trace point costs a load and a branch when tracing is
+ * disabled at run time, and nothing when built without ENABLE_TRACE.
+ *
+ *	GRALLOC_DRM_TRACE_BEGIN(LOCK);
+ *	...
+ *	GRALLOC_DRM_TRACE_END(LOCK);
+ */
+#ifdef ENABLE_TRACE
+
+extern volatile int gralloc_drm_trace_mode;
+
+#define GRALLOC_DRM_TRACE_BEGIN(point)                                   \
+	int64_t __trace_ ## point = (unlikely(gralloc_drm_trace_mode)) ? \
+		gralloc_drm_trace_begin(GRALLOC_DRM_TRACE_ ## point) : 0
+
+#define GRALLOC_DRM_TRACE_END(point)                                     \
+	do {                                                             \
+		if (unlikely(__trace_ ## point))                         \
+			gralloc_drm_trace_end(GRALLOC_DRM_TRACE_ ## point, \
+					__trace_ ## point);              \
+	} while (0)
+
+#else /* ENABLE_TRACE */
+
+#define GRALLOC_DRM_TRACE_BEGIN(point) do { } while (0)
+#define GRALLOC_DRM_TRACE_END(point) do { } while (0)
+
+#endif /* ENABLE_TRACE */
+
+#endif /* _GRALLOC_DRM_TRACE_H_ */
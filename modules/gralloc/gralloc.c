@@ -37,6 +37,19 @@ enum {
 
 	GRALLOC_MODULE_PERFORM_ENTER_VT                  = 0x080000005,
 	GRALLOC_MODULE_PERFORM_LEAVE_VT                  = 0x080000006,
+
+	GRALLOC_MODULE_PERFORM_TRIM                      = 0x080000007,
+	GRALLOC_MODULE_PERFORM_SYNC_BUFFER               = 0x080000008,
+	GRALLOC_MODULE_PERFORM_TRYLOCK                   = 0x080000009,
+	GRALLOC_MODULE_PERFORM_LOCK_ASYNC                = 0x08000000a,
+	GRALLOC_MODULE_PERFORM_GET_MEM_INFO              = 0x08000000b,
+	GRALLOC_MODULE_PERFORM_SET_MEM_PRESSURE_CALLBACK = 0x08000000c,
+	GRALLOC_MODULE_PERFORM_DUMP                      = 0x08000000d,
+	GRALLOC_MODULE_PERFORM_SET_TRACE_MODE            = 0x08000000e,
+	GRALLOC_MODULE_PERFORM_GET_TRACE_STATS           = 0x08000000f,
+	GRALLOC_MODULE_PERFORM_LOCK_YCBCR                = 0x080000010,
+	GRALLOC_MODULE_PERFORM_SET_DAMAGE                = 0x080000011,
+	GRALLOC_MODULE_PERFORM_SET_RELEASE_CALLBACK      = 0x080000012,
 };
 
 /*
@@ -48,7 +61,8 @@ static int drm_init(struct drm_module_t *dmod, int kms)
 
 	pthread_mutex_lock(&dmod->mutex);
 	if (!dmod->drm) {
-		dmod->drm = gralloc_drm_create();
+		/* only the display needs the primary node */
+		dmod->drm = gralloc_drm_create(kms);
 		if (!dmod->drm)
 			err = -EINVAL;
 	}
@@ -102,6 +116,159 @@ static int drm_mod_perform(const struct gralloc_module_t *mod, int op, ...)
 			err = 0;
 		}
 		break;
+	/* release the memory held by the caches and the warm pool */
+	case GRALLOC_MODULE_PERFORM_TRIM:
+		{
+			gralloc_drm_bo_pool_trim(dmod->drm);
+			gralloc_drm_bo_cache_trim(dmod->drm);
+			gralloc_drm_map_cache_trim(dmod->drm);
+			err = 0;
+		}
+		break;
+	/* clean or invalidate the CPU caches for a rect of a locked buffer */
+	case GRALLOC_MODULE_PERFORM_SYNC_BUFFER:
+		{
+			buffer_handle_t handle = va_arg(args, buffer_handle_t);
+			int flags = va_arg(args, int);
+			int x = va_arg(args, int);
+			int y = va_arg(args, int);
+			int w = va_arg(args, int);
+			int h = va_arg(args, int);
+			struct gralloc_drm_bo_t *bo;
+
+			bo = gralloc_drm_bo_from_handle(handle);
+			err = (bo) ? gralloc_drm_bo_sync(bo, flags,
+					x, y, w, h) : -EINVAL;
+		}
+		break;
+	/*
+	 * lock without waiting for the GPU: TRYLOCK fails with -EBUSY, and
+	 * LOCK_ASYNC returns a fence to wait for before touching the buffer
+	 */
+	case GRALLOC_MODULE_PERFORM_TRYLOCK:
+	case GRALLOC_MODULE_PERFORM_LOCK_ASYNC:
+		{
+			buffer_handle_t handle = va_arg(args, buffer_handle_t);
+			int usage = va_arg(args, int);
+			int x = va_arg(args, int);
+			int y = va_arg(args, int);
+			int w = va_arg(args, int);
+			int h = va_arg(args, int);
+			void **addr = va_arg(args, void **);
+			int *fence_fd = NULL;
+			int flags = GRALLOC_DRM_LOCK_NONBLOCK;
+			struct gralloc_drm_bo_t *bo;
+
+			if (op == GRALLOC_MODULE_PERFORM_LOCK_ASYNC) {
+				fence_fd = va_arg(args, int *);
+				flags = GRALLOC_DRM_LOCK_ASYNC;
+			}
+
+			bo = gralloc_drm_bo_from_handle(handle);
+			err = (bo) ? gralloc_drm_bo_lock_flags(bo, usage,
+					x, y, w, h, flags, addr,
+					fence_fd) : -EINVAL;
+		}
+		break;
+	case GRALLOC_MODULE_PERFORM_GET_MEM_INFO:
+		{
+			struct gralloc_drm_mem_info *info =
+				va_arg(args, struct gralloc_drm_mem_info *);
+			gralloc_drm_get_mem_info(dmod->drm, info);
+			err = 0;
+		}
+		break;
+	/* called back to release memory before an allocation would fail */
+	case GRALLOC_MODULE_PERFORM_SET_MEM_PRESSURE_CALLBACK:
+		{
+			gralloc_drm_mem_pressure_t callback =
+				va_arg(args, gralloc_drm_mem_pressure_t);
+			void *data = va_arg(args, void *);
+			gralloc_drm_set_mem_pressure_callback(dmod->drm,
+					callback, data);
+			err = 0;
+		}
+		break;
+	/*
+	 * write a text report of all buffers of the process; the length of
+	 * the whole report is returned so that a truncated one can be retried
+	 */
+	case GRALLOC_MODULE_PERFORM_DUMP:
+		{
+			char *buf = va_arg(args, char *);
+			int len = va_arg(args, int);
+			int *needed = va_arg(args, int *);
+			int n;
+
+			n = gralloc_drm_dump(dmod->drm, buf, len);
+			if (needed)
+				*needed = n + 1;
+			err = 0;
+		}
+		break;
+	/* GRALLOC_DRM_TRACE_* mode, overriding debug.drm.trace */
+	case GRALLOC_MODULE_PERFORM_SET_TRACE_MODE:
+		{
+			int mode = va_arg(args, int);
+			err = gralloc_drm_trace_set_mode(mode);
+		}
+		break;
+	/* latency histograms of the hot paths, indexed by GRALLOC_DRM_TRACE_* */
+	case GRALLOC_MODULE_PERFORM_GET_TRACE_STATS:
+		{
+			struct gralloc_drm_trace_stats *stats =
+				va_arg(args, struct gralloc_drm_trace_stats *);
+			int count = va_arg(args, int);
+			int *written = va_arg(args, int *);
+			int n;
+
+			n = gralloc_drm_trace_get_stats(stats, count);
+			if (written)
+				*written = n;
+			err = 0;
+		}
+		break;
+	/* lock_ycbcr for platforms whose gralloc_module_t lacks it */
+	case GRALLOC_MODULE_PERFORM_LOCK_YCBCR:
+		{
+			buffer_handle_t handle = va_arg(args, buffer_handle_t);
+			int usage = va_arg(args, int);
+			int x = va_arg(args, int);
+			int y = va_arg(args, int);
+			int w = va_arg(args, int);
+			int h = va_arg(args, int);
+			struct gralloc_drm_ycbcr *ycbcr =
+				va_arg(args, struct gralloc_drm_ycbcr *);
+			struct gralloc_drm_bo_t *bo;
+
+			bo = gralloc_drm_bo_from_handle(handle);
+			err = (bo) ? gralloc_drm_bo_lock_ycbcr(bo, usage,
+					x, y, w, h, ycbcr) : -EINVAL;
+		}
+		break;
+	/*
+	 * the rects of the framebuffer that the next post changes, so that
+	 * only they are copied to the screen; NULL for the whole framebuffer
+	 */
+	case GRALLOC_MODULE_PERFORM_SET_DAMAGE:
+		{
+			const struct gralloc_drm_rect *rects =
+				va_arg(args, const struct gralloc_drm_rect *);
+			int count = va_arg(args, int);
+			err = gralloc_drm_set_damage(dmod->drm, rects, count);
+		}
+		break;
+	/* called back when a posted buffer has been presented */
+	case GRALLOC_MODULE_PERFORM_SET_RELEASE_CALLBACK:
+		{
+			gralloc_drm_release_t callback =
+				va_arg(args, gralloc_drm_release_t);
+			void *data = va_arg(args, void *);
+			gralloc_drm_set_release_callback(dmod->drm,
+					callback, data);
+			err = 0;
+		}
+		break;
 	default:
 		err = -EINVAL;
 		break;
@@ -142,6 +309,22 @@ static int drm_mod_lock(const gralloc_module_t *mod, buffer_handle_t handle,
 	return gralloc_drm_bo_lock(bo, usage, x, y, w, h, ptr);
 }
 
+#ifdef GRALLOC_MODULE_API_VERSION_0_2
+static int drm_mod_lock_ycbcr(const gralloc_module_t *mod,
+		buffer_handle_t handle, int usage, int x, int y, int w, int h,
+		struct android_ycbcr *ycbcr)
+{
+	struct gralloc_drm_bo_t *bo;
+
+	bo = gralloc_drm_bo_from_handle(handle);
+	if (!bo)
+		return -EINVAL;
+
+	return gralloc_drm_bo_lock_ycbcr(bo, usage, x, y, w, h,
+			(struct gralloc_drm_ycbcr *) ycbcr);
+}
+#endif
+
 static int drm_mod_unlock(const gralloc_module_t *mod, buffer_handle_t handle)
 {
 	struct gralloc_drm_bo_t *bo;
@@ -172,8 +355,7 @@ static int drm_mod_free_gpu0(alloc_device_t *dev, buffer_handle_t handle)
 	if (!bo)
 		return -EINVAL;
 
-	if (gralloc_drm_bo_need_fb(bo))
-		gralloc_drm_bo_rm_fb(bo);
+	/* the fb is kept while the bo is in the bo cache */
 	gralloc_drm_bo_destroy(bo);
 
 	return 0;
@@ -204,6 +386,12 @@ static int drm_mod_alloc_gpu0(alloc_device_t *dev,
 		}
 	}
 
+	err = gralloc_drm_bo_export(bo);
+	if (err) {
+		gralloc_drm_bo_destroy(bo);
+		return err;
+	}
+
 	*handle = gralloc_drm_bo_get_handle(bo, stride);
 	/* in pixels */
 	*stride /= bpp;
@@ -344,8 +532,12 @@ struct drm_module_t HAL_MODULE_INFO_SYM = {
 	.base = {
 		.common = {
 			.tag = HARDWARE_MODULE_TAG,
+#ifdef GRALLOC_MODULE_API_VERSION_0_2
+			.module_api_version = GRALLOC_MODULE_API_VERSION_0_2,
+#else
 			.version_major = 1,
 			.version_minor = 0,
+#endif
 			.id = GRALLOC_HARDWARE_MODULE_ID,
 			.name = "DRM Memory Allocator",
 			.author = "Chia-I Wu",
@@ -355,7 +547,10 @@ struct drm_module_t HAL_MODULE_INFO_SYM = {
 		.unregisterBuffer = drm_mod_unregister_buffer,
 		.lock = drm_mod_lock,
 		.unlock = drm_mod_unlock,
-		.perform = drm_mod_perform
+		.perform = drm_mod_perform,
+#ifdef GRALLOC_MODULE_API_VERSION_0_2
+		.lock_ycbcr = drm_mod_lock_ycbcr,
+#endif
 	},
 	.mutex = PTHREAD_MUTEX_INITIALIZER,
 	.drm = NULL
@@ -169,7 +169,9 @@ drm_open(struct hwc_context_t *ctx)
 
 	ctx->drm_module = module;
 
-	ctx->drm_fd = module->drm->fd;
+	ctx->drm_fd = gralloc_drm_get_kms_fd(module->drm);
+	if (ctx->drm_fd < 0)
+		return ctx->drm_fd;
 
 	version = drmGetVersion(ctx->drm_fd);
 	if (!version) {